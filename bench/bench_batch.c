@@ -0,0 +1,216 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Batching benchmark: compares the instructions per second of a CPU at
+ * SPEED_UNLIMITED driven by tamalib_mainloop(), with a HAL polling the inputs
+ * and reading the clock around every instruction as a single-emulator
+ * frontend does, to those of a session run by the scheduler in batches.
+ *
+ * Usage: bench_batch ROM_FILE [DURATION_S]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64singleline.h"
+#include "metrics.h"
+#include "romcache.h"
+#include "scheduler.h"
+#include "session.h"
+
+#define BATCH_CHECK_PERIOD 65536
+// Number of handler calls between two checks of the run duration
+
+static double g_duration;
+static uint64_t g_handler_calls;
+static uint64_t g_handler_end;
+
+static double clock_s(clockid_t clock)
+{
+	struct timespec t;
+
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char * read_rom_b64(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned char rom[ROM_SIZE];
+	size_t rom_size;
+
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	rom_size = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	return (char *) base64singleline_encode(rom, rom_size, NULL);
+}
+
+/* HAL of a single-emulator frontend */
+
+static void hal_halt(void)
+{
+}
+
+static bool_t hal_is_log_enabled(log_level_t level)
+{
+	((void)level);
+	return 0;
+}
+
+static void hal_log(log_level_t level, char *buff, ...)
+{
+	((void)level);
+	((void)buff);
+}
+
+static void hal_sleep_until(timestamp_t ts)
+{
+	((void)ts);
+}
+
+static timestamp_t hal_get_timestamp(void)
+{
+	return scheduler_now();
+}
+
+static void hal_update_screen(void)
+{
+}
+
+static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+{
+	((void)x);
+	((void)y);
+	((void)val);
+}
+
+static void hal_set_lcd_icon(u8_t icon, bool_t val)
+{
+	((void)icon);
+	((void)val);
+}
+
+static void hal_set_frequency(u32_t freq)
+{
+	((void)freq);
+}
+
+static void hal_play_frequency(bool_t en)
+{
+	((void)en);
+}
+
+static int hal_handler(void)
+{
+	tamalib_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_TAP, BTN_STATE_RELEASED);
+
+	if (++g_handler_calls % BATCH_CHECK_PERIOD == 0 && clock_s(CLOCK_MONOTONIC) >= g_duration) {
+		g_handler_end = g_handler_calls;
+		return 1;
+	}
+	return 0;
+}
+
+static hal_t hal = {
+	.halt = &hal_halt,
+	.is_log_enabled = &hal_is_log_enabled,
+	.log = &hal_log,
+	.sleep_until = &hal_sleep_until,
+	.get_timestamp = &hal_get_timestamp,
+	.update_screen = &hal_update_screen,
+	.set_lcd_matrix = &hal_set_lcd_matrix,
+	.set_lcd_icon = &hal_set_lcd_icon,
+	.set_frequency = &hal_set_frequency,
+	.play_frequency = &hal_play_frequency,
+	.handler = &hal_handler,
+};
+
+static void * run_scheduler(void *arg)
+{
+	((void)arg);
+	scheduler_run(1);
+	return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+	pthread_t thread;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s ROM_FILE [DURATION_S]\n", argv[0]);
+		return 1;
+	}
+	char *rom_b64 = read_rom_b64(argv[1]);
+	double duration = (argc > 2) ? atof(argv[2]) : 10;
+	if (rom_b64 == NULL || duration <= 0) {
+		return 1;
+	}
+	rom_t *rom = rom_cache_load_b64(rom_b64);
+	free(rom_b64);
+	if (rom == NULL) {
+		return 1;
+	}
+
+	/* Per-instruction HAL round trips */
+	tamalib_register_hal(&hal);
+	tamalib_init(rom->program, NULL, 1000000);
+	tamalib_set_speed(SPEED_UNLIMITED);
+	double start = clock_s(CLOCK_MONOTONIC);
+	g_duration = start + duration;
+	tamalib_mainloop();
+	double mainloop_ips = g_handler_end / (clock_s(CLOCK_MONOTONIC) - start);
+	tamalib_release();
+
+	/* Batches run by the scheduler */
+	session_init();
+	session_t *s = session_create("bench-batch", rom);
+	rom_release(rom);
+	if (s == NULL) {
+		return 1;
+	}
+	session_set_speed(s, SPEED_UNLIMITED);
+	session_release(s);
+	pthread_create(&thread, NULL, &run_scheduler, NULL);
+
+	/* Let the pet boot before measuring */
+	sleep(1);
+
+	uint64_t instructions = atomic_load(&g_metrics.instructions);
+	start = clock_s(CLOCK_MONOTONIC);
+	usleep(duration * 1e6);
+	double batch_ips = (atomic_load(&g_metrics.instructions) - instructions) /
+		(clock_s(CLOCK_MONOTONIC) - start);
+
+	printf("mainloop:       %.2f M instructions/s\n", mainloop_ips / 1e6);
+	printf("batched:        %.2f M instructions/s\n", batch_ips / 1e6);
+	printf("speedup:        %.2fx\n", batch_ips / mainloop_ips);
+
+	return 0;
+}
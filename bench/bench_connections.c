@@ -0,0 +1,302 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Connection benchmark: opens N idle WebSocket connections to an in-process
+ * server, and reports the memory and threads used per connection, and how
+ * many connections could be opened. The server is either the epoll reactor
+ * (see reactor.h), or a thread-per-connection server, like the wsServer
+ * loop it replaced.
+ *
+ * Usage: bench_connections [reactor|threads] [N_CONNECTIONS] [PORT]
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reactor.h"
+
+#define BENCH_CLIENTS_PER_ADDRESS 20000
+// Client connections bound to each source address (127.1.x.y), which stays
+// below the number of ephemeral ports.
+
+static const char HANDSHAKE_REQUEST[] =
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+static const char HANDSHAKE_RESPONSE[] =
+	"HTTP/1.1 101 Switching Protocols\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+	"\r\n";
+
+typedef struct {
+	long rss_kib;
+	long vm_kib;
+	long threads;
+} usage_t;
+
+/**
+ * @brief Read the memory and threads used by the process
+ *
+ * @param fd /proc/self/status, opened before the file descriptors run out
+ */
+static void get_usage(int fd, usage_t *u)
+{
+	char status[4096];
+
+	memset(u, 0, sizeof(*u));
+	ssize_t n = pread(fd, status, sizeof(status) - 1, 0);
+	if (n <= 0) {
+		return;
+	}
+	status[n] = '\0';
+	for (char *line = status; line != NULL; line = strchr(line, '\n')) {
+		line += (*line == '\n');
+		sscanf(line, "VmRSS: %ld", &u->rss_kib);
+		sscanf(line, "VmSize: %ld", &u->vm_kib);
+		sscanf(line, "Threads: %ld", &u->threads);
+	}
+}
+
+/* Thread-per-connection server */
+
+static int read_request(int fd)
+{
+	char buffer[1024];
+	size_t size = 0;
+
+	while (size < sizeof(buffer) - 1) {
+		ssize_t n = recv(fd, buffer + size, sizeof(buffer) - 1 - size, 0);
+		if (n <= 0) {
+			return 1;
+		}
+		size += n;
+		buffer[size] = '\0';
+		if (strstr(buffer, "\r\n\r\n") != NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void * connection_thread(void *arg)
+{
+	int fd = (int) (intptr_t) arg;
+	char buffer[1024];
+
+	if (read_request(fd) == 0 &&
+		send(fd, HANDSHAKE_RESPONSE, sizeof(HANDSHAKE_RESPONSE) - 1, 0) > 0) {
+		while (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void * accept_thread(void *arg)
+{
+	int server_fd = (int) (intptr_t) arg;
+	pthread_t thread;
+
+	for (;;) {
+		int fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&thread, NULL, &connection_thread, (void *) (intptr_t) fd)) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int start_threads_server(uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int reuse = 1;
+	pthread_t thread;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+		perror("bind");
+		return 1;
+	}
+	return pthread_create(&thread, NULL, &accept_thread, (void *) (intptr_t) fd);
+}
+
+/* Reactor */
+
+static void on_open(ws_cli_conn_t client)
+{
+	((void)client);
+}
+
+static void on_close(ws_cli_conn_t client)
+{
+	((void)client);
+}
+
+static void on_message(ws_cli_conn_t client, const unsigned char *msg,
+	uint64_t size, int type)
+{
+	((void)client);
+	((void)msg);
+	((void)size);
+	((void)type);
+}
+
+/* Clients */
+
+/**
+ * @brief Open a connection, and complete its handshake
+ *
+ * @return the socket, or -1 on failure
+ */
+static int open_client(uint16_t port, int i)
+{
+	struct sockaddr_in source = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(0x7F010000 + 1 + i / BENCH_CLIENTS_PER_ADDRESS),
+	};
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct timeval timeout = {.tv_sec = 5};
+	const int one = 1;
+	char buffer[256];
+	size_t size = 0;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	/* The port is chosen on connect, and can be reused across destinations */
+	setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &source, sizeof(source)) ||
+		connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+		send(fd, HANDSHAKE_REQUEST, sizeof(HANDSHAKE_REQUEST) - 1, 0) < 0) {
+		goto fail;
+	}
+	while (size < sizeof(buffer) - 1) {
+		ssize_t n = recv(fd, buffer + size, sizeof(buffer) - 1 - size, 0);
+		if (n <= 0) {
+			goto fail;
+		}
+		size += n;
+		buffer[size] = '\0';
+		if (strstr(buffer, "\r\n\r\n") != NULL) {
+			return strncmp(buffer, "HTTP/1.1 101", 12) ? (close(fd), -1) : fd;
+		}
+	}
+
+	fail:
+		close(fd);
+		return -1;
+}
+
+int main(int argc, const char *argv[])
+{
+	usage_t before;
+	usage_t after;
+	struct rlimit limit;
+
+	const char *mode = (argc > 1) ? argv[1] : "reactor";
+	int n_clients = (argc > 2) ? atoi(argv[2]) : 10000;
+	uint16_t port = (argc > 3) ? atoi(argv[3]) : 18080;
+	if (n_clients < 1 || (strcmp(mode, "reactor") && strcmp(mode, "threads"))) {
+		fprintf(stderr, "Usage: %s [reactor|threads] [N_CONNECTIONS] [PORT]\n", argv[0]);
+		return 1;
+	}
+	int *clients = malloc(n_clients * sizeof(int));
+	int status_fd = open("/proc/self/status", O_RDONLY);
+	if (clients == NULL || status_fd < 0) {
+		return 1;
+	}
+
+	/* Each connection uses two file descriptors in this process */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	if (!strcmp(mode, "reactor")) {
+		const reactor_events_t events = {
+			.onopen = &on_open,
+			.onclose = &on_close,
+			.onmessage = &on_message,
+		};
+		if (reactor_init("127.0.0.1", port, REACTOR_DEFAULT_THREADS, &events)) {
+			return 1;
+		}
+	} else if (start_threads_server(port)) {
+		return 1;
+	}
+	sleep(1);
+	get_usage(status_fd, &before);
+
+	int n_open = 0;
+	while (n_open < n_clients && (clients[n_open] = open_client(port, n_open)) >= 0) {
+		n_open++;
+	}
+	/* Let the server settle */
+	sleep(1);
+	get_usage(status_fd, &after);
+
+	printf("server:              %s\n", mode);
+	printf("connections:         %d of %d%s\n", n_open, n_clients,
+		(n_open < n_clients) ? " (limit reached)" : "");
+	printf("file limit:          %llu\n", (unsigned long long) limit.rlim_cur);
+	if (n_open > 0) {
+		printf("threads:             %ld -> %ld\n", before.threads, after.threads);
+		printf("RSS per connection:  %.2f KiB\n", (double) (after.rss_kib - before.rss_kib) / n_open);
+		printf("VSZ per connection:  %.2f KiB\n", (double) (after.vm_kib - before.vm_kib) / n_open);
+	}
+
+	for (int i = 0; i < n_open; i++) {
+		close(clients[i]);
+	}
+	free(clients);
+	return 0;
+}
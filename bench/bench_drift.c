@@ -0,0 +1,162 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Drift benchmark: runs N sessions at 1x speed, and reports how far their
+ * emulated time moves away from the wall clock (a 1x CPU runs TICK_FREQUENCY
+ * clock cycles per second). The error is printed every tenth of the run, and
+ * extrapolated to 24 h.
+ *
+ * Usage: bench_drift ROM_FILE [DURATION_S] [N_PETS]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "base64singleline.h"
+#include "romcache.h"
+#include "scheduler.h"
+#include "session.h"
+
+#define DRIFT_REPORTS 10
+// Number of error reports during a run
+
+#define DRIFT_SETTLE_US 20000
+// Time given to the woken pets to catch up with the wall clock before sampling
+
+static char * read_rom_b64(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned char rom[ROM_SIZE];
+	size_t rom_size;
+
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	rom_size = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	return (char *) base64singleline_encode(rom, rom_size, NULL);
+}
+
+static void * run_scheduler(void *arg)
+{
+	((void)arg);
+	scheduler_run(1);
+	return NULL;
+}
+
+/**
+ * @brief Sample the CPU clock cycles emulated by each pet
+ *
+ * Headless pets only run once per SESSION_HEADLESS_PERIOD_US, so they are woken
+ * first for their count to match the returned wall clock within a few
+ * milliseconds.
+ *
+ * @param ticks array of n_pets counts to fill
+ * @param n_pets number of pets
+ * @return wall clock at which the pets were woken, in microseconds
+ */
+static uint64_t sample_ticks(uint64_t *ticks, int n_pets)
+{
+	char id[SESSION_ID_SIZE];
+	uint64_t now = scheduler_now_us();
+
+	for (int i = 0; i < n_pets; i++) {
+		snprintf(id, sizeof(id), "drift-%d", i);
+		session_t *s = session_find(id);
+		scheduler_wake(s);
+		session_release(s);
+	}
+	usleep(DRIFT_SETTLE_US);
+	for (int i = 0; i < n_pets; i++) {
+		snprintf(id, sizeof(id), "drift-%d", i);
+		session_t *s = session_find(id);
+		ticks[i] = atomic_load_explicit(&s->ticks, memory_order_relaxed);
+		session_release(s);
+	}
+	return now;
+}
+
+int main(int argc, const char *argv[])
+{
+	pthread_t thread;
+	char id[SESSION_ID_SIZE];
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s ROM_FILE [DURATION_S] [N_PETS]\n", argv[0]);
+		return 1;
+	}
+	char *rom_b64 = read_rom_b64(argv[1]);
+	double duration = (argc > 2) ? atof(argv[2]) : 86400;
+	int n_pets = (argc > 3) ? atoi(argv[3]) : 1;
+	if (rom_b64 == NULL || duration <= 0 || n_pets < 1 || n_pets > SESSION_MAX) {
+		return 1;
+	}
+
+	session_init();
+	rom_t *rom = rom_cache_load_b64(rom_b64);
+	free(rom_b64);
+	if (rom == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < n_pets; i++) {
+		snprintf(id, sizeof(id), "drift-%d", i);
+		session_release(session_create(id, rom));
+	}
+	rom_release(rom);
+	pthread_create(&thread, NULL, &run_scheduler, NULL);
+
+	/* Let the pets boot before measuring */
+	sleep(1);
+
+	uint64_t *ticks_start = calloc(n_pets, sizeof(uint64_t));
+	uint64_t *ticks = calloc(n_pets, sizeof(uint64_t));
+	/* The first quantum after the boot may still be catching up */
+	sample_ticks(ticks_start, n_pets);
+	uint64_t wall_start = sample_ticks(ticks_start, n_pets);
+
+	printf("%12s %14s %12s %14s\n", "wall (s)", "error (ms)", "error (ppm)", "24 h (s)");
+	for (int r = 1; r <= DRIFT_REPORTS; r++) {
+		usleep(duration * 1e6 / DRIFT_REPORTS);
+
+		/* The worst pet is reported, the error being positive when the
+		 * emulated time is ahead of the wall clock
+		 */
+		double wall = (sample_ticks(ticks, n_pets) - wall_start) * 1e-6;
+		double error = 0;
+		for (int i = 0; i < n_pets; i++) {
+			double emulated = (double) (ticks[i] - ticks_start[i]) / TICK_FREQUENCY;
+			if (fabs(emulated - wall) >= fabs(error)) {
+				error = emulated - wall;
+			}
+		}
+		printf("%12.1f %14.3f %12.1f %14.3f\n", wall, error * 1e3,
+			error / wall * 1e6, error / wall * 86400);
+		fflush(stdout);
+	}
+	free(ticks_start);
+	free(ticks);
+
+	return 0;
+}
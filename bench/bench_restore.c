@@ -0,0 +1,206 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Store restore benchmark: fills a session store with N sessions running the
+ * same ROM, then reopens it in a new process, as the server does when it
+ * starts, and reports how long the sessions take to be restored and how much
+ * disk space the store uses.
+ *
+ * The restored sessions are not started, since the store may hold more
+ * sessions than SESSION_MAX: each one only takes a reference to its ROM and
+ * copies its state save, as session_restore does.
+ *
+ * Usage: bench_restore ROM_FILE [N_PETS] [STORE_DIR]
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "romcache.h"
+#include "session.h"
+#include "state.h"
+#include "store.h"
+
+static const char *g_dir;
+static const char *g_rom_path;
+static int g_n_pets;
+static rom_t *g_rom = NULL;
+static uint8_t g_state[STATE_SIZE];
+
+static double clock_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int restore_session(const char *id, rom_t *rom, const uint8_t *state,
+	size_t state_size)
+{
+	((void)id);
+	if (g_rom == NULL) {
+		rom_acquire(rom);
+		g_rom = rom;
+	}
+	if (state != NULL && state_size == STATE_SIZE) {
+		memcpy(g_state, state, STATE_SIZE);
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the sessions to the store, and wait until they are on disk
+ */
+static int fill_store(void)
+{
+	char id[SESSION_ID_SIZE];
+
+	logger_init();
+	rom_t *rom = rom_cache_load_file(g_rom_path);
+	if (rom == NULL || store_init(g_dir)) {
+		return 1;
+	}
+	double start = clock_s();
+	for (int i = 0; i < g_n_pets; i++) {
+		snprintf(id, sizeof(id), "restore-%d", i);
+		memset(g_state, i & 0xFF, STATE_SIZE);
+		store_put_rom(id, rom);
+		store_put_state(id, g_state, STATE_SIZE);
+	}
+	store_flush();
+	printf("stored %d sessions in %.2f s\n", g_n_pets, clock_s() - start);
+	return 0;
+}
+
+/**
+ * @brief Restore the sessions of the store, as the server does when it starts
+ */
+static int restore_store(void)
+{
+	logger_init();
+	double start = clock_s();
+	if (store_init(g_dir)) {
+		return 1;
+	}
+	unsigned int n = store_restore(&restore_session);
+	double elapsed = clock_s() - start;
+	printf("restored %u sessions in %.1f ms (%.2f us per session)\n", n,
+		elapsed * 1e3, elapsed * 1e6 / (n ? n : 1));
+	return n != (unsigned int) g_n_pets;
+}
+
+/**
+ * @brief Run a phase in a child process, which has its own store
+ *
+ * @return 0 if the phase succeeded, 1 otherwise
+ */
+static int run_child(int (*phase)(void))
+{
+	int status;
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		exit(phase());
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+		return 1;
+	}
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/**
+ * @brief Print the number of files of the store and the disk space they use
+ *
+ * @param remove remove the files after counting them
+ */
+static void report_store(const char *dir, bool remove)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	unsigned int n_files = 0;
+	unsigned long long disk_size = 0;
+
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		return;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) == 0) {
+			n_files++;
+			disk_size += (unsigned long long) st.st_blocks * 512;
+		}
+		if (remove) {
+			unlink(path);
+		}
+	}
+	closedir(d);
+	if (!remove) {
+		printf("store: %u files, %.1f MB on disk\n", n_files, disk_size / 1e6);
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	char tmp_dir[] = "/tmp/bench_restore.XXXXXX";
+	int status = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s ROM_FILE [N_PETS] [STORE_DIR]\n", argv[0]);
+		return 1;
+	}
+	g_rom_path = argv[1];
+	g_n_pets = (argc > 2) ? atoi(argv[2]) : 10000;
+	if (g_n_pets < 1 || g_n_pets > STORE_ARENA_SLOTS) {
+		fprintf(stderr, "N_PETS must be between 1 and %d\n", STORE_ARENA_SLOTS);
+		return 1;
+	}
+	g_dir = (argc > 3) ? argv[3] : mkdtemp(tmp_dir);
+	if (g_dir == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	if (run_child(&fill_store) == 0) {
+		report_store(g_dir, false);
+		status = run_child(&restore_store);
+	}
+
+	if (argc <= 3) {
+		report_store(g_dir, true);
+		rmdir(g_dir);
+	}
+	return status;
+}
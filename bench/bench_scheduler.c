@@ -0,0 +1,131 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Scheduler benchmark: runs N sessions at 1x speed on a single scheduler
+ * worker, and reports how many 1x pets one core can sustain.
+ *
+ * Usage: bench_scheduler ROM_FILE [N_PETS] [DURATION_S]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64singleline.h"
+#include "romcache.h"
+#include "scheduler.h"
+#include "session.h"
+
+static double clock_s(clockid_t clock)
+{
+	struct timespec t;
+
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char * read_rom_b64(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned char rom[ROM_SIZE];
+	size_t rom_size;
+
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	rom_size = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	return (char *) base64singleline_encode(rom, rom_size, NULL);
+}
+
+static void * run_scheduler(void *arg)
+{
+	((void)arg);
+	scheduler_run(1);
+	return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+	pthread_t thread;
+	char id[SESSION_ID_SIZE];
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s ROM_FILE [N_PETS] [DURATION_S]\n", argv[0]);
+		return 1;
+	}
+	char *rom_b64 = read_rom_b64(argv[1]);
+	int n_pets = (argc > 2) ? atoi(argv[2]) : 100;
+	double duration = (argc > 3) ? atof(argv[3]) : 10;
+	if (rom_b64 == NULL || n_pets < 1 || n_pets > SESSION_MAX) {
+		return 1;
+	}
+
+	session_init();
+	rom_t *rom = rom_cache_load_b64(rom_b64);
+	free(rom_b64);
+	if (rom == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < n_pets; i++) {
+		snprintf(id, sizeof(id), "bench-%d", i);
+		session_release(session_create(id, rom));
+	}
+	rom_release(rom);
+	pthread_create(&thread, NULL, &run_scheduler, NULL);
+
+	/* Let the pets boot before measuring */
+	sleep(1);
+
+	double wall_start = clock_s(CLOCK_MONOTONIC);
+	double cpu_start = clock_s(CLOCK_PROCESS_CPUTIME_ID);
+	usleep(duration * 1e6);
+	double wall = clock_s(CLOCK_MONOTONIC) - wall_start;
+	double cpu = clock_s(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+	/* Emulated time lagging behind the wall clock means the core is
+	 * saturated, and that the measured load underestimates the real cost.
+	 */
+	timestamp_t now = scheduler_now();
+	int32_t max_lag = 0;
+	for (int i = 0; i < n_pets; i++) {
+		snprintf(id, sizeof(id), "bench-%d", i);
+		session_t *s = session_find(id);
+		int32_t lag = (int32_t) (now - s->deadline);
+		if (lag > max_lag) {
+			max_lag = lag;
+		}
+		session_release(s);
+	}
+
+	double load = cpu / wall;
+	printf("pets:           %d\n", n_pets);
+	printf("duration:       %.1f s\n", wall);
+	printf("core load:      %.1f %%\n", load * 100);
+	printf("max lag:        %.1f ms\n", max_lag / 1e3);
+	printf("pets per core:  %.0f%s\n", n_pets / load,
+		(max_lag > 2 * 1000000 / SESSION_FRAMERATE) ? " (saturated, retry with fewer pets)" : "");
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Screen encoding microbenchmark: compares the encoding of scr events by
+ * screen_pack_screen and screen_encode_json to the original implementation,
+ * which packed the pixels one by one and allocated the intermediate buffers.
+ *
+ * Usage: bench_screen [N_ITERATIONS]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64singleline.h"
+#include "screen.h"
+
+#define N_SCREENS 64
+
+static bool_t matrices[N_SCREENS][LCD_HEIGHT][LCD_WIDTH];
+static bool_t icons[N_SCREENS][ICON_NUM];
+
+static double clock_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Original implementation */
+
+static unsigned char * bool_t_to_base64(const bool_t *src, const size_t len,
+	size_t *out_len)
+{
+	size_t new_len = len / 8;
+	unsigned char * new_arr = malloc(new_len);
+	for (int i = 0; i < new_len; i++) {
+		new_arr[i] = 0;
+		for (int j = 0; j < 8; j++) {
+            new_arr[i] |= src[i*8+(7-j)] << j;
+		}
+	}
+	unsigned char *out = base64singleline_encode(new_arr, new_len, out_len);
+	free(new_arr);
+	return out;
+}
+
+static size_t encode_reference(const bool_t matrix[LCD_HEIGHT][LCD_WIDTH],
+	const bool_t icon[ICON_NUM], char *msg)
+{
+	const size_t msg_size = 124;
+	char msg_template[] = "{\"t\":\"scr\",\"e\":{\"m\":\"%s\",\"i\":\"%s\"}}";
+	unsigned char *matrix_b64 = bool_t_to_base64((bool_t *)matrix, LCD_HEIGHT * LCD_WIDTH, NULL);
+	unsigned char *icon_b64 = bool_t_to_base64(icon, ICON_NUM, NULL);
+	snprintf(msg, msg_size, msg_template, matrix_b64, icon_b64);
+	free(matrix_b64);
+	free(icon_b64);
+	return msg_size - 1;
+}
+
+/* Current implementation */
+
+static size_t encode_current(const bool_t matrix[LCD_HEIGHT][LCD_WIDTH],
+	const bool_t icon[ICON_NUM], char *msg)
+{
+	uint8_t screen[SCREEN_SIZE];
+
+	screen_pack_screen(matrix, icon, screen);
+	return screen_encode_json(screen, NULL, msg);
+}
+
+static double run(size_t (*encode)(const bool_t[LCD_HEIGHT][LCD_WIDTH],
+	const bool_t[ICON_NUM], char *), long n_iterations, size_t *checksum)
+{
+	char msg[SCREEN_JSON_MAX_SIZE];
+
+	double start = clock_s();
+	for (long i = 0; i < n_iterations; i++) {
+		size_t k = i % N_SCREENS;
+		*checksum += encode(matrices[k], icons[k], msg);
+		*checksum += (unsigned char) msg[40];
+	}
+	return clock_s() - start;
+}
+
+int main(int argc, const char *argv[])
+{
+	long n_iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+	char msg_reference[SCREEN_JSON_MAX_SIZE];
+	char msg_current[SCREEN_JSON_MAX_SIZE];
+	size_t checksum_reference = 0;
+	size_t checksum_current = 0;
+
+	srand(0);
+	for (int k = 0; k < N_SCREENS; k++) {
+		for (int y = 0; y < LCD_HEIGHT; y++) {
+			for (int x = 0; x < LCD_WIDTH; x++) {
+				matrices[k][y][x] = rand() & 1;
+			}
+		}
+		for (int i = 0; i < ICON_NUM; i++) {
+			icons[k][i] = rand() & 1;
+		}
+		encode_reference(matrices[k], icons[k], msg_reference);
+		encode_current(matrices[k], icons[k], msg_current);
+		if (strcmp(msg_reference, msg_current) != 0) {
+			fprintf(stderr, "Mismatch for screen %d:\n%s\n%s\n", k, msg_reference, msg_current);
+			return 1;
+		}
+	}
+
+	double t_reference = run(&encode_reference, n_iterations, &checksum_reference);
+	double t_current = run(&encode_current, n_iterations, &checksum_current);
+
+	printf("iterations:     %ld\n", n_iterations);
+	printf("reference:      %.1f ns/frame\n", t_reference / n_iterations * 1e9);
+	printf("current:        %.1f ns/frame\n", t_current / n_iterations * 1e9);
+	printf("speedup:        %.1fx\n", t_reference / t_current);
+
+	return checksum_reference != checksum_current;
+}
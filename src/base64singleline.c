@@ -35,36 +35,27 @@
 static const unsigned char base64_table[65] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+#include "base64singleline.h"
+
 /**
- * base64singleline_encode - Base64 encode without newlines
+ * base64singleline_encode_to - Base64 encode without newlines to a buffer
  * @src: Data to be encoded
  * @len: Length of the data to be encoded
- * @out_len: Pointer to output length variable, or %NULL if not used
- * Returns: Allocated buffer of out_len bytes of encoded data,
- * or %NULL on failure
+ * @dst: Output buffer, of at least BASE64SINGLELINE_SIZE(len) + 1 bytes
+ * Returns: Length of the encoded data
  *
- * Caller is responsible for freeing the returned buffer. Returned buffer is
- * nul terminated to make it easier to use as a C string. The nul terminator is
- * not included in out_len.
+ * The output is nul terminated. The nul terminator is not included in the
+ * returned length.
  */
-unsigned char * base64singleline_encode(const unsigned char *src, size_t len,
-			      size_t *out_len)
+size_t base64singleline_encode_to(const unsigned char *src, size_t len,
+			      char *dst)
 {
-	unsigned char *out, *pos;
+	char *pos;
 	const unsigned char *end, *in;
-	size_t olen;
-
-	olen = len * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
-	olen++; /* nul termination */
-	if (olen < len)
-		return NULL; /* integer overflow */
-	out = malloc(olen);
-	if (out == NULL)
-		return NULL;
 
 	end = src + len;
 	in = src;
-	pos = out;
+	pos = dst;
 	while (end - in >= 3) {
 		*pos++ = base64_table[in[0] >> 2];
 		*pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
@@ -87,7 +78,37 @@ unsigned char * base64singleline_encode(const unsigned char *src, size_t len,
 	}
 
 	*pos = '\0';
+	return pos - dst;
+}
+
+/**
+ * base64singleline_encode - Base64 encode without newlines
+ * @src: Data to be encoded
+ * @len: Length of the data to be encoded
+ * @out_len: Pointer to output length variable, or %NULL if not used
+ * Returns: Allocated buffer of out_len bytes of encoded data,
+ * or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned buffer. Returned buffer is
+ * nul terminated to make it easier to use as a C string. The nul terminator is
+ * not included in out_len.
+ */
+unsigned char * base64singleline_encode(const unsigned char *src, size_t len,
+			      size_t *out_len)
+{
+	unsigned char *out;
+	size_t olen, elen;
+
+	olen = len * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
+	olen++; /* nul termination */
+	if (olen < len)
+		return NULL; /* integer overflow */
+	out = malloc(olen);
+	if (out == NULL)
+		return NULL;
+
+	elen = base64singleline_encode_to(src, len, (char *) out);
 	if (out_len)
-		*out_len = pos - out;
+		*out_len = elen;
 	return out;
 }
@@ -20,7 +20,14 @@
 #ifndef BASE64SINGLELINE_H
 #define BASE64SINGLELINE_H
 
+#include <stddef.h>
+
+#define BASE64SINGLELINE_SIZE(len) (((len) + 2) / 3 * 4)
+// Length of the base64 encoding of len bytes, excluding the string terminator.
+
 unsigned char * base64singleline_encode(const unsigned char *src, size_t len,
 			      size_t *out_len);
+size_t base64singleline_encode_to(const unsigned char *src, size_t len,
+			      char *dst);
 
 #endif //BASE64SINGLELINE_H
@@ -0,0 +1,682 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Batch runner: runs emulation scenarios headless, on all cores, and reports
+ * the screens they produced.
+ *
+ * Usage: tama_batch [-j N_WORKERS] [-o OUT_DIR] MANIFEST
+ *
+ * Each line of the manifest is a job: a ROM file, a state save to start from
+ * (or - to boot the ROM), an input script (or - for none), and an emulated
+ * duration in seconds. Each line of an input script is a button action:
+ * an emulated time in seconds since the start of the job, a button (left,
+ * middle, right or tap), and a state (1 pressed, 0 released). Lines starting
+ * with # are ignored in both files.
+ *
+ * TamaLIB keeps the CPU in global variables, so that each worker is a process
+ * with its own emulator. Workers take the next job from a counter shared with
+ * the other workers, so that jobs of different lengths are balanced.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tamalib/tamalib.h"
+
+#include "logger.h"
+#include "program.h"
+#include "romcache.h"
+#include "screen.h"
+#include "state.h"
+
+#define BATCH_FRAMERATE 30
+// Number of times per emulated second the screen is sampled, as by the
+// server at 1x speed.
+
+#define BATCH_MAX_SLICE_TICKS (1U << 30)
+// Maximum number of clock cycles run without checking the progress of a job,
+// so that differences of the 32-bit tick counter never wrap.
+
+#define BATCH_LINE_SIZE 4096
+// Maximum size of a line of a manifest or input script.
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+// Parameters of the 64-bit FNV-1a hash of the screens.
+
+typedef struct {
+	char *rom;
+	char *state;				// NULL to boot the ROM
+	char *script;				// NULL for no inputs
+	double duration;			// Emulated duration, in seconds
+	unsigned int line;			// Line of the job in the manifest
+} batch_job_t;
+
+typedef enum {
+	BATCH_STATUS_PENDING = 0,	// Not run, or its worker crashed
+	BATCH_STATUS_OK,
+	BATCH_STATUS_HALTED,		// The CPU halted before the end of the job
+	BATCH_STATUS_ERROR,
+} batch_status_t;
+
+/**
+ * @brief Result of a job, written by its worker in memory shared with the
+ * parent process
+ */
+typedef struct {
+	batch_status_t status;
+	uint32_t frames;			// Number of distinct consecutive screens
+	uint64_t frames_hash;		// Hash of the sequence of screens
+	uint64_t screen_hash;		// Hash of the final screen
+} batch_result_t;
+
+typedef struct {
+	uint64_t tick;				// Emulated time, in clock cycles
+	button_t button;
+	btn_state_t state;
+} batch_input_t;
+
+static const char * const g_status_names[] = {
+	[BATCH_STATUS_PENDING] = "crashed",
+	[BATCH_STATUS_OK] = "ok",
+	[BATCH_STATUS_HALTED] = "halted",
+	[BATCH_STATUS_ERROR] = "error",
+};
+
+/* Emulator of the worker */
+static bool_t g_matrix[LCD_HEIGHT][LCD_WIDTH];
+static bool_t g_icons[ICON_NUM];
+static bool g_screen_dirty;
+static bool g_halted;
+
+/* HAL */
+
+static void hal_halt(void)
+{
+	g_halted = true;
+}
+
+static bool_t hal_is_log_enabled(log_level_t level)
+{
+	((void)level);
+	return 0;
+}
+
+static void hal_log(log_level_t level, char *buff, ...)
+{
+	((void)level);
+	((void)buff);
+}
+
+static void hal_sleep_until(timestamp_t ts)
+{
+	((void)ts);
+}
+
+static timestamp_t hal_get_timestamp(void)
+{
+	/* Jobs run unthrottled, and the screen is sampled by emulated time */
+	return 0;
+}
+
+static void hal_update_screen(void)
+{
+}
+
+static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+{
+	if (g_matrix[y][x] != val) {
+		g_matrix[y][x] = val;
+		g_screen_dirty = true;
+	}
+}
+
+static void hal_set_lcd_icon(u8_t icon, bool_t val)
+{
+	if (g_icons[icon] != val) {
+		g_icons[icon] = val;
+		g_screen_dirty = true;
+	}
+}
+
+static void hal_set_frequency(u32_t freq)
+{
+	((void)freq);
+}
+
+static void hal_play_frequency(bool_t en)
+{
+	((void)en);
+}
+
+static int hal_handler(void)
+{
+	return 0;
+}
+
+static hal_t hal = {
+	.halt = &hal_halt,
+	.is_log_enabled = &hal_is_log_enabled,
+	.log = &hal_log,
+	.sleep_until = &hal_sleep_until,
+	.get_timestamp = &hal_get_timestamp,
+	.update_screen = &hal_update_screen,
+	.set_lcd_matrix = &hal_set_lcd_matrix,
+	.set_lcd_icon = &hal_set_lcd_icon,
+	.set_frequency = &hal_set_frequency,
+	.play_frequency = &hal_play_frequency,
+	.handler = &hal_handler,
+};
+
+/* Input files */
+
+/**
+ * @brief Read a whole file
+ *
+ * @param path file to read
+ * @param max_size maximum size of the file
+ * @param size set to the size of the file
+ * @return the contents of the file, which must be freed by the caller, or NULL
+ * on failure
+ */
+static uint8_t * read_file(const char *path, size_t max_size, size_t *size)
+{
+	uint8_t *data = NULL;
+
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	data = malloc(max_size + 1);
+	if (data == NULL) {
+		goto end;
+	}
+	*size = fread(data, 1, max_size + 1, f);
+	if (*size > max_size || ferror(f)) {
+		fprintf(stderr, "Invalid file %s\n", path);
+		free(data);
+		data = NULL;
+	}
+
+	end:
+		fclose(f);
+		return data;
+}
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+static int parse_button(const char *name, button_t *button)
+{
+	static const char * const names[] = {"left", "middle", "right", "tap"};
+	static const button_t buttons[] = {BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, BTN_TAP};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(name, names[i])) {
+			*button = buttons[i];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @brief Parse an input script
+ *
+ * @param path script file
+ * @param inputs set to the inputs, in order, which must be freed by the caller
+ * @param n_inputs set to the number of inputs
+ * @return 0 on success, 1 on failure
+ */
+static int parse_script(const char *path, batch_input_t **inputs, size_t *n_inputs)
+{
+	char line[BATCH_LINE_SIZE];
+	char button[16];
+	size_t capacity = 0;
+	unsigned int line_no = 0;
+	double time;
+	int state;
+
+	*inputs = NULL;
+	*n_inputs = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_no++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		if (*n_inputs == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			batch_input_t *grown = realloc(*inputs, capacity * sizeof(batch_input_t));
+			if (grown == NULL) {
+				goto error;
+			}
+			*inputs = grown;
+		}
+		batch_input_t *input = &(*inputs)[*n_inputs];
+		if (sscanf(line, "%lf %15s %d", &time, button, &state) != 3 || time < 0 ||
+			parse_button(button, &input->button) || (state != 0 && state != 1)) {
+			fprintf(stderr, "%s:%u: invalid input\n", path, line_no);
+			goto error;
+		}
+		input->tick = (uint64_t) (time * TICK_FREQUENCY + 0.5);
+		input->state = state ? BTN_STATE_PRESSED : BTN_STATE_RELEASED;
+		if (*n_inputs > 0 && input->tick < (*inputs)[*n_inputs - 1].tick) {
+			fprintf(stderr, "%s:%u: inputs are not in order\n", path, line_no);
+			goto error;
+		}
+		(*n_inputs)++;
+	}
+	fclose(f);
+	return 0;
+
+	error:
+		fclose(f);
+		free(*inputs);
+		*inputs = NULL;
+		*n_inputs = 0;
+		return 1;
+}
+
+/**
+ * @brief Parse the manifest
+ *
+ * @param path manifest file
+ * @param n_jobs set to the number of jobs
+ * @return the jobs, or NULL on failure
+ */
+static batch_job_t * parse_manifest(const char *path, size_t *n_jobs)
+{
+	char line[BATCH_LINE_SIZE];
+	char rom[BATCH_LINE_SIZE], state[BATCH_LINE_SIZE], script[BATCH_LINE_SIZE];
+	batch_job_t *jobs = NULL;
+	size_t capacity = 0;
+	unsigned int line_no = 0;
+	double duration;
+
+	*n_jobs = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_no++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		if (sscanf(line, "%s %s %s %lf", rom, state, script, &duration) != 4 ||
+			!(duration >= 0)) {
+			fprintf(stderr, "%s:%u: invalid job\n", path, line_no);
+			goto error;
+		}
+		if (*n_jobs == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			batch_job_t *grown = realloc(jobs, capacity * sizeof(batch_job_t));
+			if (grown == NULL) {
+				goto error;
+			}
+			jobs = grown;
+		}
+		batch_job_t *job = &jobs[(*n_jobs)++];
+		job->rom = strdup(rom);
+		job->state = strcmp(state, "-") ? strdup(state) : NULL;
+		job->script = strcmp(script, "-") ? strdup(script) : NULL;
+		job->duration = duration;
+		job->line = line_no;
+	}
+	fclose(f);
+	return jobs;
+
+	error:
+		fclose(f);
+		free(jobs);
+		return NULL;
+}
+
+/* Jobs */
+
+/**
+ * @brief Sample the screen, and account for it if it changed
+ *
+ * @param previous last distinct screen, updated
+ * @param r result of the job
+ * @param frames file where the screens are listed, or NULL
+ * @param tick emulated time of the sample, in clock cycles
+ */
+static void sample_screen(uint8_t previous[SCREEN_SIZE], batch_result_t *r,
+	FILE *frames, uint64_t tick)
+{
+	uint8_t screen[SCREEN_SIZE];
+
+	if (!g_screen_dirty) {
+		return;
+	}
+	g_screen_dirty = false;
+	screen_pack_screen(g_matrix, g_icons, screen);
+	if (r->frames && !memcmp(screen, previous, SCREEN_SIZE)) {
+		return;
+	}
+	memcpy(previous, screen, SCREEN_SIZE);
+	r->frames++;
+	r->frames_hash = fnv1a(r->frames_hash, screen, SCREEN_SIZE);
+	if (frames != NULL) {
+		fprintf(frames, "%" PRIu64 " %016" PRIx64 "\n", tick,
+			fnv1a(FNV_OFFSET, screen, SCREEN_SIZE));
+	}
+}
+
+/**
+ * @brief Run the CPU until the job has run for a number of clock cycles
+ *
+ * @param elapsed clock cycles run by the job, updated
+ * @param target clock cycles to reach
+ */
+static void run_until(uint64_t *elapsed, uint64_t target)
+{
+	const u32_t *tick_counter = tamalib_get_state()->tick_counter;
+
+	while (*elapsed < target && !g_halted) {
+		const u32_t start = *tick_counter;
+		const u32_t end = start + (u32_t) ((target - *elapsed < BATCH_MAX_SLICE_TICKS) ?
+			target - *elapsed : BATCH_MAX_SLICE_TICKS);
+
+		while ((int32_t) (*tick_counter - end) < 0 && !g_halted) {
+			tamalib_step();
+		}
+		*elapsed += (u32_t) (*tick_counter - start);
+	}
+}
+
+/**
+ * @brief Run a job in the emulator of the worker
+ *
+ * @param job job to run
+ * @param index index of the job, used to name its output files
+ * @param out_dir directory where the final state and the screens of the job
+ * are written, or NULL
+ * @param out result of the job, only written once the job is done, so that
+ * it stays BATCH_STATUS_PENDING if the worker crashes
+ */
+static void run_job(const batch_job_t *job, size_t index, const char *out_dir,
+	batch_result_t *out)
+{
+	batch_result_t result = {.status = BATCH_STATUS_ERROR, .frames_hash = FNV_OFFSET};
+	batch_result_t *r = &result;
+	char path[PATH_MAX];
+	uint8_t previous[SCREEN_SIZE] = {0};
+	uint8_t save[STATE_SIZE];
+	uint8_t screen[SCREEN_SIZE];
+	uint8_t *rom = NULL;
+	uint8_t *state = NULL;
+	u12_t *program = NULL;
+	batch_input_t *inputs = NULL;
+	FILE *frames = NULL;
+	size_t rom_size, state_size, n_inputs = 0;
+	uint32_t program_size;
+	bool initialized = false;
+
+	rom = read_file(job->rom, ROM_SIZE, &rom_size);
+	if (rom == NULL) {
+		goto end;
+	}
+	if (rom_size != ROM_SIZE) {
+		fprintf(stderr, "%s: invalid ROM (%zu bytes instead of %d)\n", job->rom, rom_size, ROM_SIZE);
+		goto end;
+	}
+	program = program_load(rom, rom_size, &program_size);
+	if (program == NULL) {
+		goto end;
+	}
+	if (job->state != NULL &&
+		(state = read_file(job->state, STATE_V3_SIZE, &state_size)) == NULL) {
+		goto end;
+	}
+	if (job->script != NULL && parse_script(job->script, &inputs, &n_inputs)) {
+		goto end;
+	}
+	if (out_dir != NULL) {
+		snprintf(path, sizeof(path), "%s/%zu.frames", out_dir, index);
+		frames = fopen(path, "w");
+		if (frames == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+			goto end;
+		}
+	}
+
+	memset(g_matrix, 0, sizeof(g_matrix));
+	memset(g_icons, 0, sizeof(g_icons));
+	g_screen_dirty = true;
+	g_halted = false;
+	tamalib_init(program, NULL, 1000000);
+	initialized = true;
+	tamalib_set_speed(0);
+	if (state != NULL && state_load(state, state_size)) {
+		fprintf(stderr, "%s: invalid state save\n", job->state);
+		goto end;
+	}
+	tamalib_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+	tamalib_set_button(BTN_TAP, BTN_STATE_RELEASED);
+
+	/* The CPU runs up to the next input or screen sample, whichever is first */
+	const uint64_t duration = (uint64_t) (job->duration * TICK_FREQUENCY + 0.5);
+	uint64_t elapsed = 0;
+	uint64_t frame = 0;
+	size_t next_input = 0;
+	for (;;) {
+		const uint64_t frame_tick = frame * TICK_FREQUENCY / BATCH_FRAMERATE;
+		if (elapsed >= frame_tick) {
+			sample_screen(previous, r, frames, elapsed);
+			frame++;
+			continue;
+		}
+		while (next_input < n_inputs && inputs[next_input].tick <= elapsed) {
+			tamalib_set_button(inputs[next_input].button, inputs[next_input].state);
+			next_input++;
+		}
+		if (elapsed >= duration || g_halted) {
+			break;
+		}
+		uint64_t target = (frame_tick < duration) ? frame_tick : duration;
+		if (next_input < n_inputs && inputs[next_input].tick < target) {
+			target = inputs[next_input].tick;
+		}
+		run_until(&elapsed, target);
+	}
+
+	g_screen_dirty = true;
+	sample_screen(previous, r, frames, elapsed);
+	screen_pack_screen(g_matrix, g_icons, screen);
+	r->screen_hash = fnv1a(FNV_OFFSET, screen, SCREEN_SIZE);
+	r->status = g_halted ? BATCH_STATUS_HALTED : BATCH_STATUS_OK;
+
+	if (out_dir != NULL) {
+		size_t save_size = state_save(save);
+		snprintf(path, sizeof(path), "%s/%zu.tlst", out_dir, index);
+		FILE *f = fopen(path, "wb");
+		if (f == NULL || fwrite(save, 1, save_size, f) != save_size) {
+			fprintf(stderr, "Cannot write %s\n", path);
+			r->status = BATCH_STATUS_ERROR;
+		}
+		if (f != NULL) {
+			fclose(f);
+		}
+	}
+
+	end:
+		if (initialized) {
+			tamalib_release();
+		}
+		if (frames != NULL) {
+			fclose(frames);
+		}
+		free(inputs);
+		free(program);
+		free(state);
+		free(rom);
+		logger_flush();
+		*out = result;
+}
+
+/**
+ * @brief Run jobs until none is left
+ *
+ * @param jobs jobs of the manifest
+ * @param n_jobs number of jobs
+ * @param next index of the next job to run, shared by all the workers
+ * @param results results of the jobs, shared with the parent process
+ * @param out_dir output directory, or NULL
+ */
+static void run_worker(const batch_job_t *jobs, size_t n_jobs, atomic_size_t *next,
+	batch_result_t *results, const char *out_dir)
+{
+	tamalib_register_hal(&hal);
+	for (;;) {
+		size_t i = atomic_fetch_add_explicit(next, 1, memory_order_relaxed);
+		if (i >= n_jobs) {
+			break;
+		}
+		run_job(&jobs[i], i + 1, out_dir, &results[i]);
+	}
+}
+
+static double clock_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j N_WORKERS] [-o OUT_DIR] MANIFEST\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *out_dir = NULL;
+	size_t n_jobs;
+	pid_t pid;
+	int wstatus;
+	int opt;
+	int status = 0;
+
+	while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+		switch (opt) {
+			case 'j':
+				n_workers = atol(optarg);
+				break;
+			case 'o':
+				out_dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || n_workers < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	batch_job_t *jobs = parse_manifest(argv[optind], &n_jobs);
+	if (jobs == NULL) {
+		return 1;
+	}
+	if ((size_t) n_workers > n_jobs) {
+		n_workers = n_jobs ? n_jobs : 1;
+	}
+
+	/* The job counter and the results are shared with the workers */
+	const size_t shared_size = sizeof(atomic_size_t) + n_jobs * sizeof(batch_result_t);
+	void *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	atomic_size_t *next = shared;
+	batch_result_t *results = (batch_result_t *) ((uint8_t *) shared + sizeof(atomic_size_t));
+	atomic_init(next, 0);
+
+	double start = clock_s();
+	fflush(NULL);
+	for (long i = 0; i < n_workers; i++) {
+		pid = fork();
+		if (pid == 0) {
+			run_worker(jobs, n_jobs, next, results, out_dir);
+			exit(0);
+		}
+		if (pid < 0) {
+			perror("fork");
+			break;
+		}
+	}
+	while ((pid = waitpid(-1, &wstatus, 0)) > 0) {
+		if (WIFSIGNALED(wstatus)) {
+			fprintf(stderr, "Worker %d killed by signal %d (%s)\n", (int) pid,
+				WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
+			status = 1;
+		} else if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0) {
+			fprintf(stderr, "Worker %d exited with status %d\n", (int) pid,
+				WEXITSTATUS(wstatus));
+			status = 1;
+		}
+	}
+	double wall = clock_s() - start;
+
+	for (size_t i = 0; i < n_jobs; i++) {
+		const batch_result_t *r = &results[i];
+		printf("%zu\t%u\t%s\t%" PRIu32 "\t%016" PRIx64 "\t%016" PRIx64 "\n", i + 1,
+			jobs[i].line, g_status_names[r->status], r->frames, r->frames_hash,
+			r->screen_hash);
+		if (r->status != BATCH_STATUS_OK && r->status != BATCH_STATUS_HALTED) {
+			status = 1;
+		}
+	}
+	fprintf(stderr, "%zu jobs in %.2f s on %ld workers (%.1f jobs/s)\n",
+		n_jobs, wall, n_workers, n_jobs / wall);
+
+	return status;
+}
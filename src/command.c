@@ -0,0 +1,100 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The queue is a ring of cells, each with a sequence number telling whether
+ * it is free for the push of a given position, or holds the command of a
+ * given position, ready to be popped. Producers claim a position with a CAS
+ * on the tail, and publish the command by releasing the cell sequence number.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "command.h"
+
+void command_queue_init(command_queue_t *q)
+{
+	for (size_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+		atomic_init(&q->cells[i].seq, i);
+	}
+	atomic_init(&q->tail, 0);
+	q->head = 0;
+}
+
+/**
+ * @brief Push a command, from any thread
+ *
+ * @return true on success, false if the queue is full (the command is then
+ * still owned by the caller)
+ */
+bool command_queue_push(command_queue_t *q, const command_t *command)
+{
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	command_cell_t *cell;
+
+	for (;;) {
+		cell = &q->cells[pos & (COMMAND_QUEUE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+	cell->command = *command;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * @brief Pop the oldest command, from the consumer thread only
+ *
+ * @return true on success, false if the queue is empty
+ */
+bool command_queue_pop(command_queue_t *q, command_t *command)
+{
+	command_cell_t *cell = &q->cells[q->head & (COMMAND_QUEUE_SIZE - 1)];
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+	if (seq != q->head + 1) {
+		return false;
+	}
+	*command = cell->command;
+	atomic_store_explicit(&cell->seq, q->head + COMMAND_QUEUE_SIZE, memory_order_release);
+	q->head++;
+	return true;
+}
+
+/**
+ * @brief Free the resources owned by a command that is not applied
+ */
+void command_free(command_t *command)
+{
+	if (command->type == COMMAND_LOAD) {
+		free(command->state_b64);
+		command->state_b64 = NULL;
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tamalib/tamalib.h"
+
+#define COMMAND_QUEUE_SIZE 64
+// Maximum number of pending commands of a session. Must be a power of 2.
+
+typedef enum {
+	COMMAND_BUTTON,
+	COMMAND_EXEC_MODE,
+	COMMAND_SPEED,
+	COMMAND_SAVE,
+	COMMAND_LOAD,
+	COMMAND_FAST_FORWARD,
+	COMMAND_END,
+} command_type_t;
+
+/**
+ * @brief A client action, to be applied by the thread running the session
+ */
+typedef struct {
+	command_type_t type;
+	timestamp_t received;		// Arrival of the client message, 0 if unknown
+	timestamp_t queued;			// When the command was pushed
+	union {
+		struct {
+			button_t button;
+			btn_state_t state;
+		} button;				// COMMAND_BUTTON
+		exec_mode_t exec_mode;	// COMMAND_EXEC_MODE
+		u8_t speed;				// COMMAND_SPEED
+		char *state_b64;		// COMMAND_LOAD, owned by the command
+		uint32_t duration;		// COMMAND_FAST_FORWARD, in seconds
+	};
+} command_t;
+
+typedef struct {
+	atomic_size_t seq;
+	command_t command;
+} command_cell_t;
+
+/**
+ * @brief Bounded lock-free queue of commands, with many producers (the
+ * client threads) and a single consumer (the thread running the session)
+ */
+typedef struct {
+	command_cell_t cells[COMMAND_QUEUE_SIZE];
+	alignas(64) atomic_size_t tail;	// Next cell to push, shared by producers
+	alignas(64) size_t head;		// Next cell to pop, owned by the consumer
+} command_queue_t;
+
+void command_queue_init(command_queue_t *q);
+bool command_queue_push(command_queue_t *q, const command_t *command);
+bool command_queue_pop(command_queue_t *q, command_t *command);
+void command_free(command_t *command);
+
+#endif /* _COMMAND_H_ */
@@ -0,0 +1,375 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Asynchronous logger. Each thread formats its log lines into its own ring
+ * buffer, with a single producer (the thread) and a single consumer (the
+ * flusher thread), so that logging never takes a lock nor waits for the
+ * output. The flusher thread periodically writes the buffered lines of all
+ * threads, errors and warnings to stderr and the others to stdout.
+ *
+ * The rings of the threads that exited are reused by new threads, once
+ * flushed. The threads of the server (reactor, scheduler workers, store and
+ * metrics) live as long as the process, so this only bounds the rings of
+ * programs that start threads on the fly, such as the benchmarks.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+typedef struct {
+	struct timespec time;
+	uint8_t level;
+	uint8_t category;
+	char line[LOGGER_LINE_SIZE];
+} logger_entry_t;
+
+typedef struct logger_ring {
+	logger_entry_t entries[LOGGER_RING_SIZE];
+	alignas(64) atomic_size_t tail;	// Next entry to write, owned by the thread
+	alignas(64) atomic_size_t head;	// Next entry to flush, owned by the flusher
+	atomic_uint_fast64_t dropped;	// Lines dropped as the ring was full
+	atomic_bool exited;				// The thread owning the ring exited
+	struct logger_ring *next;
+} logger_ring_t;
+
+static const char * const g_level_names[LOGGER_LEVEL_NUM] = {
+	[LOGGER_ERROR] = "error",
+	[LOGGER_WARN] = "warn",
+	[LOGGER_INFO] = "info",
+	[LOGGER_DEBUG] = "debug",
+};
+
+static const char * const g_category_names[LOGGER_CAT_NUM] = {
+	[LOGGER_CAT_SERVER] = "server",
+	[LOGGER_CAT_WS] = "ws",
+	[LOGGER_CAT_SESSION] = "session",
+	[LOGGER_CAT_EMU] = "emu",
+};
+
+atomic_uchar g_logger_levels[LOGGER_CAT_NUM] = {
+	[LOGGER_CAT_SERVER] = LOGGER_INFO,
+	[LOGGER_CAT_WS] = LOGGER_INFO,
+	[LOGGER_CAT_SESSION] = LOGGER_INFO,
+	[LOGGER_CAT_EMU] = LOGGER_INFO,
+};
+
+/* All the rings, only ever prepended to. g_rings_lock is only taken when a
+ * thread logs for the first time.
+ */
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(logger_ring_t *) g_rings = NULL;
+
+/* Serializes the flushes of the flusher thread and of logger_flush */
+static pthread_mutex_t g_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ring_key;
+static _Thread_local logger_ring_t *g_ring = NULL;
+
+static void logger_ring_exit(void *ring)
+{
+	atomic_store_explicit(&((logger_ring_t *) ring)->exited, true, memory_order_release);
+}
+
+static void logger_create_key(void)
+{
+	pthread_key_create(&g_ring_key, &logger_ring_exit);
+}
+
+/**
+ * @brief Get the ring of the calling thread, reusing the ring of a thread that
+ * exited if it was flushed
+ *
+ * @return the ring, or NULL if it cannot be allocated
+ */
+static logger_ring_t * logger_get_ring(void)
+{
+	logger_ring_t *ring;
+
+	if (g_ring != NULL) {
+		return g_ring;
+	}
+	pthread_once(&g_key_once, &logger_create_key);
+
+	pthread_mutex_lock(&g_rings_lock);
+	for (ring = atomic_load(&g_rings); ring != NULL; ring = ring->next) {
+		if (atomic_load_explicit(&ring->exited, memory_order_acquire) &&
+			atomic_load_explicit(&ring->head, memory_order_acquire) ==
+			atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+			atomic_store_explicit(&ring->exited, false, memory_order_relaxed);
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(logger_ring_t));
+		if (ring != NULL) {
+			ring->next = atomic_load(&g_rings);
+			atomic_store(&g_rings, ring);
+		}
+	}
+	pthread_mutex_unlock(&g_rings_lock);
+
+	if (ring != NULL) {
+		pthread_setspecific(g_ring_key, ring);
+		g_ring = ring;
+	}
+	return ring;
+}
+
+static void logger_write(const logger_entry_t *e)
+{
+	struct tm tm;
+	char time_str[32];
+
+	gmtime_r(&e->time.tv_sec, &tm);
+	strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", &tm);
+	fprintf((e->level <= LOGGER_WARN) ? stderr : stdout, "%s.%06ldZ %s %s: %s\n",
+		time_str, e->time.tv_nsec / 1000, g_level_names[e->level],
+		g_category_names[e->category], e->line);
+}
+
+/**
+ * @note g_flush_lock must be held.
+ */
+static void logger_flush_locked(void)
+{
+	for (logger_ring_t *ring = atomic_load(&g_rings); ring != NULL; ring = ring->next) {
+		size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		for (; head != tail; head++) {
+			logger_write(&ring->entries[head & (LOGGER_RING_SIZE - 1)]);
+		}
+		atomic_store_explicit(&ring->head, head, memory_order_release);
+
+		uint_fast64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		if (dropped) {
+			fprintf(stderr, "Logger: dropped %" PRIuFAST64 " lines\n", dropped);
+		}
+	}
+	fflush(stdout);
+	fflush(stderr);
+}
+
+/**
+ * @brief Write the lines buffered by all threads
+ *
+ * The lines of each thread are written in order, but the lines of different
+ * threads may be interleaved out of order within a flush.
+ */
+void logger_flush(void)
+{
+	pthread_mutex_lock(&g_flush_lock);
+	logger_flush_locked();
+	pthread_mutex_unlock(&g_flush_lock);
+}
+
+/**
+ * @brief Flush the buffered lines, unless a flush is in progress
+ *
+ * @return 0 if the lines were flushed, 1 otherwise
+ */
+static int logger_try_flush(void)
+{
+	if (pthread_mutex_trylock(&g_flush_lock) != 0) {
+		return 1;
+	}
+	logger_flush_locked();
+	pthread_mutex_unlock(&g_flush_lock);
+	return 0;
+}
+
+/**
+ * @brief Log a line, formatted by vsnprintf
+ *
+ * The line is truncated to LOGGER_LINE_SIZE, and a trailing newline is
+ * removed.
+ */
+void logger_vlog(logger_level_t level, logger_category_t category,
+	const char *format, va_list args)
+{
+	logger_ring_t *ring = logger_get_ring();
+	if (ring == NULL) {
+		return;
+	}
+
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOGGER_RING_SIZE &&
+		(logger_try_flush() ||
+		 tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOGGER_RING_SIZE)) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	logger_entry_t *e = &ring->entries[tail & (LOGGER_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &e->time);
+	e->level = level;
+	e->category = category;
+	int size = vsnprintf(e->line, LOGGER_LINE_SIZE, format, args);
+	if (size < 0) {
+		size = 0;
+		e->line[0] = '\0';
+	} else if (size >= LOGGER_LINE_SIZE) {
+		size = LOGGER_LINE_SIZE - 1;
+		memcpy(e->line + size - 3, "...", 3);
+	}
+	if (size > 0 && e->line[size - 1] == '\n') {
+		e->line[size - 1] = '\0';
+	}
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void logger_log(logger_level_t level, logger_category_t category,
+	const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	logger_vlog(level, category, format, args);
+	va_end(args);
+}
+
+static void * logger_thread(void *arg)
+{
+	((void)arg);
+
+	for (;;) {
+		usleep(LOGGER_FLUSH_PERIOD_US);
+		logger_flush();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Set the most verbose level logged in a category
+ *
+ * It can be changed at any time, from any thread: the lines being logged by
+ * other threads may still use the previous level.
+ */
+void logger_set_level(logger_category_t category, logger_level_t level)
+{
+	atomic_store_explicit(&g_logger_levels[category], level, memory_order_relaxed);
+}
+
+/**
+ * @brief Set the most verbose level logged, by category
+ *
+ * @param spec comma-separated list of [category=]level, e.g. "warn,ws=debug".
+ * A level without a category applies to all categories.
+ * @return 0 on success, 1 if spec is invalid (the valid items are applied)
+ */
+int logger_configure(const char *spec)
+{
+	char item[32];
+	int status = 0;
+
+	while (*spec) {
+		size_t size = strcspn(spec, ",");
+		if (size == 0 || size >= sizeof(item)) {
+			status = size ? 1 : status;
+			spec += size + (spec[size] == ',');
+			continue;
+		}
+		memcpy(item, spec, size);
+		item[size] = '\0';
+		spec += size + (spec[size] == ',');
+
+		char *level_name = strchr(item, '=');
+		int category = -1;
+		if (level_name != NULL) {
+			*level_name++ = '\0';
+			for (int c = 0; c < LOGGER_CAT_NUM; c++) {
+				if (!strcasecmp(item, g_category_names[c])) {
+					category = c;
+				}
+			}
+			if (category < 0) {
+				fprintf(stderr, "Logger: unknown category \"%s\"\n", item);
+				status = 1;
+				continue;
+			}
+		} else {
+			level_name = item;
+		}
+
+		int level = -1;
+		for (int l = 0; l < LOGGER_LEVEL_NUM; l++) {
+			if (!strcasecmp(level_name, g_level_names[l])) {
+				level = l;
+			}
+		}
+		if (level < 0) {
+			fprintf(stderr, "Logger: unknown level \"%s\"\n", level_name);
+			status = 1;
+			continue;
+		}
+
+		for (int c = 0; c < LOGGER_CAT_NUM; c++) {
+			if (category < 0 || category == c) {
+				logger_set_level(c, level);
+			}
+		}
+	}
+	return status;
+}
+
+/**
+ * @brief Describe the most verbose level logged in each category, in the
+ * format of logger_configure, e.g. "server=info,ws=debug,session=info,emu=info"
+ */
+void logger_get_config(char spec[LOGGER_CONFIG_SIZE])
+{
+	size_t size = 0;
+
+	spec[0] = '\0';
+	for (int c = 0; c < LOGGER_CAT_NUM; c++) {
+		int level = atomic_load_explicit(&g_logger_levels[c], memory_order_relaxed);
+		size += snprintf(spec + size, LOGGER_CONFIG_SIZE - size, "%s%s=%s",
+			c ? "," : "", g_category_names[c], g_level_names[level]);
+	}
+}
+
+/**
+ * @brief Start the flusher thread
+ *
+ * Lines logged before are buffered, and written by the first flush. The
+ * remaining lines are also flushed when the process exits.
+ */
+void logger_init(void)
+{
+	pthread_t thread;
+
+	atexit(&logger_flush);
+	if (pthread_create(&thread, NULL, &logger_thread, NULL)) {
+		fprintf(stderr, "Cannot start logger thread\n");
+		return;
+	}
+	pthread_detach(thread);
+}
@@ -0,0 +1,93 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define LOGGER_LINE_SIZE 192
+// Maximum size of a log line, including the string terminator. Longer lines
+// are truncated.
+
+#define LOGGER_PAYLOAD_MAX 96
+// Maximum number of characters of a client message written to the log.
+
+#define LOGGER_RING_SIZE 128
+// Number of lines buffered by each thread. Must be a power of 2. When the
+// buffer of a thread is full, the thread flushes it itself if no flush is in
+// progress, and otherwise drops the line.
+
+#define LOGGER_FLUSH_PERIOD_US 50000
+// Interval between two flushes of the buffered lines.
+
+#define LOGGER_CONFIG_SIZE 64
+// Size of the description of the levels written by logger_get_config,
+// including the string terminator.
+
+typedef enum {
+	LOGGER_ERROR,
+	LOGGER_WARN,
+	LOGGER_INFO,
+	LOGGER_DEBUG,
+	LOGGER_LEVEL_NUM,
+} logger_level_t;
+
+typedef enum {
+	LOGGER_CAT_SERVER,			// Startup, scheduler, store
+	LOGGER_CAT_WS,				// Client connections and messages
+	LOGGER_CAT_SESSION,			// Session lifecycle and client actions
+	LOGGER_CAT_EMU,				// TamaLIB logs
+	LOGGER_CAT_NUM,
+} logger_category_t;
+
+/* Most verbose level logged, by category */
+extern atomic_uchar g_logger_levels[LOGGER_CAT_NUM];
+
+/**
+ * @brief Check if a log line would be written, before formatting it
+ */
+static inline bool logger_is_enabled(logger_level_t level,
+	logger_category_t category)
+{
+	return level <= atomic_load_explicit(&g_logger_levels[category], memory_order_relaxed);
+}
+
+/* Log a line, evaluating the arguments only if the line is written */
+#define LOGGER(level, category, ...) \
+	do { \
+		if (logger_is_enabled(level, category)) { \
+			logger_log(level, category, __VA_ARGS__); \
+		} \
+	} while (0)
+
+void logger_log(logger_level_t level, logger_category_t category,
+	const char *format, ...) __attribute__((format(printf, 3, 4)));
+void logger_vlog(logger_level_t level, logger_category_t category,
+	const char *format, va_list args);
+
+void logger_set_level(logger_category_t category, logger_level_t level);
+int logger_configure(const char *spec);
+void logger_get_config(char spec[LOGGER_CONFIG_SIZE]);
+void logger_init(void);
+void logger_flush(void);
+
+#endif /* _LOGGER_H_ */
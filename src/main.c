@@ -17,338 +17,343 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <base64.h>
-#include <stdarg.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "tamalib/tamalib.h"
-#include "ws.h"
 #include "cjson/cJSON.h"
 
-#include "program.h"
-#include "state.h"
 #include "base64singleline.h"
+#include "logger.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "reactor.h"
+#include "romcache.h"
+#include "scheduler.h"
+#include "session.h"
+#include "state.h"
+#include "stats.h"
+#include "store.h"
+
+#define BASE64_STATE_SIZE BASE64SINGLELINE_SIZE(STATE_SIZE)
+// The size of a base-64 encoded state snapshot (STATE_SIZE = 523 bytes, i.e.
+// 700 base-64 characters; see state.h). This is used to validate the payload
+// by the client on lod events.
 
-#define WS_PORT 			8080
-#define FRM_TXT  1
-#define FRM_BIN  2
-#define FRM_CLSE 8
-#define FRM_FIN 128
-#define FRM_MSK 128
+#define BASE64_STATE_V3_SIZE BASE64SINGLELINE_SIZE(STATE_V3_SIZE)
+// The size of a base-64 encoded version 3 state snapshot (977 bytes, i.e.
+// 1304 base-64 characters), which is still accepted on lod events.
 
-#define BASE64_STATE_SIZE 1304
-// The size of a base-64 encoded state snapshot. Calculated from the size in
-// bytes (63 + INT_SLOT_NUM * 3 + MEM_RAM_SIZE + MEM_IO_SIZE = 977; see
-// state.h) and the formula ceil(n_bytes / 3) * 4. This is used to validate the
-// payload by the client on lod events.
+#define WS_PROTOCOL_BINARY "tama-binary"
+// WebSocket subprotocol with which clients receive binary frames from the
+// start (see the cfg event).
+
+static const char * const ws_protocols[] = {WS_PROTOCOL_BINARY, NULL};
 
 #define BASE64_ROM_SIZE 16384
 // The size of a base-64 encoded state snapshot. Measured. This is used to
 // validate the payload by the client on rom events.
 
-static u12_t *g_program = NULL;		// The actual program that is executed
-static uint32_t g_program_size = 0;
-
-static u32_t current_freq = 0; // in dHz
-static unsigned int sin_pos = 0;
-static bool_t is_audio_playing = 0;
-
-static bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH] = {{0}};
-static bool_t icon_buffer[ICON_NUM] = {0};
-static bool_t btn_buffer[4] = {0};
-
-static u8_t log_levels = LOG_ERROR | LOG_INFO;
-
-typedef enum {
-	SPEED_UNLIMITED = 0,
-	SPEED_1X = 1,
-	SPEED_10X = 10,
-} emulation_speed_t;
-
-bool g_end_action = false;
-bool g_sav_action = false;
-bool g_lod_action = false;
-char *g_load_state_save_b64;
-char *g_rom_b64 = NULL;
-
-static void hal_halt(void)
+/**
+ * @brief Whether a client negotiated binary frames in its handshake
+ */
+static bool client_negotiated_binary(ws_cli_conn_t client)
 {
-	char msg[] = "{\"t\":\"end\",\"e\":{}}";
-	size_t size = 18;
-	ws_sendframe_bcast(WS_PORT, msg, size, FRM_TXT);
-	exit(EXIT_SUCCESS);
+	const char *protocol = reactor_get_protocol(client);
+	return protocol != NULL && !strcmp(protocol, WS_PROTOCOL_BINARY);
 }
 
-static bool_t hal_is_log_enabled(log_level_t level)
+void onopen(ws_cli_conn_t client)
 {
-	return !!(log_levels & level);
+	atomic_fetch_add_explicit(&g_metrics.clients, 1, memory_order_relaxed);
+	outbox_open(client);
+	const bool binary = client_negotiated_binary(client);
+	if (binary) {
+		const client_options_t options = {.binary = true};
+		session_configure_client(client, &options);
+	}
+	LOGGER(LOGGER_INFO, LOGGER_CAT_WS, "[%s] Connected%s", reactor_get_address(client),
+		binary ? " (" WS_PROTOCOL_BINARY ")" : "");
 }
 
-static void hal_log(log_level_t level, char *buff, ...)
+void onclose(ws_cli_conn_t  client)
 {
-	va_list arglist;
-
-	if (!(log_levels & level)) {
-		return;
-	}
-
-	va_start(arglist, buff);
-
-	vfprintf((level == LOG_ERROR) ? stderr : stdout, buff, arglist);
-
-	char msg_template[] = "{\"t\":\"log\",\"e\":{\"l\":\"%d\",\"m\":\"%s\"}}";
-	size_t msg_size = snprintf(NULL, 0, msg_template, level, buff);
-	msg_size++;
-	char *msg = (char *)malloc(msg_size);
-	snprintf(msg, msg_size, msg_template, level, buff);
-	ws_sendframe_bcast(WS_PORT, msg, msg_size - 1, FRM_TXT);
-	free(msg);
-
-	va_end(arglist);
+	atomic_fetch_sub_explicit(&g_metrics.clients, 1, memory_order_relaxed);
+	LOGGER(LOGGER_INFO, LOGGER_CAT_WS, "[%s] Disconnected", reactor_get_address(client));
+	session_unsubscribe(client);
+	outbox_close(client);
 }
 
-static timestamp_t hal_get_timestamp(void)
+/**
+ * @brief Generate a random session ID
+ *
+ * @param id output buffer, of size SESSION_ID_SIZE at least
+ */
+static void generate_session_id(char *id)
 {
-	struct timespec time;
-
-	clock_gettime(CLOCK_REALTIME, &time);
-	return (time.tv_sec * 1000000 + time.tv_nsec/1000);
-}
+	static const char hex[] = "0123456789abcdef";
+	uint8_t bytes[8];
 
-static void hal_sleep_until(timestamp_t ts)
-{
-#ifndef NO_SLEEP
-	struct timespec t;
-	int32_t remaining = (int32_t) (ts - hal_get_timestamp());
-
-	/* Sleep for a bit more than what is needed */
-	if (remaining > 0) {
-		t.tv_sec = remaining / 1000000;
-		t.tv_nsec = (remaining % 1000000) * 1000;
-		nanosleep(&t, NULL);
-	}
-#else
-	/* Wait instead of sleeping to get the highest possible accuracy
-	 * NOTE: the accuracy still depends on the timestamp_t resolution.
-	 */
-	while ((int32_t) (ts - hal_get_timestamp()) > 0);
-#endif
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+		uint64_t fallback = (uint64_t) time(NULL) ^ (uint64_t) rand() << 32;
+		memcpy(bytes, &fallback, sizeof(bytes));
+	}
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		id[2*i] = hex[bytes[i] >> 4];
+		id[2*i+1] = hex[bytes[i] & 0xF];
+	}
+	id[2*sizeof(bytes)] = '\0';
 }
 
 /**
- * @brief Encode a bool_t array to base64
+ * @brief Subscribe a client to an existing session
  *
- * @param src array to encode
- * @param len src length
- * @param out_len output length
- * @return base64-encoded src
- *
- * @note src is an array of bytes used to represent bits, and is therefore
- * expected to only contain values 0x0 and 0x1.
+ * @return 0 on success, 1 if the session does not exist
  */
-unsigned char * bool_t_to_base64(const bool_t *src, const size_t len,
-	size_t *out_len)
+static int join_session(ws_cli_conn_t client, const char *id)
 {
-	if (len % 8) {
-		printf("bool_t_to_base64: cannot convert array of size %lu\n", len);
-		return NULL;
-	}
-	size_t new_len = len / 8;
-	unsigned char * new_arr = malloc(new_len);
-	for (int i = 0; i < new_len; i++) {
-		new_arr[i] = 0;
-		for (int j = 0; j < 8; j++) {
-            new_arr[i] |= src[i*8+(7-j)] << j;
-		}
+	session_t *s = session_find(id);
+	if (s == NULL) {
+		return 1;
 	}
-	unsigned char *out = base64singleline_encode(new_arr, new_len, out_len);
-	free(new_arr);
-	return out;
+	int status = session_subscribe(s, client);
+	session_release(s);
+	return status;
 }
 
-static void update_screen(const bool skip_identical_frames)
-{
-	/* This uses a const msg_size allow for a static previous_msg.
-	 * The message size is calculated as follows:
-	 * - 88 chars for the matrix (512 bits base64-encoded)
-	 * - 4 chars for the icons (8 bits base64-encoded)
-	 * - 31 chars json overhead (length of msg_template, minus the two '%s')
-	 * - 1 string terminator
-	 *
-	 * The number of chars for base64-encoded arrays is given by:
-	 * ceil(n_bits / 8 / 3) * 4
-	 */
-	const size_t msg_size = 124;
-	char msg[124] = {};
-	static char previous_msg[124] = {};
-	char msg_template[] = "{\"t\":\"scr\",\"e\":{\"m\":\"%s\",\"i\":\"%s\"}}";
-	unsigned char *matrix_b64 = bool_t_to_base64((bool_t *)matrix_buffer, LCD_HEIGHT * LCD_WIDTH, NULL);
-	unsigned char *icon_b64 = bool_t_to_base64(icon_buffer, ICON_NUM, NULL);
-	snprintf(msg, msg_size, msg_template, matrix_b64, icon_b64);
-	if (!skip_identical_frames | strcmp(msg, previous_msg) != 0) {
-        ws_sendframe_bcast(WS_PORT, msg, msg_size - 1, FRM_TXT);
-        strcpy(previous_msg, msg);
-	}
-	free(matrix_b64);
-	free(icon_b64);
-}
-
-static void hal_update_screen(void)
-{
-	update_screen(true);
-}
-
-static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+/**
+ * @brief Get the session of a client that sent an event
+ *
+ * @note The caller must release the returned session with session_release.
+ */
+static session_t * get_client_session(ws_cli_conn_t client, const char *event)
 {
-	matrix_buffer[y][x] = val;
+	session_t *s = session_of_client(client);
+	if (s == NULL) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "%s event: client is not in a session\n", event);
+	}
+	return s;
 }
 
-static void hal_set_lcd_icon(u8_t icon, bool_t val)
-{
-	icon_buffer[icon] = val;
-}
+int handle_ws_event_rom(ws_cli_conn_t client, const cJSON *json) {
+	const cJSON *r = NULL;
+	const cJSON *h = NULL;
+	const cJSON *i = NULL;
+	char id[SESSION_ID_SIZE];
+	rom_t *rom = NULL;
+	session_t *s = NULL;
+	int status = 0;
 
-static void hal_set_frequency(u32_t freq)
-{
-	if (current_freq != freq) {
-		current_freq = freq;
-		sin_pos = 0;
+	// session ID (optional)
+	i = cJSON_GetObjectItemCaseSensitive(json, "i");
+	if (i != NULL) {
+		if (!(cJSON_IsString(i) && (i->valuestring != NULL))) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: item \"i\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (!session_is_valid_id(i->valuestring)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: invalid session ID \"i\"\n");
+			status = 1;
+			goto end;
+		}
+		strcpy(id, i->valuestring);
+		if (join_session(client, id) == 0) {
+			LOGGER(LOGGER_INFO, LOGGER_CAT_WS, "rom event: session %s already exists, joined it\n", id);
+			goto end;
+		}
+	} else {
+		generate_session_id(id);
 	}
-}
 
-static void hal_play_frequency(bool_t en)
-{
-	if (is_audio_playing != en) {
-		is_audio_playing = en;
-		char msg_template[] = "{\"t\":\"frq\",\"e\":{\"f\":%u,\"p\":%u,\"e\":%d}}";
-		size_t msg_size = snprintf(NULL, 0, msg_template, current_freq, sin_pos, is_audio_playing);
-		msg_size++;
-		char *msg = (char *)malloc(msg_size);
-		snprintf(msg, msg_size, msg_template, current_freq, sin_pos, is_audio_playing);
-		ws_sendframe_bcast(WS_PORT, msg, msg_size - 1, FRM_TXT);
-		free(msg);
+	// ROM hash, for ROMs already loaded by other sessions (optional)
+	h = cJSON_GetObjectItemCaseSensitive(json, "h");
+	if (h != NULL) {
+		if (!(cJSON_IsString(h) && (h->valuestring != NULL))) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: item \"h\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		rom = rom_cache_find(h->valuestring);
+		if (rom == NULL) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: unknown ROM hash \"h\"\n");
+			status = 1;
+			goto end;
+		}
+	} else {
+		r = cJSON_GetObjectItemCaseSensitive(json, "r");
+		if (r == NULL) {
+			// ROM preloaded with TAMA_WS_ROM
+			rom = rom_cache_default();
+			if (rom == NULL) {
+				LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: no item \"r\"\n");
+				status = 1;
+				goto end;
+			}
+		}
 	}
-}
-
-static void state_save_to_ws()
-{
-	size_t save_size;
-	uint8_t *save = state_save(&save_size);
-	unsigned char *save_b64 = base64singleline_encode(save, save_size, NULL);
-	char msg_template[] = "{\"t\":\"sav\",\"e\":{\"s\":\"%s\"}}";
-	size_t msg_size = snprintf(NULL, 0, msg_template, save_b64);
-	msg_size++;
-	char *msg = (char *)malloc(msg_size);
-	snprintf(msg, msg_size, msg_template, save_b64);
-	ws_sendframe_bcast(WS_PORT, msg, msg_size - 1, FRM_TXT);
-	free(save);
-	free(save_b64);
-	free(msg);
-}
-
-static void state_load_from_ws()
-{
-	size_t out_len;
-	uint8_t *save = base64_decode(
-		(unsigned char *) g_load_state_save_b64,
-		strlen(g_load_state_save_b64),
-		&out_len);
-	state_load(save);
-	free(g_load_state_save_b64);
-	free(save);
-}
-
-static int hal_handler(void)
-{
-	tamalib_set_button(BTN_LEFT, btn_buffer[BTN_LEFT]);
-	tamalib_set_button(BTN_MIDDLE, btn_buffer[BTN_MIDDLE]);
-	tamalib_set_button(BTN_RIGHT, btn_buffer[BTN_RIGHT]);
-	tamalib_set_button(BTN_TAP, btn_buffer[BTN_TAP]);
-
-	if (g_sav_action == true) {
-		state_save_to_ws();
-        g_sav_action = false;
+	if (rom == NULL) {
+		if (!cJSON_IsString(r)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: item \"r\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (r->valuestring == NULL) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "rom event: item \"r\" is a null pointer\n");
+			status = 1;
+			goto end;
+		}
+		const unsigned long int len = strlen(r->valuestring);
+		if (len != BASE64_ROM_SIZE) {
+			LOGGER(
+				LOGGER_WARN, LOGGER_CAT_WS,
+				"rom event: item \"r\" is the wrong size: expected %d but got %lu\n",
+				BASE64_ROM_SIZE,
+				len);
+			status = 1;
+			goto end;
+		}
+		rom = rom_cache_load_b64(r->valuestring);
+		if (rom == NULL) {
+			status = 1;
+			goto end;
+		}
 	}
 
-	if (g_lod_action == true) {
-		state_load_from_ws();
-		g_lod_action = false;
+	s = session_create(id, rom);
+	if (s == NULL) {
+		// The session may have been created by another client in the meantime
+		if (join_session(client, id) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_WS, "rom event: cannot create session %s\n", id);
+			status = 1;
+		}
+		goto end;
 	}
+	status = session_subscribe(s, client);
+	session_release(s);
 
-	return g_end_action;
-}
-
-static hal_t hal = {
-    .halt = &hal_halt,
-    .is_log_enabled = &hal_is_log_enabled,
-    .log = &hal_log,
-    .sleep_until = &hal_sleep_until,
-    .get_timestamp = &hal_get_timestamp,
-    .update_screen = &hal_update_screen,
-    .set_lcd_matrix = &hal_set_lcd_matrix,
-    .set_lcd_icon = &hal_set_lcd_icon,
-    .set_frequency = &hal_set_frequency,
-    .play_frequency = &hal_play_frequency,
-    .handler = &hal_handler,
-};
-
-void onopen(ws_cli_conn_t client)
-{
-	((void)client);
-	printf("Connected!\n");
-	update_screen(false);
-}
-
-void onclose(ws_cli_conn_t  client)
-{
-	((void)client);
-	printf("Disconnected!\n");
+	end:
+		rom_release(rom);
+		return status;
 }
 
-int handle_ws_event_rom(const cJSON *json) {
-	const cJSON *r = NULL;
+int handle_ws_event_ses(ws_cli_conn_t client, const cJSON *json) {
+	const cJSON *i = NULL;
 	int status = 0;
 
-	r = cJSON_GetObjectItemCaseSensitive(json, "r");
-	if (r == NULL) {
-		fprintf(stderr, "lod event: no item \"r\"\n");
+	i = cJSON_GetObjectItemCaseSensitive(json, "i");
+	if (i == NULL) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ses event: no item \"i\"\n");
 		status = 1;
 		goto end;
 	}
-	if (!cJSON_IsString(r)) {
-		fprintf(stderr, "lod event: item \"r\" has invalid type\n");
+	if (!(cJSON_IsString(i) && (i->valuestring != NULL))) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ses event: item \"i\" has invalid type\n");
 		status = 1;
 		goto end;
 	}
-	if (r->valuestring == NULL) {
-		fprintf(stderr, "lod event: item \"r\" is a null pointer\n");
+	if (join_session(client, i->valuestring) != 0) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ses event: no session \"%s\"\n", i->valuestring);
 		status = 1;
 		goto end;
 	}
-	const unsigned long int len = strlen(r->valuestring);
-	if (len != BASE64_ROM_SIZE) {
-		fprintf(
-			stderr,
-			"lod event: item \"r\" is the wrong size: expected %d but got %lu\n",
-			BASE64_ROM_SIZE,
-			len);
-		status = 1;
-		goto end;
+
+	end:
+		return status;
+}
+
+int handle_ws_event_cfg(ws_cli_conn_t client, const cJSON *json) {
+	const cJSON *b = NULL;
+	const cJSON *d = NULL;
+	const cJSON *f = NULL;
+	const cJSON *l = NULL;
+	client_options_t options = {0};
+	int status = 0;
+
+	// binary screen frames (optional, defaults to the handshake subprotocol)
+	options.binary = client_negotiated_binary(client);
+	b = cJSON_GetObjectItemCaseSensitive(json, "b");
+	if (b != NULL) {
+		if (!cJSON_IsNumber(b)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: item \"b\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (!(b->valueint == 0 || b->valueint == 1)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: invalid value \"b\": %d\n", b->valueint);
+			status = 1;
+			goto end;
+		}
+		options.binary = b->valueint;
 	}
 
-	g_rom_b64 = (char *)malloc(len + 1);
-	strcpy(g_rom_b64, r->valuestring);
+	// delta screen updates (optional)
+	d = cJSON_GetObjectItemCaseSensitive(json, "d");
+	if (d != NULL) {
+		if (!cJSON_IsNumber(d)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: item \"d\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (!(d->valueint == 0 || d->valueint == 1)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: invalid value \"d\": %d\n", d->valueint);
+			status = 1;
+			goto end;
+		}
+		options.delta = d->valueint;
+	}
+
+	// maximum screen frame rate (optional)
+	f = cJSON_GetObjectItemCaseSensitive(json, "f");
+	if (f != NULL) {
+		if (!cJSON_IsNumber(f)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: item \"f\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (!(f->valueint >= 1 && f->valueint <= SESSION_FRAMERATE)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: invalid value \"f\": %d\n", f->valueint);
+			status = 1;
+			goto end;
+		}
+		options.max_fps = f->valueint;
+	}
+
+	// log events (optional)
+	l = cJSON_GetObjectItemCaseSensitive(json, "l");
+	if (l != NULL) {
+		if (!cJSON_IsNumber(l)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: item \"l\" has invalid type\n");
+			status = 1;
+			goto end;
+		}
+		if (!(l->valueint == 0 || l->valueint == 1)) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "cfg event: invalid value \"l\": %d\n", l->valueint);
+			status = 1;
+			goto end;
+		}
+		options.logs = l->valueint;
+	}
+
+	session_configure_client(client, &options);
 
 	end:
 		return status;
 }
 
-int handle_ws_event_btn(const cJSON *json) {
+int handle_ws_event_key(ws_cli_conn_t client) {
+	session_request_keyframe(client);
+	return 0;
+}
+
+int handle_ws_event_btn(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = NULL;
 	const cJSON *b = NULL;
 	const cJSON *s = NULL;
 	int status = 0;
@@ -356,12 +361,12 @@ int handle_ws_event_btn(const cJSON *json) {
 	// button code
 	b = cJSON_GetObjectItemCaseSensitive(json, "b");
 	if (b == NULL) {
-		fprintf(stderr, "btn event: no item \"b\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: no item \"b\"\n");
 		status = 1;
 		goto end;
 	}
 	if (!cJSON_IsNumber(b)) {
-		fprintf(stderr, "btn event: item \"b\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: item \"b\" has invalid type\n");
     	status = 1;
     	goto end;
     }
@@ -369,7 +374,7 @@ int handle_ws_event_btn(const cJSON *json) {
 	if (!(btn_code == BTN_LEFT || btn_code == BTN_RIGHT ||
 		  btn_code == BTN_MIDDLE || btn_code == BTN_TAP))
 	{
-		fprintf(stderr, "btn event: invalid button code \"b\": %d\n",
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: invalid button code \"b\": %d\n",
 		        btn_code);
 		status = 1;
 		goto end;
@@ -378,41 +383,48 @@ int handle_ws_event_btn(const cJSON *json) {
 	// button state
     s = cJSON_GetObjectItemCaseSensitive(json, "s");
 	if (s == NULL) {
-		fprintf(stderr, "btn event: no item \"s\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: no item \"s\"\n");
 		status = 1;
 		goto end;
 	}
 	if (!cJSON_IsNumber(s)) {
-		fprintf(stderr, "btn event: item \"s\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: item \"s\" has invalid type\n");
 		status = 1;
 		goto end;
 	}
 	const int btn_status = s->valueint;
 	if (!(btn_status == BTN_STATE_PRESSED || btn_status == BTN_STATE_RELEASED)) {
-		fprintf(stderr, "btn event: invalid button status \"s\": %d\n",
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "btn event: invalid button status \"s\": %d\n",
 		        btn_status);
 		status = 1;
 		goto end;
 	}
 
-	btn_buffer[btn_code] = btn_status;
+	session = get_client_session(client, "btn");
+	if (session == NULL) {
+		status = 1;
+		goto end;
+	}
+	status = session_set_button(session, btn_code, btn_status);
 
 	end:
+		session_release(session);
 		return status;
 }
 
-int handle_ws_event_mod(const cJSON *json) {
+int handle_ws_event_mod(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = NULL;
 	const cJSON *m = NULL;
 	int status = 0;
 
 	m = cJSON_GetObjectItemCaseSensitive(json, "m");
 	if (m == NULL) {
-		fprintf(stderr, "mod event: no item \"m\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "mod event: no item \"m\"\n");
 		status = 1;
 		goto end;
 	}
 	if (!cJSON_IsNumber(m)) {
-		fprintf(stderr, "mod event: item \"m\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "mod event: item \"m\" has invalid type\n");
 		status = 1;
 		goto end;
 	}
@@ -421,98 +433,169 @@ int handle_ws_event_mod(const cJSON *json) {
 		  mod_code == EXEC_MODE_STEP || mod_code == EXEC_MODE_NEXT ||
 		  mod_code == EXEC_MODE_TO_CALL || mod_code == EXEC_MODE_TO_RET))
 	{
-		fprintf(stderr, "mod event: invalid button code \"m\": %d\n",
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "mod event: invalid button code \"m\": %d\n",
 				mod_code);
 		status = 1;
 		goto end;
 	}
 
-	tamalib_set_exec_mode(mod_code);
+	session = get_client_session(client, "mod");
+	if (session == NULL) {
+		status = 1;
+		goto end;
+	}
+	status = session_set_exec_mode(session, mod_code);
 
 	end:
+		session_release(session);
 		return status;
 }
 
-int handle_ws_event_spd(const cJSON *json) {
+int handle_ws_event_spd(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = NULL;
 	const cJSON *s = NULL;
 	int status = 0;
 
 	s = cJSON_GetObjectItemCaseSensitive(json, "s");
 	if (s == NULL) {
-		fprintf(stderr, "spd event: no item \"s\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "spd event: no item \"s\"\n");
 		status = 1;
 		goto end;
 	}
 	if (!cJSON_IsNumber(s)) {
-		fprintf(stderr, "spd event: item \"s\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "spd event: item \"s\" has invalid type\n");
 		status = 1;
 		goto end;
 	}
 	const int spd_code = s->valueint;
 	if (!(spd_code == SPEED_UNLIMITED || spd_code == SPEED_1X || spd_code == SPEED_10X))
 	{
-		fprintf(stderr, "spd event: invalid button code \"s\": %d\n",
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "spd event: invalid button code \"s\": %d\n",
 				spd_code);
 		status = 1;
 		goto end;
 	}
 
-	tamalib_set_speed(spd_code);
+	session = get_client_session(client, "spd");
+	if (session == NULL) {
+		status = 1;
+		goto end;
+	}
+	status = session_set_speed(session, spd_code);
 
 	end:
+		session_release(session);
 		return status;
 }
 
-int handle_ws_event_end() {
-	g_end_action = true;
-	return 0;
+int handle_ws_event_end(ws_cli_conn_t client) {
+	session_t *session = get_client_session(client, "end");
+	if (session == NULL) {
+		return 1;
+	}
+	int status = session_request_end(session);
+	session_release(session);
+	return status;
 }
 
-int handle_ws_event_sav(const cJSON *json) {
-	g_sav_action = true;
-	return 0;
+int handle_ws_event_sav(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = get_client_session(client, "sav");
+	if (session == NULL) {
+		return 1;
+	}
+	int status = session_request_save(session);
+	session_release(session);
+	return status;
 }
 
-int handle_ws_event_lod(const cJSON *json) {
+int handle_ws_event_lod(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = NULL;
 	const cJSON *s = NULL;
 	int status = 0;
 
 	s = cJSON_GetObjectItemCaseSensitive(json, "s");
 	if (s == NULL) {
-		fprintf(stderr, "lod event: no item \"s\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "lod event: no item \"s\"\n");
 		status = 1;
 		goto end;
 	}
 	if (!cJSON_IsString(s)) {
-		fprintf(stderr, "lod event: item \"s\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "lod event: item \"s\" has invalid type\n");
 		status = 1;
 		goto end;
 	}
 	if (s->valuestring == NULL) {
-		fprintf(stderr, "lod event: item \"s\" is a null pointer\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "lod event: item \"s\" is a null pointer\n");
 		status = 1;
 		goto end;
 	}
 	const unsigned long int len = strlen(s->valuestring);
-	if (len != BASE64_STATE_SIZE) {
-		fprintf(
-			stderr,
-			"lod event: item \"s\" is the wrong size: expected %d but got %lu\n",
-			BASE64_STATE_SIZE,
+	if (len != BASE64_STATE_SIZE && len != BASE64_STATE_V3_SIZE) {
+		LOGGER(
+			LOGGER_WARN, LOGGER_CAT_WS,
+			"lod event: item \"s\" is the wrong size: expected %d or %d but got %lu\n",
+			(int) BASE64_STATE_SIZE,
+			(int) BASE64_STATE_V3_SIZE,
 			len);
 		status = 1;
 		goto end;
 	}
 
-	g_load_state_save_b64 = (char *)malloc(len + 1);
-	strcpy(g_load_state_save_b64, s->valuestring);
-	g_lod_action = true;
+	session = get_client_session(client, "lod");
+	if (session == NULL) {
+		status = 1;
+		goto end;
+	}
+	status = session_request_load(session, s->valuestring);
+
+	end:
+		session_release(session);
+		return status;
+}
+
+int handle_ws_event_ffw(ws_cli_conn_t client, const cJSON *json) {
+	session_t *session = NULL;
+	const cJSON *d = NULL;
+	int status = 0;
+
+	d = cJSON_GetObjectItemCaseSensitive(json, "d");
+	if (d == NULL) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ffw event: no item \"d\"\n");
+		status = 1;
+		goto end;
+	}
+	if (!cJSON_IsNumber(d)) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ffw event: item \"d\" has invalid type\n");
+		status = 1;
+		goto end;
+	}
+	if (!(d->valuedouble >= 0 && d->valuedouble <= SESSION_FFW_MAX_S)) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "ffw event: invalid duration \"d\": %g\n",
+				d->valuedouble);
+		status = 1;
+		goto end;
+	}
+
+	session = get_client_session(client, "ffw");
+	if (session == NULL) {
+		status = 1;
+		goto end;
+	}
+	status = session_fast_forward(session, (uint32_t) d->valuedouble);
 
 	end:
+		session_release(session);
 		return status;
 }
 
-int handle_ws_message(const unsigned char *msg)
+int handle_ws_event_sta(ws_cli_conn_t client) {
+	char msg[STATS_JSON_MAX_SIZE];
+	size_t msg_size = stats_encode_json(msg);
+	outbox_send(client, msg, msg_size, FRM_TXT, METRICS_EVENT_STA);
+	return 0;
+}
+
+int handle_ws_message(ws_cli_conn_t client, const unsigned char *msg)
 {
 	const cJSON *t = NULL;
 	const cJSON *e = NULL;
@@ -523,7 +606,7 @@ int handle_ws_message(const unsigned char *msg)
         const char *error_ptr = cJSON_GetErrorPtr();
         if (error_ptr != NULL)
         {
-            fprintf(stderr, "WS message: JSON error before: %s\n", error_ptr);
+            LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "WS message: JSON error before: %s\n", error_ptr);
         }
         status = 1;
         goto end;
@@ -532,12 +615,12 @@ int handle_ws_message(const unsigned char *msg)
 	// event type
     t = cJSON_GetObjectItemCaseSensitive(json, "t");
 	if (t == NULL) {
-		fprintf(stderr, "WS message: no item \"t\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "WS message: no item \"t\"\n");
 		status = 1;
 		goto end;
 	}
     if (!(cJSON_IsString(t) && (t->valuestring != NULL))) {
-		fprintf(stderr, "WS message: item \"t\" has invalid type\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "WS message: item \"t\" has invalid type\n");
     	status = 1;
     	goto end;
     }
@@ -545,34 +628,49 @@ int handle_ws_message(const unsigned char *msg)
 	// event payload
     e = cJSON_GetObjectItemCaseSensitive(json, "e");
 	if (e == NULL) {
-		fprintf(stderr, "WS message: no item \"e\"\n");
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "WS message: no item \"e\"\n");
 		status = 1;
 		goto end;
 	}
 
 	if (!strcmp(t->valuestring, "rom")) {
-		handle_ws_event_rom(e);
+		handle_ws_event_rom(client, e);
+	}
+	else if (!strcmp(t->valuestring, "ses")) {
+		handle_ws_event_ses(client, e);
+	}
+	else if (!strcmp(t->valuestring, "cfg")) {
+		handle_ws_event_cfg(client, e);
+	}
+	else if (!strcmp(t->valuestring, "key")) {
+		handle_ws_event_key(client);
 	}
 	else if (!strcmp(t->valuestring, "btn")) {
-		handle_ws_event_btn(e);
+		handle_ws_event_btn(client, e);
 	}
 	else if (!strcmp(t->valuestring, "mod")) {
-		handle_ws_event_mod(e);
+		handle_ws_event_mod(client, e);
 	}
 	else if (!strcmp(t->valuestring, "spd")) {
-		handle_ws_event_spd(e);
+		handle_ws_event_spd(client, e);
 	}
 	else if (!strcmp(t->valuestring, "end")) {
-		handle_ws_event_end();
+		handle_ws_event_end(client);
 	}
 	else if (!strcmp(t->valuestring, "sav")) {
-		handle_ws_event_sav(e);
+		handle_ws_event_sav(client, e);
 	}
 	else if (!strcmp(t->valuestring, "lod")) {
-		handle_ws_event_lod(e);
+		handle_ws_event_lod(client, e);
+	}
+	else if (!strcmp(t->valuestring, "ffw")) {
+		handle_ws_event_ffw(client, e);
+	}
+	else if (!strcmp(t->valuestring, "sta")) {
+		handle_ws_event_sta(client);
 	}
 	else {
-		fprintf(stderr, "WS message: unknown event type \"%s\"\n", t->valuestring);
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "WS message: unknown event type \"%s\"\n", t->valuestring);
 	}
 
 	end:
@@ -583,13 +681,17 @@ int handle_ws_message(const unsigned char *msg)
 void onmessage(ws_cli_conn_t client,
 	const unsigned char *msg, uint64_t size, int type)
 {
-	((void)client);
-	((void)msg);
-	((void)size);
-	((void)type);
-	char *client_address = ws_getaddress(client);
-	printf("[%s] %s\n", client_address, msg);
-	handle_ws_message(msg);
+	stats_set_arrival(scheduler_now());
+	/* Large payloads (ROMs, state saves) are truncated */
+	if (type == FRM_TXT) {
+		LOGGER(LOGGER_DEBUG, LOGGER_CAT_WS, "[%s] %.*s%s (%" PRIu64 " bytes)",
+			reactor_get_address(client), (int) (size < LOGGER_PAYLOAD_MAX ? size : LOGGER_PAYLOAD_MAX),
+			msg, (size > LOGGER_PAYLOAD_MAX) ? "..." : "", size);
+	} else {
+		LOGGER(LOGGER_DEBUG, LOGGER_CAT_WS, "[%s] binary message (%" PRIu64 " bytes)",
+			reactor_get_address(client), size);
+	}
+	handle_ws_message(client, msg);
 }
 
 int main (int argc, const char * argv[]) {
@@ -597,30 +699,59 @@ int main (int argc, const char * argv[]) {
 	const char *WS_HOST = getenv("TAMA_WS_HOST");
 	WS_HOST = (WS_HOST != NULL) ? WS_HOST: "127.0.0.1";
 
-	struct ws_server ws = {
-		.host = WS_HOST,
-		.port = WS_PORT,
-		.thread_loop   = 1,
-		.timeout_ms    = 1000,
-		.evs.onopen    = &onopen,
-		.evs.onclose   = &onclose,
-		.evs.onmessage = &onmessage
+	const reactor_events_t ws_events = {
+		.onopen    = &onopen,
+		.onclose   = &onclose,
+		.onmessage = &onmessage,
+		.protocols = ws_protocols,
 	};
 
-	ws_socket(&ws);
+	const char *WS_WORKERS = getenv("TAMA_WS_WORKERS");
+	long n_workers = (WS_WORKERS != NULL) ? atol(WS_WORKERS) : SCHEDULER_DEFAULT_WORKERS;
+
+	const char *WS_SPIN_US = getenv("TAMA_WS_SPIN_US");
+	long spin_us = (WS_SPIN_US != NULL) ? atol(WS_SPIN_US) : SCHEDULER_DEFAULT_SPIN_US;
+
+	const char *WS_IO_THREADS = getenv("TAMA_WS_IO_THREADS");
+	long n_io_threads = (WS_IO_THREADS != NULL) ? atol(WS_IO_THREADS) : REACTOR_DEFAULT_THREADS;
+
+	const char *WS_STORE = getenv("TAMA_WS_STORE");
+	const char *WS_AUTOSAVE = getenv("TAMA_WS_AUTOSAVE");
+	long autosave_period = (WS_AUTOSAVE != NULL) ? atol(WS_AUTOSAVE) : SESSION_AUTOSAVE_PERIOD;
+
+	const char *WS_ROM = getenv("TAMA_WS_ROM");
+
+	const char *WS_METRICS_HOST = getenv("TAMA_WS_METRICS_HOST");
+	WS_METRICS_HOST = (WS_METRICS_HOST != NULL) ? WS_METRICS_HOST : "127.0.0.1";
+
+	const char *WS_METRICS_PORT = getenv("TAMA_WS_METRICS_PORT");
+	long metrics_port = (WS_METRICS_PORT != NULL) ? atol(WS_METRICS_PORT) : 0;
+
+	const char *WS_LOG = getenv("TAMA_WS_LOG");
+	if (WS_LOG != NULL) {
+		logger_configure(WS_LOG);
+	}
+	logger_init();
+
+	session_init();
+	if (WS_ROM != NULL) {
+		rom_cache_preload(WS_ROM);
+	}
+	if (WS_STORE != NULL && store_init(WS_STORE) == 0) {
+		session_set_autosave_period(autosave_period > 0 ? autosave_period : 0);
+		store_restore(&session_restore);
+	}
+
+	if (metrics_port > 0 && metrics_port <= UINT16_MAX) {
+		metrics_init(WS_METRICS_HOST, metrics_port);
+	}
 
-	// Wait for the program to be sent through the websocket
-	while (g_rom_b64 == NULL) {
-		sleep(1);
+	if (reactor_init(WS_HOST, WS_PORT, n_io_threads > 0 ? n_io_threads : 1, &ws_events)) {
+		return 1;
 	}
-	g_program = program_load_b64(g_rom_b64, &g_program_size);
-	free(g_rom_b64);
 
-    tamalib_register_hal(&hal);
-    tamalib_init(g_program, NULL, 1000000);
-	fprintf(stderr, "Starting emulation\n");
-    tamalib_mainloop();
-    tamalib_release();
+	scheduler_set_spin(spin_us > 0 ? spin_us : 0);
+	scheduler_run(n_workers > 0 ? n_workers : 1);
 
 	return 0;
 }
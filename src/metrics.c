@@ -0,0 +1,405 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Metrics of the server, in the Prometheus text format. They are served over
+ * HTTP on a separate port by a dedicated thread, so that scraping never
+ * delays the websocket clients:
+ *
+ * - /metrics: server-wide counters and gauges, and the latency percentiles of
+ *   stats.h. Its size does not depend on the number of sessions.
+ * - /metrics/sessions: the metrics of each session.
+ * - /log: the log levels of each category (see logger_configure), which
+ *   "POST /log?warn,ws=debug" sets at runtime.
+ *
+ * Counters are updated with relaxed atomic operations, at most once per
+ * message queued or per quantum.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "session.h"
+#include "stats.h"
+
+metrics_t g_metrics;
+
+static const char * const g_event_names[METRICS_EVENT_NUM] = {
+	[METRICS_EVENT_SES] = "ses",
+	[METRICS_EVENT_SCR] = "scr",
+	[METRICS_EVENT_SCD] = "scd",
+	[METRICS_EVENT_FRQ] = "frq",
+	[METRICS_EVENT_LOG] = "log",
+	[METRICS_EVENT_SAV] = "sav",
+	[METRICS_EVENT_STA] = "sta",
+	[METRICS_EVENT_END] = "end",
+	[METRICS_EVENT_FFW] = "ffw",
+};
+
+typedef struct {
+	uint64_t sessions;
+	uint64_t headless;
+	uint64_t subscribers;
+	uint32_t lag_max;
+	uint64_t lag_sum;
+} metrics_sessions_t;
+
+static void metrics_header(FILE *f, const char *name, const char *type,
+	const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_counter(FILE *f, const char *name, const char *help,
+	atomic_uint_fast64_t *counter)
+{
+	metrics_header(f, name, "counter", help);
+	fprintf(f, "%s %" PRIuFAST64 "\n", name,
+		atomic_load_explicit(counter, memory_order_relaxed));
+}
+
+static void metrics_gauge(FILE *f, const char *name, const char *help,
+	uint64_t value)
+{
+	metrics_header(f, name, "gauge", help);
+	fprintf(f, "%s %" PRIu64 "\n", name, value);
+}
+
+static void metrics_aggregate_session(session_t *s, void *arg)
+{
+	metrics_sessions_t *m = arg;
+	uint32_t lag = atomic_load_explicit(&s->lag_us, memory_order_relaxed);
+
+	m->sessions++;
+	pthread_mutex_lock(&s->lock);
+	m->subscribers += s->n_subscribers;
+	m->headless += (s->n_subscribers == 0);
+	pthread_mutex_unlock(&s->lock);
+	m->lag_max = (lag > m->lag_max) ? lag : m->lag_max;
+	m->lag_sum += lag;
+}
+
+static void metrics_write_server(FILE *f)
+{
+	metrics_sessions_t m = {0};
+	outbox_usage_t outbox;
+	uint64_t clients = 0;
+
+	session_foreach(&metrics_aggregate_session, &m);
+	outbox_get_usage(&outbox);
+
+	metrics_gauge(f, "tama_ws_sessions", "Running sessions", m.sessions);
+	metrics_gauge(f, "tama_ws_sessions_headless", "Running sessions without subscribers", m.headless);
+	metrics_gauge(f, "tama_ws_clients", "Connected clients",
+		atomic_load_explicit(&g_metrics.clients, memory_order_relaxed));
+	metrics_gauge(f, "tama_ws_subscribers", "Clients subscribed to a session", m.subscribers);
+	metrics_gauge(f, "tama_ws_outbox_bytes", "Bytes queued for the clients, not yet sent", outbox.total_bytes);
+	metrics_gauge(f, "tama_ws_outbox_max_bytes", "Bytes queued for the client with the most bytes queued", outbox.max_bytes);
+	/* A snapshot rather than observations: the buckets count the clients
+	 * by their current depth, and may decrease.
+	 */
+	metrics_header(f, "tama_ws_outbox_depth_bytes", "histogram", "Clients by bytes queued and not yet sent");
+	for (size_t i = 0; i < OUTBOX_DEPTH_BUCKETS; i++) {
+		clients += outbox.depth[i];
+		fprintf(f, "tama_ws_outbox_depth_bytes_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+			g_outbox_depth_bounds[i], clients);
+	}
+	fprintf(f, "tama_ws_outbox_depth_bytes_bucket{le=\"+Inf\"} %" PRIu64 "\n", outbox.clients);
+	fprintf(f, "tama_ws_outbox_depth_bytes_sum %" PRIu64 "\n", outbox.total_bytes);
+	fprintf(f, "tama_ws_outbox_depth_bytes_count %" PRIu64 "\n", outbox.clients);
+	metrics_gauge(f, "tama_ws_lag_max_us", "Maximum delay of the emulated time behind the wall clock, over all sessions", m.lag_max);
+	metrics_gauge(f, "tama_ws_lag_sum_us", "Sum of the delays of the emulated time behind the wall clock, over all sessions", m.lag_sum);
+
+	metrics_counter(f, "tama_ws_quanta_total", "Quanta run by the scheduler", &g_metrics.quanta);
+	metrics_counter(f, "tama_ws_emulated_instructions_total", "CPU instructions emulated", &g_metrics.instructions);
+	metrics_counter(f, "tama_ws_emulated_ticks_total", "CPU clock cycles emulated, at 32768 Hz", &g_metrics.ticks);
+	metrics_counter(f, "tama_ws_frames_sent_total", "Screen updates sent to a client", &g_metrics.frames_sent);
+	metrics_counter(f, "tama_ws_frames_identical_total", "Screens not sent, as identical to the previous one", &g_metrics.frames_identical);
+	metrics_counter(f, "tama_ws_frames_capped_total", "Screen updates skipped by the frame rate cap of a client", &g_metrics.frames_capped);
+	metrics_counter(f, "tama_ws_frames_coalesced_total", "Screen updates replaced by a newer one before being sent", &g_metrics.frames_coalesced);
+	metrics_counter(f, "tama_ws_clients_disconnected_total", "Clients disconnected for staying over their outbound budget", &g_metrics.clients_disconnected);
+	metrics_counter(f, "tama_ws_commands_dropped_total", "Client actions dropped, as too many were pending", &g_metrics.commands_dropped);
+	metrics_counter(f, "tama_ws_logs_dropped_total", "Log events not sent, above the rate limit of a session", &g_metrics.logs_dropped);
+
+	metrics_header(f, "tama_ws_sent_messages_total", "counter", "Messages queued for the clients, by event type");
+	for (int i = 0; i < METRICS_EVENT_NUM; i++) {
+		fprintf(f, "tama_ws_sent_messages_total{event=\"%s\"} %" PRIuFAST64 "\n", g_event_names[i],
+			atomic_load_explicit(&g_metrics.sent_messages[i], memory_order_relaxed));
+	}
+	metrics_header(f, "tama_ws_sent_bytes_total", "counter", "Bytes queued for the clients, by event type");
+	for (int i = 0; i < METRICS_EVENT_NUM; i++) {
+		fprintf(f, "tama_ws_sent_bytes_total{event=\"%s\"} %" PRIuFAST64 "\n", g_event_names[i],
+			atomic_load_explicit(&g_metrics.sent_bytes[i], memory_order_relaxed));
+	}
+
+	static const double quantiles[] = {0.5, 0.99, 0.999};
+	metrics_header(f, "tama_ws_input_latency_us", "summary", "Latency from the arrival of a btn event to the next screen update, by stage");
+	for (int i = 0; i < STATS_STAGE_NUM; i++) {
+		for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++) {
+			fprintf(f, "tama_ws_input_latency_us{stage=\"%s\",quantile=\"%g\"} %" PRIu32 "\n",
+				stats_stage_name(i), quantiles[j], stats_percentile(i, quantiles[j]));
+		}
+		fprintf(f, "tama_ws_input_latency_us_sum{stage=\"%s\"} %" PRIu64 "\n", stats_stage_name(i), stats_sum(i));
+		fprintf(f, "tama_ws_input_latency_us_count{stage=\"%s\"} %" PRIu64 "\n", stats_stage_name(i), stats_count(i));
+	}
+}
+
+static void metrics_write_session_subscribers(session_t *s, void *arg)
+{
+	pthread_mutex_lock(&s->lock);
+	size_t n_subscribers = s->n_subscribers;
+	pthread_mutex_unlock(&s->lock);
+	fprintf(arg, "tama_ws_session_subscribers{session=\"%s\"} %zu\n", s->id, n_subscribers);
+}
+
+static void metrics_write_session_lag(session_t *s, void *arg)
+{
+	fprintf(arg, "tama_ws_session_lag_us{session=\"%s\"} %" PRIuFAST32 "\n", s->id,
+		atomic_load_explicit(&s->lag_us, memory_order_relaxed));
+}
+
+static void metrics_write_session_ticks(session_t *s, void *arg)
+{
+	fprintf(arg, "tama_ws_session_emulated_ticks_total{session=\"%s\"} %" PRIuFAST64 "\n", s->id,
+		atomic_load_explicit(&s->ticks, memory_order_relaxed));
+}
+
+/**
+ * @brief Write the metrics of each session
+ *
+ * The samples of a metric must be contiguous, hence one pass over the
+ * sessions per metric.
+ */
+static void metrics_write_sessions(FILE *f)
+{
+	metrics_header(f, "tama_ws_session_subscribers", "gauge", "Clients subscribed to the session");
+	session_foreach(&metrics_write_session_subscribers, f);
+	metrics_header(f, "tama_ws_session_lag_us", "gauge", "Delay of the emulated time behind the wall clock");
+	session_foreach(&metrics_write_session_lag, f);
+	metrics_header(f, "tama_ws_session_emulated_ticks_total", "counter", "CPU clock cycles emulated, at 32768 Hz");
+	session_foreach(&metrics_write_session_ticks, f);
+}
+
+static int metrics_write_all(int fd, const char *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the log levels of each category, after setting them if requested
+ *
+ * @param query query of a POST request, i.e. "?" followed by the levels to
+ * set (see logger_configure) and the rest of the request line, or NULL
+ * @return the HTTP status
+ */
+static const char * metrics_serve_log(FILE *f, char *query)
+{
+	char spec[LOGGER_CONFIG_SIZE];
+	const char *status = "200 OK";
+
+	if (query != NULL) {
+		if (*query != '?') {
+			fprintf(f, "Missing log levels, e.g. POST /log?warn,ws=debug\n");
+			return "400 Bad Request";
+		}
+		query[1 + strcspn(query + 1, " \r\n")] = '\0';
+		if (logger_configure(query + 1)) {
+			status = "400 Bad Request";
+		}
+		logger_get_config(spec);
+		LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Log levels set to %s\n", spec);
+	}
+	logger_get_config(spec);
+	fprintf(f, "%s\n", spec);
+	return status;
+}
+
+/**
+ * @brief Answer a scrape, or a request to /log
+ */
+static void metrics_serve(int fd)
+{
+	char request[METRICS_REQUEST_MAX_SIZE + 1];
+	char header[256];
+	size_t request_size = 0;
+	char *body = NULL;
+	size_t body_size = 0;
+	const char *status = "200 OK";
+	struct timeval timeout = {
+		.tv_sec = METRICS_TIMEOUT_MS / 1000,
+		.tv_usec = (METRICS_TIMEOUT_MS % 1000) * 1000,
+	};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	/* Only the request line matters */
+	while (request_size < METRICS_REQUEST_MAX_SIZE) {
+		ssize_t n = recv(fd, request + request_size, METRICS_REQUEST_MAX_SIZE - request_size, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		request_size += n;
+		request[request_size] = '\0';
+		if (strstr(request, "\r\n") != NULL) {
+			break;
+		}
+	}
+	request[request_size] = '\0';
+	const bool post = strncmp(request, "POST ", 5) == 0;
+	if (strncmp(request, "GET ", 4) != 0 && !post) {
+		return;
+	}
+	char *path = request + (post ? 5 : 4);
+	size_t path_size = strcspn(path, " ?\r\n");
+	const bool log = path_size == 4 && strncmp(path, "/log", 4) == 0;
+
+	FILE *f = open_memstream(&body, &body_size);
+	if (f == NULL) {
+		return;
+	}
+	if (post && !log) {
+		status = "405 Method Not Allowed";
+		fprintf(f, "Method not allowed\n");
+	} else if (log) {
+		status = metrics_serve_log(f, post ? path + path_size : NULL);
+	} else if (path_size == 8 && strncmp(path, "/metrics", 8) == 0) {
+		metrics_write_server(f);
+	} else if (path_size == 17 && strncmp(path, "/metrics/sessions", 17) == 0) {
+		metrics_write_sessions(f);
+	} else {
+		status = "404 Not Found";
+		fprintf(f, "Not found\n");
+	}
+	fclose(f);
+
+	int header_size = snprintf(header, sizeof(header),
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n\r\n",
+		status, body_size);
+	if (metrics_write_all(fd, header, header_size) == 0) {
+		metrics_write_all(fd, body, body_size);
+	}
+	free(body);
+}
+
+static void * metrics_thread(void *arg)
+{
+	int server_fd = (int) (intptr_t) arg;
+
+	for (;;) {
+		int fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR) {
+				LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Metrics: cannot accept connection: %s\n", strerror(errno));
+				usleep(100000);
+			}
+			continue;
+		}
+		metrics_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start serving the metrics over HTTP
+ *
+ * @param host address to listen on
+ * @param port port to listen on
+ * @return 0 on success, 1 on failure
+ */
+int metrics_init(const char *host, uint16_t port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *addrs = NULL;
+	char port_str[8];
+	int server_fd = -1;
+	int status = 0;
+	pthread_t thread;
+
+	snprintf(port_str, sizeof(port_str), "%u", port);
+	if (getaddrinfo(host, port_str, &hints, &addrs) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Metrics: cannot resolve %s\n", host);
+		return 1;
+	}
+	for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+		int reuse = 1;
+		server_fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (server_fd < 0) {
+			continue;
+		}
+		setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (bind(server_fd, a->ai_addr, a->ai_addrlen) == 0 && listen(server_fd, 16) == 0) {
+			break;
+		}
+		close(server_fd);
+		server_fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if (server_fd < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Metrics: cannot listen on %s:%u: %s\n", host, port, strerror(errno));
+		status = 1;
+		goto end;
+	}
+
+	if (pthread_create(&thread, NULL, &metrics_thread, (void *) (intptr_t) server_fd)) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Metrics: cannot start thread\n");
+		close(server_fd);
+		status = 1;
+		goto end;
+	}
+	pthread_detach(thread);
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Serving metrics on http://%s:%u/metrics\n", host, port);
+
+	end:
+		return status;
+}
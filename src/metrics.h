@@ -0,0 +1,78 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_REQUEST_MAX_SIZE 1024
+// Maximum size of the request line and headers of a scrape.
+
+#define METRICS_TIMEOUT_MS 1000
+// Time after which a scrape that does not send its request is dropped.
+
+/**
+ * @brief Types of the events sent to the clients, for the metrics of bytes
+ * sent. Binary frames are accounted for with the event they replace.
+ */
+typedef enum {
+	METRICS_EVENT_SES,
+	METRICS_EVENT_SCR,
+	METRICS_EVENT_SCD,
+	METRICS_EVENT_FRQ,
+	METRICS_EVENT_LOG,
+	METRICS_EVENT_SAV,
+	METRICS_EVENT_STA,
+	METRICS_EVENT_END,
+	METRICS_EVENT_FFW,
+	METRICS_EVENT_NUM,
+} metrics_event_t;
+
+/**
+ * @brief Server-wide counters, updated with relaxed atomic operations
+ */
+typedef struct {
+	atomic_uint_fast64_t sent_messages[METRICS_EVENT_NUM];
+	atomic_uint_fast64_t sent_bytes[METRICS_EVENT_NUM];
+	atomic_uint_fast64_t frames_sent;		// Screen updates sent to a client
+	atomic_uint_fast64_t frames_identical;	// Screens not sent, identical to the previous one
+	atomic_uint_fast64_t frames_capped;		// Screen updates skipped by the frame rate cap of a client
+	atomic_uint_fast64_t frames_coalesced;	// Screen updates replaced by a newer one before being sent
+	atomic_uint_fast64_t instructions;		// Instructions emulated
+	atomic_uint_fast64_t ticks;				// CPU clock cycles emulated
+	atomic_uint_fast64_t quanta;
+	atomic_uint_fast64_t commands_dropped;
+	atomic_uint_fast64_t logs_dropped;		// Log events not sent, above the rate limit of a session
+	atomic_uint_fast64_t clients_disconnected;	// Slow clients disconnected
+	atomic_int_fast64_t clients;			// Connected clients
+} metrics_t;
+
+extern metrics_t g_metrics;
+
+static inline void metrics_add(atomic_uint_fast64_t *counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+int metrics_init(const char *host, uint16_t port);
+
+#endif /* _METRICS_H_ */
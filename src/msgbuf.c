@@ -0,0 +1,89 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgbuf.h"
+
+/**
+ * @brief Create a buffer holding a copy of raw bytes (e.g. an HTTP response)
+ *
+ * @return the buffer, with a single reference, or NULL on allocation failure
+ */
+msgbuf_t * msgbuf_create(const void *data, size_t size)
+{
+	msgbuf_t *b = malloc(sizeof(msgbuf_t) + size);
+	if (b == NULL) {
+		return NULL;
+	}
+	atomic_init(&b->refcount, 1);
+	memcpy(b->storage, data, size);
+	b->data = b->storage;
+	b->size = size;
+	return b;
+}
+
+/**
+ * @brief Create a buffer holding an unfragmented WebSocket frame
+ *
+ * The header is written right before the payload, so that the frame is
+ * contiguous whatever the size of its header.
+ *
+ * @param type opcode of the frame (e.g. FRM_TXT or FRM_BIN)
+ * @return the buffer, with a single reference, or NULL on allocation failure
+ */
+msgbuf_t * msgbuf_frame(const void *payload, size_t size, int type)
+{
+	msgbuf_t *b = malloc(sizeof(msgbuf_t) + MSGBUF_MAX_HEADER_SIZE + size);
+	if (b == NULL) {
+		return NULL;
+	}
+	uint8_t *p = b->storage + MSGBUF_MAX_HEADER_SIZE;
+	memcpy(p, payload, size);
+
+	if (size < 126) {
+		*--p = size;
+	} else if (size <= UINT16_MAX) {
+		*--p = size;
+		*--p = size >> 8;
+		*--p = 126;
+	} else {
+		for (int i = 0; i < 8; i++) {
+			*--p = (uint64_t) size >> (8 * i);
+		}
+		*--p = 127;
+	}
+	*--p = 0x80 | type;
+
+	atomic_init(&b->refcount, 1);
+	b->data = p;
+	b->size = b->storage + MSGBUF_MAX_HEADER_SIZE + size - p;
+	return b;
+}
+
+/**
+ * @brief Drop a reference to a buffer, and free it if it was the last one
+ */
+void msgbuf_release(msgbuf_t *b)
+{
+	if (b != NULL && atomic_fetch_sub_explicit(&b->refcount, 1, memory_order_acq_rel) == 1) {
+		free(b);
+	}
+}
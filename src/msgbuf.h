@@ -0,0 +1,58 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MSGBUF_H_
+#define _MSGBUF_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MSGBUF_MAX_HEADER_SIZE 10
+// Maximum size of the header of a WebSocket frame sent by the server.
+
+/**
+ * @brief Reference-counted, immutable bytes written to client sockets
+ *
+ * An event sent to many clients (e.g. the screen updates of a session) is
+ * framed once, and the same buffer is queued for each of them. It is freed
+ * when the last client wrote it, or disconnected.
+ */
+typedef struct {
+	atomic_uint refcount;
+	size_t size;				// Size of data
+	const uint8_t *data;		// Bytes to write, in storage
+	uint8_t storage[];
+} msgbuf_t;
+
+msgbuf_t * msgbuf_create(const void *data, size_t size);
+msgbuf_t * msgbuf_frame(const void *payload, size_t size, int type);
+
+/**
+ * @brief Take a new reference to a buffer
+ */
+static inline msgbuf_t * msgbuf_acquire(msgbuf_t *b)
+{
+	atomic_fetch_add_explicit(&b->refcount, 1, memory_order_relaxed);
+	return b;
+}
+
+void msgbuf_release(msgbuf_t *b);
+
+#endif /* _MSGBUF_H_ */
@@ -0,0 +1,387 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Outbound queues of the clients. The threads that produce events (mostly
+ * the scheduler workers, at the end of each quantum) only copy them to the
+ * queue of each recipient, and notify the I/O thread serving the client (see
+ * reactor.h). That thread takes the queue once the previous batch was
+ * written to the socket, so that a slow client never stalls a session nor the
+ * other clients. Events sent to many clients are framed once, and queued by
+ * reference (see msgbuf.h).
+ *
+ * Screen updates are coalesced: a client has at most one screen update
+ * queued, replaced by newer ones. The other events (e.g. sav, end) are never
+ * dropped. A client that stays over its budget of queued bytes is
+ * disconnected.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "outbox.h"
+#include "scheduler.h"
+
+typedef struct outbox_msg {
+	msgbuf_t *buf;
+	metrics_event_t event;
+	struct outbox_msg *next;
+} outbox_msg_t;
+
+typedef struct outbox {
+	ws_cli_conn_t client;
+	pthread_mutex_t lock;		// Guards the queue and the flags
+	outbox_msg_t *head;
+	outbox_msg_t *tail;
+	outbox_msg_t *screen;		// Screen update in the queue, if any
+	atomic_size_t bytes;		// Bytes queued or being sent
+	uint64_t over_since;		// When the client went over its budget, see scheduler_now_us
+	bool over;
+	bool kill;					// The client is being disconnected
+	struct outbox *next;		// Next outbox in its hash bucket
+} outbox_t;
+
+/* Upper bounds of the buckets of outbox_usage_t: idle clients, then up to
+ * the hard limit. Clients above it are about to be disconnected, and only
+ * counted in the total.
+ */
+const uint64_t g_outbox_depth_bounds[OUTBOX_DEPTH_BUCKETS] = {
+	0, 4096, 16384, 65536, OUTBOX_MAX_BYTES, OUTBOX_HARD_MAX_BYTES,
+};
+
+static pthread_rwlock_t g_outboxes_lock = PTHREAD_RWLOCK_INITIALIZER;
+static outbox_t *g_outboxes[OUTBOX_BUCKETS] = {0};
+
+static uint32_t hash_client(ws_cli_conn_t client)
+{
+	uint64_t h = (uint64_t) client * 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (h >> 32);
+}
+
+static outbox_t ** outbox_find_locked(ws_cli_conn_t client)
+{
+	outbox_t **o = &g_outboxes[hash_client(client) % OUTBOX_BUCKETS];
+	while (*o != NULL && (*o)->client != client) {
+		o = &(*o)->next;
+	}
+	return o;
+}
+
+/**
+ * @brief Find the outbox of a client, and lock it
+ *
+ * @return the locked outbox, or NULL if the client has none
+ */
+static outbox_t * outbox_lock(ws_cli_conn_t client)
+{
+	pthread_rwlock_rdlock(&g_outboxes_lock);
+	outbox_t *o = *outbox_find_locked(client);
+	if (o != NULL) {
+		pthread_mutex_lock(&o->lock);
+	}
+	pthread_rwlock_unlock(&g_outboxes_lock);
+	return o;
+}
+
+static void outbox_msg_free(outbox_msg_t *m)
+{
+	msgbuf_release(m->buf);
+	free(m);
+}
+
+static void outbox_free(outbox_t *o)
+{
+	while (o->head != NULL) {
+		outbox_msg_t *m = o->head;
+		o->head = m->next;
+		outbox_msg_free(m);
+	}
+	pthread_mutex_destroy(&o->lock);
+	free(o);
+}
+
+/**
+ * @brief Create the outbound queue of a client
+ *
+ * @return 0 on success, 1 on failure, in which case no event can be sent to
+ * the client
+ */
+int outbox_open(ws_cli_conn_t client)
+{
+	int status = 0;
+
+	outbox_t *o = calloc(1, sizeof(outbox_t));
+	if (o == NULL) {
+		return 1;
+	}
+	o->client = client;
+	pthread_mutex_init(&o->lock, NULL);
+
+	pthread_rwlock_wrlock(&g_outboxes_lock);
+	outbox_t **e = outbox_find_locked(client);
+	if (*e != NULL) {
+		status = 1;
+		goto end;
+	}
+	*e = o;
+
+	end:
+		pthread_rwlock_unlock(&g_outboxes_lock);
+		if (status != 0) {
+			outbox_free(o);
+		}
+		return status;
+}
+
+/**
+ * @brief Drop the outbound queue of a client, after it disconnected
+ */
+void outbox_close(ws_cli_conn_t client)
+{
+	pthread_rwlock_wrlock(&g_outboxes_lock);
+	outbox_t **e = outbox_find_locked(client);
+	outbox_t *o = *e;
+	if (o != NULL) {
+		*e = o->next;
+	}
+	pthread_rwlock_unlock(&g_outboxes_lock);
+	if (o != NULL) {
+		outbox_free(o);
+	}
+}
+
+/**
+ * @brief Check the budget of a client, after bytes were queued
+ *
+ * @note o->lock must be held.
+ * @return true if the client must be disconnected
+ */
+static bool outbox_check_budget_locked(outbox_t *o)
+{
+	size_t bytes = atomic_load(&o->bytes);
+
+	if (bytes <= OUTBOX_MAX_BYTES) {
+		o->over = false;
+		return false;
+	}
+	uint64_t now = scheduler_now_us();
+	if (!o->over) {
+		o->over = true;
+		o->over_since = now;
+	}
+	if (bytes > OUTBOX_HARD_MAX_BYTES ||
+		now - o->over_since > OUTBOX_SLOW_TIMEOUT_US) {
+		o->kill = true;
+	}
+	return o->kill;
+}
+
+/**
+ * @brief Queue an event for a client
+ *
+ * Screen updates (scr and scd events) replace the screen update already
+ * queued for the client, if any. The I/O thread of the client is notified
+ * when its queue was empty.
+ *
+ * @param buf WebSocket frame of the event, referenced by the queue until it
+ * is written
+ * @return 0 on success, 1 if the event cannot be queued
+ */
+int outbox_send_buf(ws_cli_conn_t client, msgbuf_t *buf, metrics_event_t event)
+{
+	const bool screen = (event == METRICS_EVENT_SCR || event == METRICS_EVENT_SCD);
+	outbox_msg_t *m;
+	bool notify = false;
+	bool kill = false;
+	size_t queued = 0;
+	int status = 0;
+
+	outbox_t *o = outbox_lock(client);
+	if (o == NULL) {
+		/* Client disconnected, or without an outbox (it could not be created) */
+		return 1;
+	}
+	if (o->kill) {
+		status = 1;
+		goto end;
+	}
+
+	if (screen && o->screen != NULL) {
+		m = o->screen;
+		atomic_fetch_sub(&o->bytes, m->buf->size);
+		msgbuf_release(m->buf);
+		metrics_add(&g_metrics.frames_coalesced, 1);
+	} else {
+		m = calloc(1, sizeof(outbox_msg_t));
+		if (m == NULL) {
+			status = 1;
+			goto end;
+		}
+		if (o->tail != NULL) {
+			o->tail->next = m;
+		} else {
+			o->head = m;
+			notify = true;
+		}
+		o->tail = m;
+		if (screen) {
+			o->screen = m;
+		}
+	}
+	m->buf = msgbuf_acquire(buf);
+	m->event = event;
+	atomic_fetch_add(&o->bytes, buf->size);
+	kill = outbox_check_budget_locked(o);
+	queued = atomic_load(&o->bytes);
+	metrics_add(&g_metrics.sent_messages[event], 1);
+	metrics_add(&g_metrics.sent_bytes[event], buf->size);
+
+	end:
+		pthread_mutex_unlock(&o->lock);
+		if (kill) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "[%s] Disconnecting slow client (%zu bytes queued)",
+				reactor_get_address(client), queued);
+			metrics_add(&g_metrics.clients_disconnected, 1);
+			reactor_close_client(client);
+		} else if (notify) {
+			reactor_notify(client);
+		}
+		return status;
+}
+
+/**
+ * @brief Queue an event for a single client
+ *
+ * Events sent to many clients should rather be framed once with
+ * msgbuf_frame(), and queued with outbox_send_buf().
+ *
+ * @return 0 on success, 1 if the event cannot be queued
+ */
+int outbox_send(ws_cli_conn_t client, const char *msg, size_t size, int type,
+	metrics_event_t event)
+{
+	msgbuf_t *buf = msgbuf_frame(msg, size, type);
+	if (buf == NULL) {
+		return 1;
+	}
+	int status = outbox_send_buf(client, buf, event);
+	msgbuf_release(buf);
+	return status;
+}
+
+/**
+ * @brief Check if a screen update is queued for a client
+ *
+ * The next screen update sent to the client replaces it, so that delta
+ * clients must then receive a keyframe.
+ */
+bool outbox_has_screen(ws_cli_conn_t client)
+{
+	outbox_t *o = outbox_lock(client);
+	if (o == NULL) {
+		return false;
+	}
+	bool screen = o->screen != NULL;
+	pthread_mutex_unlock(&o->lock);
+	return screen;
+}
+
+/**
+ * @brief Take the oldest events queued for a client, to write them to its
+ * socket
+ *
+ * The events stay accounted for in the budget of the client until they are
+ * released with outbox_release(), once written.
+ *
+ * @param bufs output array, which receives the references of the queue
+ * @param max_bufs size of bufs
+ * @param bytes incremented by the size of the events taken
+ * @return number of events taken
+ */
+size_t outbox_take(ws_cli_conn_t client, msgbuf_t **bufs, size_t max_bufs,
+	size_t *bytes)
+{
+	size_t n = 0;
+
+	outbox_t *o = outbox_lock(client);
+	if (o == NULL) {
+		return 0;
+	}
+	while (!o->kill && o->head != NULL && n < max_bufs) {
+		outbox_msg_t *m = o->head;
+		o->head = m->next;
+		if (o->screen == m) {
+			o->screen = NULL;
+		}
+		bufs[n++] = m->buf;
+		*bytes += m->buf->size;
+		free(m);
+	}
+	if (o->head == NULL) {
+		o->tail = NULL;
+	}
+	pthread_mutex_unlock(&o->lock);
+	return n;
+}
+
+/**
+ * @brief Remove events taken with outbox_take() from the budget of a client,
+ * once written to its socket
+ *
+ * A client that drained its queue back under its budget is no longer over
+ * it, even if no event was queued since.
+ */
+void outbox_release(ws_cli_conn_t client, size_t bytes)
+{
+	outbox_t *o = outbox_lock(client);
+	if (o != NULL) {
+		if (atomic_fetch_sub(&o->bytes, bytes) - bytes <= OUTBOX_MAX_BYTES) {
+			o->over = false;
+		}
+		pthread_mutex_unlock(&o->lock);
+	}
+}
+
+/**
+ * @brief Get the bytes queued for all the clients, and their distribution
+ * over the clients
+ */
+void outbox_get_usage(outbox_usage_t *usage)
+{
+	memset(usage, 0, sizeof(*usage));
+	pthread_rwlock_rdlock(&g_outboxes_lock);
+	for (size_t b = 0; b < OUTBOX_BUCKETS; b++) {
+		for (outbox_t *o = g_outboxes[b]; o != NULL; o = o->next) {
+			size_t bytes = atomic_load_explicit(&o->bytes, memory_order_relaxed);
+			usage->clients++;
+			usage->total_bytes += bytes;
+			usage->max_bytes = (bytes > usage->max_bytes) ? bytes : usage->max_bytes;
+			for (size_t i = 0; i < OUTBOX_DEPTH_BUCKETS; i++) {
+				if (bytes <= g_outbox_depth_bounds[i]) {
+					usage->depth[i]++;
+					break;
+				}
+			}
+		}
+	}
+	pthread_rwlock_unlock(&g_outboxes_lock);
+}
@@ -0,0 +1,75 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "msgbuf.h"
+#include "reactor.h"
+
+#define OUTBOX_BUCKETS 4096
+
+#define OUTBOX_MAX_BYTES (256 * 1024)
+// Outbound budget of a client: bytes queued and not yet sent. A client that
+// stays over its budget for OUTBOX_SLOW_TIMEOUT_US is disconnected.
+
+#define OUTBOX_HARD_MAX_BYTES (4 * OUTBOX_MAX_BYTES)
+// Bytes queued for a client above which it is disconnected right away.
+
+#define OUTBOX_SLOW_TIMEOUT_US 5000000
+// Time a client may stay over OUTBOX_MAX_BYTES before it is disconnected.
+
+#define OUTBOX_DEPTH_BUCKETS 6
+// Number of buckets of the distribution of the bytes queued per client, see
+// g_outbox_depth_bounds.
+
+extern const uint64_t g_outbox_depth_bounds[OUTBOX_DEPTH_BUCKETS];
+
+/**
+ * @brief Bytes queued for the clients
+ */
+typedef struct {
+	uint64_t clients;
+	uint64_t total_bytes;
+	uint64_t max_bytes;					// Of the client with the most bytes queued
+	uint64_t depth[OUTBOX_DEPTH_BUCKETS];	// Clients with more than the previous
+										// bound and at most
+										// g_outbox_depth_bounds[i] bytes queued
+} outbox_usage_t;
+
+int outbox_open(ws_cli_conn_t client);
+void outbox_close(ws_cli_conn_t client);
+
+int outbox_send(ws_cli_conn_t client, const char *msg, size_t size, int type,
+	metrics_event_t event);
+int outbox_send_buf(ws_cli_conn_t client, msgbuf_t *buf, metrics_event_t event);
+bool outbox_has_screen(ws_cli_conn_t client);
+
+size_t outbox_take(ws_cli_conn_t client, msgbuf_t **bufs, size_t max_bufs,
+	size_t *bytes);
+void outbox_release(ws_cli_conn_t client, size_t bytes);
+
+void outbox_get_usage(outbox_usage_t *usage);
+
+#endif /* _OUTBOX_H_ */
@@ -45,17 +45,47 @@
 
 #include <base64.h>
 
+#include "logger.h"
 #include "program.h"
 
-u12_t * program_load_b64(char *rom_b64, uint32_t *size)
+/**
+ * @brief Load a program from a binary ROM
+ *
+ * Each 12-bit instruction is stored in 2 bytes, big-endian.
+ *
+ * @param rom binary ROM
+ * @param rom_len size of the ROM, in bytes
+ * @param size set to the size of the program, in instructions
+ * @return the program, which must be freed by the caller, or NULL on failure
+ */
+u12_t * program_load(const uint8_t *rom, size_t rom_len, uint32_t *size)
 {
 	uint32_t i;
+	u12_t *program;
+
+	*size = rom_len / 2;
+
+	program = (u12_t *) malloc(*size * sizeof(u12_t));
+	if (program == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Cannot allocate ROM memory!\n");
+		return NULL;
+	}
+
+	for (i = 0; i < *size; i++) {
+		program[i] = rom[2*i+1] | ((rom[2*i] & 0xF) << 8);
+	}
+
+	return program;
+}
+
+u12_t * program_load_b64(char *rom_b64, uint32_t *size)
+{
 	size_t rom_len;
 	uint8_t *rom;
 	u12_t *program;
 
 	if (rom_b64 == NULL) {
-		fprintf(stderr, "FATAL: Cannot load ROM!\n");
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Cannot load ROM!\n");
 		return NULL;
 	}
 
@@ -63,18 +93,27 @@ u12_t * program_load_b64(char *rom_b64, uint32_t *size)
 		(unsigned char *) rom_b64,
 		strlen(rom_b64),
 		&rom_len);
-
-	*size = rom_len / 2;
-
-	program = (u12_t *) malloc(*size * sizeof(u12_t));
-	if (program == NULL) {
-		fprintf(stderr, "FATAL: Cannot allocate ROM memory!\n");
+	if (rom == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Cannot decode ROM!\n");
 		return NULL;
 	}
 
-	for (i = 0; i < *size; i++) {
-		program[i] = rom[2*i+1] | ((rom[2*i] & 0xF) << 8);
-	}
-
+	program = program_load(rom, rom_len, size);
+	free(rom);
 	return program;
 }
+
+/**
+ * @brief Write a program as a binary ROM, the inverse of program_load
+ *
+ * @param rom buffer of at least 2 * size bytes
+ */
+void program_save(const u12_t *program, uint32_t size, uint8_t *rom)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		rom[2*i] = (program[i] >> 8) & 0xF;
+		rom[2*i+1] = program[i] & 0xFF;
+	}
+}
@@ -41,8 +41,13 @@
 #ifndef _PROGRAM_H_
 #define _PROGRAM_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "hal_types.h"
 
+u12_t * program_load(const uint8_t *rom, size_t rom_len, uint32_t *size);
 u12_t * program_load_b64(char *rom_b64, uint32_t *size);
+void program_save(const u12_t *program, uint32_t size, uint8_t *rom);
 
 #endif /* _PROGRAM_H_ */
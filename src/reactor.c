@@ -0,0 +1,1060 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * WebSocket server (RFC 6455), serving all the connections from a small pool
+ * of I/O threads instead of a thread per client. Each thread waits on its
+ * own epoll instance, in which its sockets are registered edge-triggered: on
+ * each event, a socket is read or written until it would block.
+ *
+ * The listening socket is shared by the threads, and a connection is served
+ * by the thread that accepted it until it closes. The events sent to a client
+ * are queued in its outbox (see outbox.h) by any thread, which then notifies
+ * the I/O thread of the client through its ready list and eventfd. Frames
+ * are written from their shared buffers (see msgbuf.h) with scatter/gather
+ * I/O, so that an event sent to many clients is never copied per client.
+ *
+ * Idle connections hold no buffer: input is read to a buffer of the thread,
+ * and only the bytes of an incomplete frame are kept by the connection.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha1.h"
+
+#include "base64singleline.h"
+#include "logger.h"
+#include "msgbuf.h"
+#include "outbox.h"
+#include "reactor.h"
+
+#define REACTOR_BUCKETS 4096
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TXT 0x1
+#define WS_OP_BIN 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_POLICY_VIOLATION 1008
+#define WS_CLOSE_TOO_BIG 1009
+
+#define WS_KEY_MAX_SIZE 64
+// Maximum size of the Sec-WebSocket-Key header of a handshake (24 characters
+// for a valid key), including the string terminator.
+
+#define WS_PROTOCOL_MAX_SIZE 256
+// Maximum size of the Sec-WebSocket-Protocol header of a handshake, including
+// the string terminator. Longer headers are ignored.
+
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static const char HTTP_BAD_REQUEST[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+typedef enum {
+	CONN_HANDSHAKE,				// Waiting for the HTTP upgrade request
+	CONN_OPEN,					// WebSocket connection established
+} conn_state_t;
+
+typedef struct reactor_thread reactor_thread_t;
+
+typedef struct conn {
+	ws_cli_conn_t id;
+	int fd;
+	reactor_thread_t *thread;	// I/O thread serving the connection
+	conn_state_t state;
+	char address[INET6_ADDRSTRLEN];
+	const char *protocol;		// Subprotocol accepted in the handshake, or NULL
+
+	/* Input */
+	uint8_t *in;				// Bytes received and not yet parsed
+	size_t in_size;
+	uint8_t *message;			// Fragments of the message being received
+	size_t message_size;
+	int message_type;
+
+	/* Output */
+	msgbuf_t **queue;			// Buffers to write, in order
+	size_t queue_head;			// First buffer not completely written
+	size_t queue_size;
+	size_t queue_capacity;
+	size_t queue_offset;		// Bytes of the first buffer already written
+	size_t taken_bytes;			// Bytes of the queue taken from the outbox
+
+	atomic_bool notified;		// In the ready list of its thread
+	atomic_bool close_requested;
+	struct conn *next;			// Next connection in its hash bucket
+} conn_t;
+
+struct reactor_thread {
+	pthread_t thread;
+	int epoll_fd;
+	int event_fd;				// Signaled when ready is no longer empty
+	bool accepting;				// The listening socket is in epoll_fd
+	struct timespec accept_retry;	// When to accept connections again
+
+	pthread_mutex_t ready_lock;	// Guards ready
+	ws_cli_conn_t *ready;		// Connections with events to write, or to close
+	size_t n_ready;
+	size_t ready_size;
+	ws_cli_conn_t *spare;		// Ready list being processed by the thread
+	size_t spare_size;
+
+	uint8_t buffer[REACTOR_READ_SIZE + 1];	// See conn_deliver
+};
+
+static reactor_events_t g_events;
+static int g_listen_fd = -1;
+static reactor_thread_t *g_threads = NULL;
+static atomic_uint_fast64_t g_next_id = 1;
+
+static pthread_rwlock_t g_conns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static conn_t *g_conns[REACTOR_BUCKETS] = {0};
+
+static uint32_t hash_client(ws_cli_conn_t client)
+{
+	uint64_t h = (uint64_t) client * 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (h >> 32);
+}
+
+static conn_t ** conn_find_locked(ws_cli_conn_t client)
+{
+	conn_t **c = &g_conns[hash_client(client) % REACTOR_BUCKETS];
+	while (*c != NULL && (*c)->id != client) {
+		c = &(*c)->next;
+	}
+	return c;
+}
+
+/**
+ * @brief Find a connection served by the calling I/O thread
+ *
+ * Connections are only freed by the thread serving them, so that the
+ * returned pointer stays valid without holding g_conns_lock.
+ */
+static conn_t * conn_find(ws_cli_conn_t client)
+{
+	pthread_rwlock_rdlock(&g_conns_lock);
+	conn_t *c = *conn_find_locked(client);
+	pthread_rwlock_unlock(&g_conns_lock);
+	return c;
+}
+
+/**
+ * @brief Ensure that n more buffers can be queued for writing
+ *
+ * @return 0 on success, 1 on allocation failure
+ */
+static int conn_reserve(conn_t *c, size_t n)
+{
+	if (c->queue_size + n <= c->queue_capacity) {
+		return 0;
+	}
+	size_t capacity = c->queue_capacity ? c->queue_capacity : REACTOR_MAX_IOV;
+	while (capacity < c->queue_size + n) {
+		capacity *= 2;
+	}
+	msgbuf_t **queue = realloc(c->queue, capacity * sizeof(msgbuf_t *));
+	if (queue == NULL) {
+		return 1;
+	}
+	c->queue = queue;
+	c->queue_capacity = capacity;
+	return 0;
+}
+
+/**
+ * @brief Queue a buffer for writing, after the events taken from the outbox
+ *
+ * @param b buffer, whose reference is taken over by the connection
+ * @return 0 on success, 1 on allocation failure
+ */
+static int conn_push(conn_t *c, msgbuf_t *b)
+{
+	if (b == NULL || conn_reserve(c, 1)) {
+		msgbuf_release(b);
+		return 1;
+	}
+	c->queue[c->queue_size++] = b;
+	return 0;
+}
+
+/**
+ * @brief Queue a control frame (or the handshake response) for writing
+ *
+ * @param opcode opcode of the frame, or -1 to write raw bytes
+ * @return 0 on success, 1 on allocation failure
+ */
+static int conn_push_control(conn_t *c, int opcode, const void *payload,
+	size_t size)
+{
+	return conn_push(c, (opcode < 0) ? msgbuf_create(payload, size) :
+		msgbuf_frame(payload, size, opcode));
+}
+
+/**
+ * @brief Write the queued buffers, then the events queued for the client,
+ * until the socket would block
+ *
+ * @return 0 on success, 1 if the connection must be closed
+ */
+static int conn_flush(conn_t *c)
+{
+	struct iovec iov[REACTOR_MAX_IOV];
+
+	for (;;) {
+		if (c->queue_head == c->queue_size) {
+			c->queue_head = c->queue_size = 0;
+			if (c->taken_bytes > 0) {
+				outbox_release(c->id, c->taken_bytes);
+				c->taken_bytes = 0;
+			}
+			if (c->state == CONN_OPEN && !conn_reserve(c, REACTOR_MAX_IOV)) {
+				c->queue_size = outbox_take(c->id, c->queue, REACTOR_MAX_IOV,
+					&c->taken_bytes);
+			}
+			if (c->queue_size == 0) {
+				/* Idle connections keep no buffer */
+				free(c->queue);
+				c->queue = NULL;
+				c->queue_capacity = 0;
+				return 0;
+			}
+		}
+
+		int n_iov = 0;
+		for (size_t i = c->queue_head; i < c->queue_size && n_iov < REACTOR_MAX_IOV; i++) {
+			const size_t offset = (i == c->queue_head) ? c->queue_offset : 0;
+			iov[n_iov].iov_base = (void *) (c->queue[i]->data + offset);
+			iov[n_iov].iov_len = c->queue[i]->size - offset;
+			n_iov++;
+		}
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = n_iov,
+		};
+		ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+
+		/* Release the buffers completely written */
+		while (n > 0) {
+			size_t left = c->queue[c->queue_head]->size - c->queue_offset;
+			if ((size_t) n < left) {
+				c->queue_offset += n;
+				break;
+			}
+			n -= left;
+			msgbuf_release(c->queue[c->queue_head++]);
+			c->queue_offset = 0;
+		}
+	}
+}
+
+/**
+ * @brief Close a connection, and free it
+ *
+ * @param code status code of the close frame sent to the client, or 0 to
+ * close the socket without sending one
+ */
+static void conn_close(reactor_thread_t *t, conn_t *c, int code)
+{
+	/* The close frame (or the response to an invalid handshake) is sent as a
+	 * best effort, unless it would be interleaved with a partially written
+	 * frame */
+	if (c->state == CONN_HANDSHAKE) {
+		conn_flush(c);
+	} else if (code != 0 && c->queue_offset == 0) {
+		const uint8_t frame[4] = {0x80 | WS_OP_CLOSE, 2, code >> 8, code & 0xFF};
+		if (send(c->fd, frame, sizeof(frame), MSG_NOSIGNAL) < 0) {
+			/* The client is gone anyway */
+		}
+	}
+
+	for (size_t i = c->queue_head; i < c->queue_size; i++) {
+		msgbuf_release(c->queue[i]);
+	}
+	if (c->state == CONN_OPEN) {
+		g_events.onclose(c->id);
+	}
+
+	pthread_rwlock_wrlock(&g_conns_lock);
+	conn_t **e = conn_find_locked(c->id);
+	if (*e == c) {
+		*e = c->next;
+	}
+	pthread_rwlock_unlock(&g_conns_lock);
+
+	epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->in);
+	free(c->message);
+	free(c->queue);
+	free(c);
+}
+
+/**
+ * @brief Find a header of an HTTP request
+ *
+ * @param request request line and headers, nul-terminated
+ * @param name header name, matched case-insensitively
+ * @param value output buffer for the value, without surrounding whitespace
+ * @return 0 on success, 1 if the header is missing or its value too long
+ */
+static int http_get_header(const char *request, const char *name, char *value,
+	size_t value_size)
+{
+	const size_t name_len = strlen(name);
+	const char *line = strstr(request, "\r\n");
+
+	while (line != NULL) {
+		line += 2;
+		const char *end = strstr(line, "\r\n");
+		size_t line_len = (end != NULL) ? (size_t) (end - line) : strlen(line);
+		if (line_len > name_len && line[name_len] == ':' &&
+			!strncasecmp(line, name, name_len)) {
+			const char *v = line + name_len + 1;
+			const char *v_end = line + line_len;
+			while (v < v_end && (*v == ' ' || *v == '\t')) {
+				v++;
+			}
+			while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+				v_end--;
+			}
+			if ((size_t) (v_end - v) >= value_size) {
+				return 1;
+			}
+			memcpy(value, v, v_end - v);
+			value[v_end - v] = '\0';
+			return 0;
+		}
+		line = end;
+	}
+	return 1;
+}
+
+/**
+ * @brief Choose the subprotocol of a connection
+ *
+ * @param offered value of the Sec-WebSocket-Protocol header, i.e. the
+ * subprotocols of the client, comma-separated, in order of preference
+ * @return the first offered subprotocol that the server accepts (see
+ * reactor_events_t), or NULL
+ */
+static const char * http_select_protocol(const char *offered)
+{
+	if (g_events.protocols == NULL) {
+		return NULL;
+	}
+	while (*offered != '\0') {
+		while (*offered == ' ' || *offered == '\t' || *offered == ',') {
+			offered++;
+		}
+		size_t len = strcspn(offered, " \t,");
+		for (const char * const *p = g_events.protocols; len > 0 && *p != NULL; p++) {
+			if (strlen(*p) == len && !strncmp(*p, offered, len)) {
+				return *p;
+			}
+		}
+		offered += len;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Handle the HTTP upgrade request of a connection
+ *
+ * @param code set to a non-zero value if the connection must be closed
+ * @return number of bytes consumed from data
+ */
+static size_t conn_handshake(conn_t *c, uint8_t *data, size_t size, int *code)
+{
+	char key[WS_KEY_MAX_SIZE + sizeof(WS_GUID)];
+	uint8_t digest[SHA1HashSize];
+	char accept[BASE64SINGLELINE_SIZE(SHA1HashSize) + 1];
+	char protocols[WS_PROTOCOL_MAX_SIZE];
+	char protocol_header[WS_PROTOCOL_MAX_SIZE + 32] = "";
+	char response[256 + sizeof(protocol_header)];
+	SHA1Context sha;
+
+	uint8_t *end = memmem(data, size, "\r\n\r\n", 4);
+	if (end == NULL) {
+		if (size > REACTOR_MAX_HANDSHAKE_SIZE) {
+			*code = WS_CLOSE_PROTOCOL_ERROR;
+		}
+		return 0;
+	}
+	end[2] = '\0';
+
+	if (strncmp((char *) data, "GET ", 4) ||
+		http_get_header((char *) data, "Sec-WebSocket-Key", key, WS_KEY_MAX_SIZE)) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "[%s] Invalid handshake", c->address);
+		conn_push_control(c, -1, HTTP_BAD_REQUEST, sizeof(HTTP_BAD_REQUEST) - 1);
+		*code = WS_CLOSE_PROTOCOL_ERROR;
+		return end + 4 - data;
+	}
+
+	strcat(key, WS_GUID);
+	SHA1Reset(&sha);
+	SHA1Input(&sha, (const uint8_t *) key, strlen(key));
+	SHA1Result(&sha, digest);
+	base64singleline_encode_to(digest, sizeof(digest), accept);
+	if (!http_get_header((char *) data, "Sec-WebSocket-Protocol", protocols, WS_PROTOCOL_MAX_SIZE)) {
+		c->protocol = http_select_protocol(protocols);
+		if (c->protocol != NULL) {
+			snprintf(protocol_header, sizeof(protocol_header),
+				"Sec-WebSocket-Protocol: %s\r\n", c->protocol);
+		}
+	}
+	int response_size = snprintf(response, sizeof(response),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"%s"
+		"\r\n", accept, protocol_header);
+	if (conn_push_control(c, -1, response, response_size)) {
+		*code = WS_CLOSE_PROTOCOL_ERROR;
+		return end + 4 - data;
+	}
+
+	c->state = CONN_OPEN;
+	g_events.onopen(c->id);
+	return end + 4 - data;
+}
+
+/**
+ * @brief Pass a received message to the onmessage callback
+ *
+ * Messages are passed nul-terminated, as expected by the JSON parser. The
+ * terminator temporarily replaces the byte following the payload, which is
+ * always in the buffer: the buffers the frames are read to have an extra
+ * byte.
+ */
+static void conn_deliver(conn_t *c, int type, uint8_t *payload, size_t size)
+{
+	uint8_t next = payload[size];
+
+	payload[size] = '\0';
+	g_events.onmessage(c->id, payload, size, type);
+	payload[size] = next;
+}
+
+/**
+ * @brief Handle the frame at the start of data, if complete
+ *
+ * @param code set to a non-zero value if the connection must be closed
+ * @return size of the frame, or 0 if it is incomplete
+ */
+static size_t conn_parse_frame(conn_t *c, uint8_t *data, size_t size, int *code)
+{
+	if (size < 2) {
+		return 0;
+	}
+	const bool fin = data[0] & 0x80;
+	const int opcode = data[0] & 0x0F;
+	uint64_t len = data[1] & 0x7F;
+	size_t header_size = 2;
+
+	/* Frames sent by clients are always masked */
+	if ((data[0] & 0x70) || !(data[1] & 0x80)) {
+		*code = WS_CLOSE_PROTOCOL_ERROR;
+		return 0;
+	}
+	if (len == 126) {
+		if (size < 4) {
+			return 0;
+		}
+		len = (data[2] << 8) | data[3];
+		header_size = 4;
+	} else if (len == 127) {
+		if (size < 10) {
+			return 0;
+		}
+		len = 0;
+		for (int i = 0; i < 8; i++) {
+			len = (len << 8) | data[2 + i];
+		}
+		header_size = 10;
+	}
+	if ((opcode & 0x08) && (!fin || len > 125)) {
+		*code = WS_CLOSE_PROTOCOL_ERROR;
+		return 0;
+	}
+	if (len > REACTOR_MAX_MESSAGE_SIZE) {
+		*code = WS_CLOSE_TOO_BIG;
+		return 0;
+	}
+	if (size < header_size + 4 + len) {
+		return 0;
+	}
+
+	const uint8_t *mask = data + header_size;
+	uint8_t *payload = data + header_size + 4;
+	for (uint64_t i = 0; i < len; i++) {
+		payload[i] ^= mask[i & 3];
+	}
+
+	switch (opcode) {
+		case WS_OP_TXT:
+		case WS_OP_BIN:
+			if (c->message != NULL) {
+				*code = WS_CLOSE_PROTOCOL_ERROR;
+				break;
+			}
+			if (fin) {
+				conn_deliver(c, opcode, payload, len);
+				break;
+			}
+			c->message = malloc(len + 1);
+			if (c->message == NULL) {
+				*code = WS_CLOSE_TOO_BIG;
+				break;
+			}
+			memcpy(c->message, payload, len);
+			c->message_size = len;
+			c->message_type = opcode;
+			break;
+
+		case WS_OP_CONT:
+			if (c->message == NULL) {
+				*code = WS_CLOSE_PROTOCOL_ERROR;
+				break;
+			}
+			if (c->message_size + len > REACTOR_MAX_MESSAGE_SIZE) {
+				*code = WS_CLOSE_TOO_BIG;
+				break;
+			}
+			uint8_t *message = realloc(c->message, c->message_size + len + 1);
+			if (message == NULL) {
+				*code = WS_CLOSE_TOO_BIG;
+				break;
+			}
+			memcpy(message + c->message_size, payload, len);
+			c->message = message;
+			c->message_size += len;
+			if (fin) {
+				conn_deliver(c, c->message_type, c->message, c->message_size);
+				free(c->message);
+				c->message = NULL;
+				c->message_size = 0;
+			}
+			break;
+
+		case WS_OP_PING:
+			if (conn_push_control(c, WS_OP_PONG, payload, len)) {
+				*code = WS_CLOSE_TOO_BIG;
+			}
+			break;
+
+		case WS_OP_PONG:
+			break;
+
+		case WS_OP_CLOSE:
+			*code = WS_CLOSE_NORMAL;
+			break;
+
+		default:
+			*code = WS_CLOSE_PROTOCOL_ERROR;
+			break;
+	}
+	return header_size + 4 + len;
+}
+
+/**
+ * @brief Handle the bytes received on a connection
+ *
+ * @param code set to a non-zero value if the connection must be closed
+ * @return number of bytes consumed from data
+ */
+static size_t conn_parse(conn_t *c, uint8_t *data, size_t size, int *code)
+{
+	size_t pos = 0;
+	size_t n;
+
+	if (c->state == CONN_HANDSHAKE) {
+		pos = conn_handshake(c, data, size, code);
+		if (c->state == CONN_HANDSHAKE) {
+			return pos;
+		}
+	}
+	while (*code == 0 && (n = conn_parse_frame(c, data + pos, size - pos, code)) > 0) {
+		pos += n;
+	}
+	return pos;
+}
+
+/**
+ * @brief Read a connection until it would block, and handle its frames
+ *
+ * @return 0 on success, 1 if the connection was closed
+ */
+static int conn_read(reactor_thread_t *t, conn_t *c)
+{
+	int code = 0;
+
+	for (;;) {
+		ssize_t n = recv(c->fd, t->buffer, REACTOR_READ_SIZE, 0);
+		if (n == 0) {
+			conn_close(t, c, 0);
+			return 1;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			conn_close(t, c, 0);
+			return 1;
+		}
+
+		/* Bytes of an incomplete frame are kept by the connection, and
+		 * completed with the ones just read */
+		uint8_t *data = t->buffer;
+		size_t size = n;
+		if (c->in_size > 0) {
+			uint8_t *in = realloc(c->in, c->in_size + n + 1);
+			if (in == NULL) {
+				conn_close(t, c, WS_CLOSE_TOO_BIG);
+				return 1;
+			}
+			memcpy(in + c->in_size, t->buffer, n);
+			c->in = data = in;
+			size = c->in_size + n;
+		}
+
+		size_t used = conn_parse(c, data, size, &code);
+		if (code != 0) {
+			conn_close(t, c, code);
+			return 1;
+		}
+		if (data == c->in) {
+			memmove(c->in, c->in + used, size - used);
+		} else if (used < size) {
+			c->in = malloc(size - used + 1);
+			if (c->in == NULL) {
+				conn_close(t, c, WS_CLOSE_TOO_BIG);
+				return 1;
+			}
+			memcpy(c->in, data + used, size - used);
+		}
+		c->in_size = size - used;
+		if (c->in_size == 0) {
+			free(c->in);
+			c->in = NULL;
+		}
+	}
+
+	/* Handshake response, pongs */
+	if (conn_flush(c)) {
+		conn_close(t, c, 0);
+		return 1;
+	}
+	return 0;
+}
+
+static void conn_open(reactor_thread_t *t, int fd, const struct sockaddr_storage *addr)
+{
+	const int one = 1;
+
+	conn_t *c = calloc(1, sizeof(conn_t));
+	if (c == NULL) {
+		close(fd);
+		return;
+	}
+	c->id = atomic_fetch_add(&g_next_id, 1);
+	c->fd = fd;
+	c->thread = t;
+	c->state = CONN_HANDSHAKE;
+	if (addr->ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((const struct sockaddr_in6 *) addr)->sin6_addr,
+			c->address, sizeof(c->address));
+	} else {
+		inet_ntop(AF_INET, &((const struct sockaddr_in *) addr)->sin_addr,
+			c->address, sizeof(c->address));
+	}
+	/* Events are small, and sent as soon as they are produced */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	pthread_rwlock_wrlock(&g_conns_lock);
+	conn_t **e = &g_conns[hash_client(c->id) % REACTOR_BUCKETS];
+	c->next = *e;
+	*e = c;
+	pthread_rwlock_unlock(&g_conns_lock);
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = c,
+	};
+	if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_WS, "[%s] Cannot register connection: %s",
+			c->address, strerror(errno));
+		conn_close(t, c, 0);
+	}
+}
+
+static void reactor_listen(reactor_thread_t *t)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLEXCLUSIVE,
+		.data.ptr = &g_listen_fd,
+	};
+	t->accepting = (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, g_listen_fd, &ev) == 0);
+}
+
+/**
+ * @brief Accept a pending connection, which is then served by this thread
+ *
+ * The listening socket is level-triggered, so that connections are accepted
+ * one at a time and spread over the threads woken up.
+ */
+static void reactor_accept(reactor_thread_t *t)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+
+	int fd = accept4(g_listen_fd, (struct sockaddr *) &addr, &addr_len,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd >= 0) {
+		conn_open(t, fd, &addr);
+		return;
+	}
+	if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+		/* The pending connection would wake the thread up again right away */
+		LOGGER(LOGGER_WARN, LOGGER_CAT_WS, "Cannot accept connection: %s", strerror(errno));
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, g_listen_fd, NULL);
+		t->accepting = false;
+		clock_gettime(CLOCK_MONOTONIC, &t->accept_retry);
+		t->accept_retry.tv_nsec += REACTOR_ACCEPT_BACKOFF_MS * 1000000L;
+		if (t->accept_retry.tv_nsec >= 1000000000L) {
+			t->accept_retry.tv_sec++;
+			t->accept_retry.tv_nsec -= 1000000000L;
+		}
+	}
+}
+
+/**
+ * @brief Handle the connections notified by other threads
+ */
+static void reactor_process_ready(reactor_thread_t *t)
+{
+	uint64_t count;
+	ws_cli_conn_t *ready;
+	size_t size;
+	size_t n;
+
+	if (read(t->event_fd, &count, sizeof(count)) < 0) {
+		/* Nothing to reset */
+	}
+	pthread_mutex_lock(&t->ready_lock);
+	ready = t->ready;
+	size = t->ready_size;
+	n = t->n_ready;
+	t->ready = t->spare;
+	t->ready_size = t->spare_size;
+	t->n_ready = 0;
+	pthread_mutex_unlock(&t->ready_lock);
+	t->spare = ready;
+	t->spare_size = size;
+
+	for (size_t i = 0; i < n; i++) {
+		conn_t *c = conn_find(ready[i]);
+		if (c == NULL) {
+			continue;
+		}
+		atomic_store(&c->notified, false);
+		if (atomic_load(&c->close_requested)) {
+			conn_close(t, c, WS_CLOSE_POLICY_VIOLATION);
+		} else if (conn_flush(c)) {
+			conn_close(t, c, 0);
+		}
+	}
+}
+
+static void * reactor_thread(void *arg)
+{
+	reactor_thread_t *t = arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+
+	for (;;) {
+		int n = epoll_wait(t->epoll_fd, events, REACTOR_MAX_EVENTS,
+			t->accepting ? -1 : REACTOR_ACCEPT_BACKOFF_MS);
+		if (n < 0 && errno != EINTR) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_WS, "FATAL: cannot wait for events: %s", strerror(errno));
+			exit(1);
+		}
+		if (!t->accepting) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > t->accept_retry.tv_sec ||
+				(now.tv_sec == t->accept_retry.tv_sec && now.tv_nsec >= t->accept_retry.tv_nsec)) {
+				reactor_listen(t);
+			}
+		}
+
+		bool ready = false;
+		for (int i = 0; i < n; i++) {
+			void *p = events[i].data.ptr;
+			uint32_t e = events[i].events;
+			if (p == &g_listen_fd) {
+				reactor_accept(t);
+			} else if (p == &t->event_fd) {
+				ready = true;
+			} else if (e & (EPOLLERR | EPOLLHUP)) {
+				conn_close(t, p, 0);
+			} else if ((e & (EPOLLIN | EPOLLRDHUP)) && conn_read(t, p)) {
+				continue;
+			} else if ((e & EPOLLOUT) && conn_flush(p)) {
+				conn_close(t, p, 0);
+			}
+		}
+		if (ready) {
+			reactor_process_ready(t);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Queue a connection in the ready list of its thread
+ *
+ * @param close whether the connection must be closed
+ */
+static void reactor_signal(ws_cli_conn_t client, bool close)
+{
+	const uint64_t one = 1;
+
+	pthread_rwlock_rdlock(&g_conns_lock);
+	conn_t *c = *conn_find_locked(client);
+	if (c == NULL) {
+		goto end;
+	}
+	if (close) {
+		atomic_store(&c->close_requested, true);
+	}
+	if (atomic_exchange(&c->notified, true)) {
+		goto end;
+	}
+
+	reactor_thread_t *t = c->thread;
+	pthread_mutex_lock(&t->ready_lock);
+	if (t->n_ready == t->ready_size) {
+		size_t size = t->ready_size ? 2 * t->ready_size : 64;
+		ws_cli_conn_t *ready = realloc(t->ready, size * sizeof(ws_cli_conn_t));
+		if (ready == NULL) {
+			pthread_mutex_unlock(&t->ready_lock);
+			atomic_store(&c->notified, false);
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_WS, "Cannot notify I/O thread");
+			goto end;
+		}
+		t->ready = ready;
+		t->ready_size = size;
+	}
+	t->ready[t->n_ready++] = client;
+	/* The thread takes the whole list when woken up */
+	if (t->n_ready == 1 && write(t->event_fd, &one, sizeof(one)) < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_WS, "Cannot wake I/O thread up: %s", strerror(errno));
+	}
+	pthread_mutex_unlock(&t->ready_lock);
+
+	end:
+		pthread_rwlock_unlock(&g_conns_lock);
+}
+
+/**
+ * @brief Notify the I/O thread of a client that events are queued in its
+ * outbox
+ */
+void reactor_notify(ws_cli_conn_t client)
+{
+	reactor_signal(client, false);
+}
+
+/**
+ * @brief Close the connection of a client, dropping the events queued for it
+ *
+ * The connection is closed asynchronously by its I/O thread, which then
+ * calls the onclose callback.
+ */
+void reactor_close_client(ws_cli_conn_t client)
+{
+	reactor_signal(client, true);
+}
+
+/**
+ * @brief Get the address of a client, for logging
+ *
+ * @return the address, in a buffer of the calling thread overwritten by the
+ * next call
+ */
+const char * reactor_get_address(ws_cli_conn_t client)
+{
+	static _Thread_local char address[INET6_ADDRSTRLEN];
+
+	pthread_rwlock_rdlock(&g_conns_lock);
+	conn_t *c = *conn_find_locked(client);
+	strcpy(address, (c != NULL) ? c->address : "?");
+	pthread_rwlock_unlock(&g_conns_lock);
+	return address;
+}
+
+/**
+ * @brief Get the subprotocol accepted in the handshake of a client
+ *
+ * @return one of the subprotocols of reactor_events_t, or NULL if the client
+ * offered none of them
+ */
+const char * reactor_get_protocol(ws_cli_conn_t client)
+{
+	pthread_rwlock_rdlock(&g_conns_lock);
+	conn_t *c = *conn_find_locked(client);
+	const char *protocol = (c != NULL) ? c->protocol : NULL;
+	pthread_rwlock_unlock(&g_conns_lock);
+	return protocol;
+}
+
+/**
+ * @brief Raise the limit of open files, which bounds the number of clients
+ */
+static void reactor_raise_fd_limit(void)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/**
+ * @brief Start serving WebSocket connections
+ *
+ * @param host address to listen on
+ * @param port port to listen on
+ * @param n_threads number of I/O threads
+ * @param events callbacks, called from the I/O threads
+ * @return 0 on success, 1 on failure
+ */
+int reactor_init(const char *host, uint16_t port, unsigned int n_threads,
+	const reactor_events_t *events)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *addrs = NULL;
+	char port_str[8];
+	int status = 0;
+
+	n_threads = (n_threads < 1) ? 1 : n_threads;
+	n_threads = (n_threads > REACTOR_MAX_THREADS) ? REACTOR_MAX_THREADS : n_threads;
+	g_events = *events;
+	reactor_raise_fd_limit();
+
+	snprintf(port_str, sizeof(port_str), "%u", port);
+	if (getaddrinfo(host, port_str, &hints, &addrs) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot resolve %s", host);
+		return 1;
+	}
+	for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+		int reuse = 1;
+		g_listen_fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			a->ai_protocol);
+		if (g_listen_fd < 0) {
+			continue;
+		}
+		setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (bind(g_listen_fd, a->ai_addr, a->ai_addrlen) == 0 && listen(g_listen_fd, SOMAXCONN) == 0) {
+			break;
+		}
+		close(g_listen_fd);
+		g_listen_fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if (g_listen_fd < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot listen on %s:%u: %s", host, port, strerror(errno));
+		return 1;
+	}
+
+	g_threads = calloc(n_threads, sizeof(reactor_thread_t));
+	if (g_threads == NULL) {
+		status = 1;
+		goto end;
+	}
+	for (unsigned int i = 0; i < n_threads; i++) {
+		reactor_thread_t *t = &g_threads[i];
+		pthread_mutex_init(&t->ready_lock, NULL);
+		t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		t->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = &t->event_fd,
+		};
+		if (t->epoll_fd < 0 || t->event_fd < 0 ||
+			epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->event_fd, &ev)) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot create I/O thread: %s", strerror(errno));
+			status = 1;
+			goto end;
+		}
+		reactor_listen(t);
+		if (pthread_create(&t->thread, NULL, &reactor_thread, t)) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot start I/O thread");
+			status = 1;
+			goto end;
+		}
+		pthread_detach(t->thread);
+	}
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Listening on ws://%s:%u, with %u I/O threads",
+		host, port, n_threads);
+
+	end:
+		return status;
+}
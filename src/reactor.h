@@ -0,0 +1,73 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+
+#define REACTOR_DEFAULT_THREADS 2
+// Default number of I/O threads, serving all the WebSocket connections.
+
+#define REACTOR_MAX_THREADS 64
+
+#define REACTOR_MAX_EVENTS 256
+// Maximum number of epoll events handled per wakeup of an I/O thread.
+
+#define REACTOR_MAX_IOV 64
+// Maximum number of buffers written to a socket in a single system call.
+
+#define REACTOR_READ_SIZE 65536
+// Size of the buffer each I/O thread reads the sockets into.
+
+#define REACTOR_MAX_HANDSHAKE_SIZE 8192
+// Maximum size of the request line and headers of a WebSocket handshake.
+
+#define REACTOR_MAX_MESSAGE_SIZE (1 << 20)
+// Maximum size of a message received from a client, after reassembly of its
+// fragments. Clients sending larger messages are disconnected.
+
+#define REACTOR_ACCEPT_BACKOFF_MS 100
+// Time during which an I/O thread stops accepting connections after running
+// out of file descriptors.
+
+typedef uint64_t ws_cli_conn_t;
+// Identifier of a client connection. Identifiers are not reused.
+
+/**
+ * @brief Callbacks of the WebSocket server, called from the I/O threads
+ */
+typedef struct {
+	void (*onopen)(ws_cli_conn_t client);
+	void (*onclose)(ws_cli_conn_t client);
+	void (*onmessage)(ws_cli_conn_t client, const unsigned char *msg,
+		uint64_t size, int type);
+	const char * const *protocols;	// Subprotocols accepted in handshakes,
+									// NULL-terminated (optional)
+} reactor_events_t;
+
+int reactor_init(const char *host, uint16_t port, unsigned int n_threads,
+	const reactor_events_t *events);
+
+void reactor_notify(ws_cli_conn_t client);
+void reactor_close_client(ws_cli_conn_t client);
+const char * reactor_get_address(ws_cli_conn_t client);
+const char * reactor_get_protocol(ws_cli_conn_t client);
+
+#endif /* _REACTOR_H_ */
@@ -0,0 +1,364 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Content-addressed ROM cache. Sessions running the same ROM share a single
+ * decoded program, identified by the SHA-1 of the binary ROM (see rom_hash).
+ * A ROM is kept in the cache as long as a session references it, or for the
+ * server lifetime if it was preloaded from disk.
+ */
+
+#include <base64.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sha1.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "program.h"
+#include "romcache.h"
+
+static pthread_mutex_t g_rom_lock = PTHREAD_MUTEX_INITIALIZER;
+static rom_t *g_roms[ROM_CACHE_BUCKETS] = {0};
+static rom_t *g_default_rom = NULL;	// Used by rom events without a ROM
+
+/**
+ * @brief Hash a binary ROM of ROM_SIZE bytes
+ *
+ * The upper 4 bits of each instruction, which program_load ignores, are
+ * cleared first, so that a ROM written back by program_save (e.g. to the
+ * session store) keeps its hash.
+ */
+static void rom_hash(const uint8_t *rom, char hash[ROM_HASH_SIZE])
+{
+	static const char hex[] = "0123456789abcdef";
+	SHA1Context ctx;
+	uint8_t digest[SHA1HashSize];
+	uint8_t decoded[ROM_SIZE];
+
+	for (size_t i = 0; i < ROM_SIZE; i += 2) {
+		decoded[i] = rom[i] & 0xF;
+		decoded[i+1] = rom[i+1];
+	}
+	SHA1Reset(&ctx);
+	SHA1Input(&ctx, decoded, ROM_SIZE);
+	SHA1Result(&ctx, digest);
+	for (int i = 0; i < SHA1HashSize; i++) {
+		hash[2*i] = hex[digest[i] >> 4];
+		hash[2*i+1] = hex[digest[i] & 0xF];
+	}
+	hash[2*SHA1HashSize] = '\0';
+}
+
+static rom_t ** rom_find_locked(const char *hash)
+{
+	/* The hash is a hexadecimal SHA-1: its first digits are uniformly
+	 * distributed.
+	 */
+	unsigned int bucket = (hash[0] * 31 + hash[1]) % ROM_CACHE_BUCKETS;
+	rom_t **e = &g_roms[bucket];
+	while (*e != NULL && strcmp((*e)->hash, hash) != 0) {
+		e = &(*e)->next;
+	}
+	return e;
+}
+
+/**
+ * @brief Decode a binary ROM into a read-only program
+ *
+ * @return the new ROM, with a reference count of 1, or NULL on failure
+ */
+static rom_t * rom_new(const uint8_t *rom, size_t rom_len,
+	const char hash[ROM_HASH_SIZE])
+{
+	uint32_t size;
+
+	rom_t *r = calloc(1, sizeof(rom_t));
+	if (r == NULL) {
+		return NULL;
+	}
+	u12_t *program = program_load(rom, rom_len, &size);
+	if (program == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->map_size = size * sizeof(u12_t);
+	void *map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "FATAL: Cannot allocate ROM memory!\n");
+		free(program);
+		free(r);
+		return NULL;
+	}
+	memcpy(map, program, r->map_size);
+	free(program);
+	mprotect(map, r->map_size, PROT_READ);
+
+	strcpy(r->hash, hash);
+	r->program = map;
+	r->size = size;
+	r->refcount = 1;
+	return r;
+}
+
+/**
+ * @brief Get the cached program of a binary ROM, decoding it if needed
+ *
+ * @return the ROM, or NULL on failure
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+rom_t * rom_cache_load(const uint8_t *rom, size_t rom_len)
+{
+	char hash[ROM_HASH_SIZE];
+
+	if (rom_len != ROM_SIZE) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Invalid ROM: %zu bytes instead of %d\n", rom_len, ROM_SIZE);
+		return NULL;
+	}
+	rom_hash(rom, hash);
+
+	pthread_mutex_lock(&g_rom_lock);
+	rom_t **e = rom_find_locked(hash);
+	if (*e != NULL) {
+		(*e)->refcount++;
+	} else {
+		*e = rom_new(rom, rom_len, hash);
+		if (*e != NULL) {
+			LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Cached ROM %s\n", hash);
+		}
+	}
+	rom_t *r = *e;
+	pthread_mutex_unlock(&g_rom_lock);
+	return r;
+}
+
+/**
+ * @brief Get the cached program of a base64-encoded ROM, decoding it if
+ * needed
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+rom_t * rom_cache_load_b64(const char *rom_b64)
+{
+	size_t rom_len;
+
+	uint8_t *rom = base64_decode(
+		(const unsigned char *) rom_b64,
+		strlen(rom_b64),
+		&rom_len);
+	if (rom == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "FATAL: Cannot decode ROM!\n");
+		return NULL;
+	}
+	rom_t *r = rom_cache_load(rom, rom_len);
+	free(rom);
+	return r;
+}
+
+/**
+ * @brief Get the cached program of a binary ROM file, decoding it if needed
+ *
+ * The file is mapped rather than read.
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+rom_t * rom_cache_load_file(const char *path)
+{
+	struct stat st;
+	rom_t *r = NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open ROM %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open ROM %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	if (st.st_size != ROM_SIZE) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Invalid ROM %s: %jd bytes instead of %d\n", path,
+			(intmax_t) st.st_size, ROM_SIZE);
+		goto end;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot map ROM %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	r = rom_cache_load(map, st.st_size);
+	munmap(map, st.st_size);
+
+	end:
+		close(fd);
+		return r;
+}
+
+/**
+ * @brief Load ROM files in the cache, where they stay for the server lifetime
+ *
+ * If a single ROM is loaded, it becomes the default ROM, used by rom events
+ * that carry no ROM.
+ *
+ * @param path ROM file, or directory of ROM files (*.bin)
+ * @return the number of loaded ROMs
+ */
+unsigned int rom_cache_preload(const char *path)
+{
+	char file_path[PATH_MAX];
+	struct stat st;
+	struct dirent *entry;
+	rom_t *first = NULL;
+	unsigned int n = 0;
+
+	if (stat(path, &st) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open ROM %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		first = rom_cache_load_file(path);
+		if (first != NULL) {
+			LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Preloaded ROM %s (%s)\n", path, first->hash);
+			n = 1;
+		}
+	} else {
+		DIR *dir = opendir(path);
+		if (dir == NULL) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open ROM directory %s: %s\n", path, strerror(errno));
+			return 0;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			const char *ext = strrchr(entry->d_name, '.');
+			if (ext == NULL || strcmp(ext, ".bin") != 0) {
+				continue;
+			}
+			snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
+			rom_t *r = rom_cache_load_file(file_path);
+			if (r == NULL) {
+				continue;
+			}
+			LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Preloaded ROM %s (%s)\n", file_path, r->hash);
+			if (first == NULL) {
+				first = r;
+			}
+			n++;
+		}
+		closedir(dir);
+	}
+	/* The preloaded ROMs keep the reference taken by rom_cache_load_file */
+	if (n == 1) {
+		pthread_mutex_lock(&g_rom_lock);
+		g_default_rom = first;
+		pthread_mutex_unlock(&g_rom_lock);
+	}
+	return n;
+}
+
+/**
+ * @brief Get the default ROM, see rom_cache_preload
+ *
+ * @return the ROM, or NULL if there is no default ROM
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+rom_t * rom_cache_default(void)
+{
+	pthread_mutex_lock(&g_rom_lock);
+	rom_t *r = g_default_rom;
+	if (r != NULL) {
+		r->refcount++;
+	}
+	pthread_mutex_unlock(&g_rom_lock);
+	return r;
+}
+
+/**
+ * @brief Find a cached ROM by hash
+ *
+ * @return the ROM, or NULL if no session runs it
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+rom_t * rom_cache_find(const char *hash)
+{
+	if (!rom_is_valid_hash(hash)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&g_rom_lock);
+	rom_t *r = *rom_find_locked(hash);
+	if (r != NULL) {
+		r->refcount++;
+	}
+	pthread_mutex_unlock(&g_rom_lock);
+	return r;
+}
+
+void rom_acquire(rom_t *rom)
+{
+	pthread_mutex_lock(&g_rom_lock);
+	rom->refcount++;
+	pthread_mutex_unlock(&g_rom_lock);
+}
+
+/**
+ * @brief Release a reference to a ROM, and remove it from the cache when no
+ * reference is left
+ */
+void rom_release(rom_t *rom)
+{
+	if (rom == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&g_rom_lock);
+	if (--rom->refcount > 0) {
+		pthread_mutex_unlock(&g_rom_lock);
+		return;
+	}
+	rom_t **e = rom_find_locked(rom->hash);
+	*e = rom->next;
+	pthread_mutex_unlock(&g_rom_lock);
+
+	munmap((void *) rom->program, rom->map_size);
+	free(rom);
+}
+
+bool rom_is_valid_hash(const char *hash)
+{
+	size_t len = strlen(hash);
+	if (len != ROM_HASH_SIZE - 1) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		char c = hash[i];
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,64 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ROMCACHE_H_
+#define _ROMCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal_types.h"
+
+#define ROM_HASH_SIZE 41
+// Size of a ROM hash, including the string terminator: the SHA-1 of the
+// binary ROM, as 40 lowercase hexadecimal digits.
+
+#define ROM_CACHE_BUCKETS 64
+
+#define ROM_SIZE 12288
+// Size of a binary ROM: the 6144 12-bit instructions of the Tamagotchi P1
+// program, 2 bytes each. ROMs of any other size are rejected.
+
+/**
+ * @brief A program shared by all the sessions running the same ROM
+ *
+ * The program is mapped read-only: it must never be modified.
+ */
+typedef struct rom {
+	char hash[ROM_HASH_SIZE];
+	const u12_t *program;
+	uint32_t size;				// Program size, in instructions
+	size_t map_size;
+	unsigned int refcount;		// Guarded by the cache lock
+	struct rom *next;			// Next ROM in its hash bucket
+} rom_t;
+
+rom_t * rom_cache_load(const uint8_t *rom, size_t rom_len);
+rom_t * rom_cache_load_b64(const char *rom_b64);
+rom_t * rom_cache_load_file(const char *path);
+rom_t * rom_cache_find(const char *hash);
+rom_t * rom_cache_default(void);
+unsigned int rom_cache_preload(const char *path);
+void rom_acquire(rom_t *rom);
+void rom_release(rom_t *rom);
+
+bool rom_is_valid_hash(const char *hash);
+
+#endif /* _ROMCACHE_H_ */
@@ -0,0 +1,291 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "logger.h"
+#include "scheduler.h"
+
+/* Sessions waiting for their next quantum, in a min-heap ordered by
+ * next_run. The heap holds one reference to each session it contains.
+ * Sessions being run by a worker are not in the heap.
+ */
+static pthread_mutex_t g_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_sched_cond;		// Waits on CLOCK_MONOTONIC, see scheduler_init
+static pthread_once_t g_sched_once = PTHREAD_ONCE_INIT;
+static session_t *g_heap[SESSION_MAX] = {0};
+static size_t g_heap_size = 0;
+static unsigned int g_spin_us = SCHEDULER_DEFAULT_SPIN_US;
+
+/**
+ * @brief Get the time of the monotonic clock, in microseconds
+ *
+ * Unlike the wall clock, it is not stepped by NTP, so that the emulated time
+ * does not jump. It does not wrap in practice.
+ */
+uint64_t scheduler_now_us(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+/**
+ * @brief Get the time of the monotonic clock, truncated to a timestamp_t
+ *
+ * Timestamps wrap about every 71 minutes: they may only be compared to close
+ * timestamps, e.g. (int32_t) (a - b) < 0.
+ */
+timestamp_t scheduler_now(void)
+{
+	return (timestamp_t) scheduler_now_us();
+}
+
+static void scheduler_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_sched_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static bool heap_before(size_t i, size_t j)
+{
+	return g_heap[i]->next_run < g_heap[j]->next_run;
+}
+
+static void heap_swap(size_t i, size_t j)
+{
+	session_t *tmp = g_heap[i];
+	g_heap[i] = g_heap[j];
+	g_heap[j] = tmp;
+	g_heap[i]->heap_index = i;
+	g_heap[j]->heap_index = j;
+}
+
+static void heap_sift_up(size_t i)
+{
+	while (i > 0 && heap_before(i, (i - 1) / 2)) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_sift_down(size_t i)
+{
+	for (;;) {
+		size_t smallest = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+		if (left < g_heap_size && heap_before(left, smallest)) {
+			smallest = left;
+		}
+		if (right < g_heap_size && heap_before(right, smallest)) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			return;
+		}
+		heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void heap_push(session_t *s)
+{
+	s->heap_index = g_heap_size;
+	g_heap[g_heap_size++] = s;
+	heap_sift_up(s->heap_index);
+	if (s->heap_index == 0) {
+		pthread_cond_signal(&g_sched_cond);
+	}
+}
+
+static session_t * heap_pop(void)
+{
+	session_t *s = g_heap[0];
+	g_heap_size--;
+	if (g_heap_size > 0) {
+		g_heap[0] = g_heap[g_heap_size];
+		g_heap[0]->heap_index = 0;
+		heap_sift_down(0);
+	}
+	s->heap_index = -1;
+	return s;
+}
+
+/**
+ * @brief Schedule a new session
+ */
+void scheduler_add(session_t *s)
+{
+	pthread_once(&g_sched_once, &scheduler_init);
+	atomic_fetch_add(&s->refcount, 1);
+	pthread_mutex_lock(&g_sched_lock);
+	heap_push(s);
+	pthread_mutex_unlock(&g_sched_lock);
+}
+
+/**
+ * @brief Schedule a session as soon as possible
+ *
+ * This is used when a client action is pending, so that it is not delayed
+ * until the next quantum of the session.
+ */
+void scheduler_wake(session_t *s)
+{
+	pthread_once(&g_sched_once, &scheduler_init);
+	pthread_mutex_lock(&g_sched_lock);
+	if (s->heap_index >= 0) {
+		s->next_run = scheduler_now_us();
+		heap_sift_up(s->heap_index);
+		if (s->heap_index == 0) {
+			pthread_cond_signal(&g_sched_cond);
+		}
+	} else {
+		s->wake_pending = true;
+	}
+	pthread_mutex_unlock(&g_sched_lock);
+}
+
+/**
+ * @brief Wait until a time of the monotonic clock, or until the scheduler is
+ * signaled
+ *
+ * The worker sleeps until g_spin_us before ts, and spins for the remaining
+ * time, so that it is not late by the scheduling latency of the kernel. When
+ * built with NO_SLEEP, it always spins.
+ *
+ * @note g_sched_lock must be held. The caller must check the heap again when
+ * this returns, as a session may have been scheduled earlier.
+ */
+static void wait_until(uint64_t ts)
+{
+	uint64_t now = scheduler_now_us();
+
+	if (ts <= now) {
+		return;
+	}
+#ifndef NO_SLEEP
+	if (ts - now > g_spin_us) {
+		const uint64_t wakeup = ts - g_spin_us;
+		struct timespec t = {
+			.tv_sec = wakeup / 1000000,
+			.tv_nsec = (wakeup % 1000000) * 1000,
+		};
+		pthread_cond_timedwait(&g_sched_cond, &g_sched_lock, &t);
+		return;
+	}
+#endif
+	pthread_mutex_unlock(&g_sched_lock);
+	while (scheduler_now_us() < ts);
+	pthread_mutex_lock(&g_sched_lock);
+}
+
+static void * scheduler_worker(void *arg)
+{
+	((void)arg);
+
+	prctl(PR_SET_TIMERSLACK, SCHEDULER_TIMER_SLACK_NS, 0, 0, 0);
+	pthread_mutex_lock(&g_sched_lock);
+	for (;;) {
+		if (g_heap_size == 0) {
+			pthread_cond_wait(&g_sched_cond, &g_sched_lock);
+			continue;
+		}
+		uint64_t now = scheduler_now_us();
+		if (g_heap[0]->next_run > now) {
+			wait_until(g_heap[0]->next_run);
+			continue;
+		}
+		session_t *s = heap_pop();
+		s->wake_pending = false;
+		/* Let another worker pick the next session */
+		if (g_heap_size > 0) {
+			pthread_cond_signal(&g_sched_cond);
+		}
+		pthread_mutex_unlock(&g_sched_lock);
+
+		bool alive = session_run_quantum(s, now);
+
+		pthread_mutex_lock(&g_sched_lock);
+		if (alive) {
+			if (s->wake_pending) {
+				s->next_run = now;
+			}
+			heap_push(s);
+		} else {
+			session_release(s);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Set how long before their next quantum workers spin instead of
+ * sleeping
+ *
+ * This must be called before scheduler_run.
+ */
+void scheduler_set_spin(unsigned int spin_us)
+{
+	g_spin_us = spin_us;
+}
+
+/**
+ * @brief Run the emulation of all sessions on a pool of worker threads
+ *
+ * Each worker picks the session with the earliest next_run, runs it for one
+ * quantum (see session_run_quantum), and puts it back in the heap. The
+ * calling thread is used as one of the workers: this function never returns.
+ *
+ * Only one session is emulated at a time, whatever the number of workers,
+ * since the sessions share the TamaLIB core (see session_run_quantum).
+ *
+ * @param n_workers number of workers, including the calling thread
+ */
+void scheduler_run(unsigned int n_workers)
+{
+	pthread_t thread;
+
+	pthread_once(&g_sched_once, &scheduler_init);
+	if (n_workers < 1) {
+		n_workers = 1;
+	}
+	if (n_workers > SCHEDULER_MAX_WORKERS) {
+		n_workers = SCHEDULER_MAX_WORKERS;
+	}
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Starting %u scheduler workers\n", n_workers);
+
+	for (unsigned int i = 1; i < n_workers; i++) {
+		if (pthread_create(&thread, NULL, &scheduler_worker, NULL)) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot start scheduler worker %u\n", i);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	scheduler_worker(NULL);
+}
@@ -0,0 +1,50 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include "session.h"
+
+#include <stdint.h>
+
+#define SCHEDULER_MAX_WORKERS 64
+
+#define SCHEDULER_DEFAULT_WORKERS 1
+// Default number of workers. TamaLIB keeps its CPU in globals, so the workers
+// take turns in the core: more workers only overlap the screen encoding and
+// sending of some sessions with the emulation of another.
+
+#define SCHEDULER_DEFAULT_SPIN_US 0
+// Default time before the next quantum during which a worker spins instead of
+// sleeping, for a more accurate wakeup at the cost of CPU time.
+
+#define SCHEDULER_TIMER_SLACK_NS 10000
+// Timer slack of the workers, i.e. how late the kernel may wake them up to
+// coalesce wakeups (50 us by default).
+
+uint64_t scheduler_now_us(void);
+timestamp_t scheduler_now(void);
+
+void scheduler_set_spin(unsigned int spin_us);
+void scheduler_run(unsigned int n_workers);
+void scheduler_add(session_t *s);
+void scheduler_wake(session_t *s);
+
+#endif /* _SCHEDULER_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "screen.h"
+#include "base64singleline.h"
+
+/**
+ * @brief Pack a bool_t array into bits
+ *
+ * @param src array to pack
+ * @param len src length, which must be a multiple of 8
+ * @param dst output array, of length len / 8
+ *
+ * @note src is an array of bytes used to represent bits, and is therefore
+ * expected to only contain values 0x0 and 0x1. The first element of src is
+ * the most significant bit of the first byte of dst.
+ */
+void screen_pack(const bool_t *src, const size_t len, uint8_t *dst)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	/* 16 pixels per step: reverse the order of the bytes in each 8-byte half,
+	 * turn the 0x1 bytes into 0xFF, and gather their most significant bits.
+	 */
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		unsigned int mask = _mm_movemask_epi8(_mm_sub_epi8(zero, v));
+		dst[i/8] = mask & 0xFF;
+		dst[i/8+1] = mask >> 8;
+	}
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* 8 pixels per step: the multiplication moves the low bit of each byte to
+	 * its position in the most significant byte.
+	 */
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, src + i, sizeof(v));
+		dst[i/8] = (v * 0x8040201008040201ull) >> 56;
+	}
+#endif
+
+	for (; i + 8 <= len; i += 8) {
+		dst[i/8] = 0;
+		for (int j = 0; j < 8; j++) {
+			dst[i/8] |= src[i+(7-j)] << j;
+		}
+	}
+}
+
+/**
+ * @brief Pack the screen matrix and icons
+ *
+ * @param matrix screen matrix
+ * @param icons screen icons
+ * @param screen output packed screen
+ */
+void screen_pack_screen(const bool_t matrix[LCD_HEIGHT][LCD_WIDTH],
+	const bool_t icons[ICON_NUM], uint8_t screen[SCREEN_SIZE])
+{
+	screen_pack((const bool_t *) matrix, LCD_HEIGHT * LCD_WIDTH, screen);
+	screen_pack(icons, ICON_NUM, screen + SCREEN_MATRIX_SIZE);
+}
+
+static void write_u32_le(uint8_t *dst, uint32_t val)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = (val >> 8) & 0xFF;
+	dst[2] = (val >> 16) & 0xFF;
+	dst[3] = (val >> 24) & 0xFF;
+}
+
+/**
+ * @brief Encode a packed screen as a binary frame
+ */
+void screen_encode_bin(const uint8_t screen[SCREEN_SIZE],
+	uint8_t frame[SCREEN_BIN_FRAME_SIZE])
+{
+	frame[0] = SCREEN_BIN_TYPE_FRAME;
+	memcpy(frame + 1, screen, SCREEN_SIZE);
+}
+
+/**
+ * @brief Encode a packed screen as a binary keyframe
+ */
+void screen_encode_bin_keyframe(const uint8_t screen[SCREEN_SIZE],
+	uint32_t seq, uint8_t frame[SCREEN_BIN_KEYFRAME_SIZE])
+{
+	frame[0] = SCREEN_BIN_TYPE_KEYFRAME;
+	write_u32_le(frame + 1, seq);
+	memcpy(frame + 5, screen, SCREEN_SIZE);
+}
+
+/**
+ * @brief Compute the spans of bytes that changed between two packed screens
+ *
+ * Each span is written as its offset in the packed screen (u8), its length
+ * (u8), and the new bytes. Spans separated by less than 3 unchanged bytes are
+ * merged, since a new span costs 2 bytes.
+ *
+ * @param previous previous packed screen
+ * @param current current packed screen
+ * @param spans output spans, of size SCREEN_DELTA_MAX_SIZE
+ * @return size of the spans, in bytes
+ */
+size_t screen_encode_delta(const uint8_t previous[SCREEN_SIZE],
+	const uint8_t current[SCREEN_SIZE], uint8_t *spans)
+{
+	size_t size = 0;
+	size_t i = 0;
+
+	while (i < SCREEN_SIZE) {
+		if (previous[i] == current[i]) {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		size_t end = i + 1;
+		for (size_t j = end; j < SCREEN_SIZE && j < end + 3; j++) {
+			if (previous[j] != current[j]) {
+				end = j + 1;
+			}
+		}
+		spans[size] = start;
+		spans[size+1] = end - start;
+		memcpy(spans + size + 2, current + start, end - start);
+		size += 2 + end - start;
+		i = end;
+	}
+	return size;
+}
+
+/**
+ * @brief Encode delta spans as a binary delta frame
+ *
+ * @param spans spans, as returned by screen_encode_delta
+ * @param spans_size size of the spans
+ * @param seq sequence number of the new screen
+ * @param frame output frame, of size SCREEN_BIN_DELTA_MAX_SIZE
+ * @return size of the frame, in bytes
+ */
+size_t screen_encode_bin_delta(const uint8_t *spans, size_t spans_size,
+	uint32_t seq, uint8_t *frame)
+{
+	frame[0] = SCREEN_BIN_TYPE_DELTA;
+	write_u32_le(frame + 1, seq);
+	memcpy(frame + 5, spans, spans_size);
+	return 5 + spans_size;
+}
+
+static char * append(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+static char * append_u32(char *dst, uint32_t val)
+{
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	while (n) {
+		*dst++ = digits[--n];
+	}
+	return dst;
+}
+
+#define APPEND_LITERAL(dst, str) append(dst, str, sizeof(str) - 1)
+
+/**
+ * @brief Encode a packed screen as a scr event
+ *
+ * The event is written in a single pass, without allocation.
+ *
+ * @param screen packed screen
+ * @param seq sequence number of the screen, or NULL to omit it
+ * @param msg output message, of size SCREEN_JSON_MAX_SIZE
+ * @return length of the message
+ */
+size_t screen_encode_json(const uint8_t screen[SCREEN_SIZE], const uint32_t *seq,
+	char *msg)
+{
+	char *pos = msg;
+
+	pos = APPEND_LITERAL(pos, "{\"t\":\"scr\",\"e\":{\"m\":\"");
+	pos += base64singleline_encode_to(screen, SCREEN_MATRIX_SIZE, pos);
+	pos = APPEND_LITERAL(pos, "\",\"i\":\"");
+	pos += base64singleline_encode_to(screen + SCREEN_MATRIX_SIZE, SCREEN_ICON_SIZE, pos);
+	pos = APPEND_LITERAL(pos, "\"");
+	if (seq != NULL) {
+		pos = APPEND_LITERAL(pos, ",\"q\":");
+		pos = append_u32(pos, *seq);
+	}
+	pos = APPEND_LITERAL(pos, "}}");
+	*pos = '\0';
+	return pos - msg;
+}
+
+/**
+ * @brief Encode delta spans as a scd event
+ *
+ * The event is written in a single pass, without allocation.
+ *
+ * @param spans spans, as returned by screen_encode_delta
+ * @param spans_size size of the spans
+ * @param seq sequence number of the new screen
+ * @param msg output message, of size SCREEN_JSON_DELTA_MAX_SIZE
+ * @return length of the message
+ */
+size_t screen_encode_json_delta(const uint8_t *spans, size_t spans_size,
+	uint32_t seq, char *msg)
+{
+	char *pos = msg;
+
+	pos = APPEND_LITERAL(pos, "{\"t\":\"scd\",\"e\":{\"q\":");
+	pos = append_u32(pos, seq);
+	pos = APPEND_LITERAL(pos, ",\"d\":\"");
+	pos += base64singleline_encode_to(spans, spans_size, pos);
+	pos = APPEND_LITERAL(pos, "\"}}");
+	*pos = '\0';
+	return pos - msg;
+}
@@ -0,0 +1,78 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SCREEN_H_
+#define _SCREEN_H_
+
+#include <stdint.h>
+
+#include "tamalib/tamalib.h"
+
+#define SCREEN_MATRIX_SIZE (LCD_HEIGHT * LCD_WIDTH / 8)
+// Size of the packed screen matrix, in bytes (one bit per pixel).
+
+#define SCREEN_ICON_SIZE (ICON_NUM / 8)
+// Size of the packed icons, in bytes (one bit per icon).
+
+#define SCREEN_SIZE (SCREEN_MATRIX_SIZE + SCREEN_ICON_SIZE)
+// Size of the packed screen: the packed matrix, followed by the packed icons.
+
+#define SCREEN_BIN_TYPE_FRAME 0x01
+#define SCREEN_BIN_TYPE_DELTA 0x02
+#define SCREEN_BIN_TYPE_KEYFRAME 0x03
+
+#define SCREEN_BIN_FRAME_SIZE (1 + SCREEN_SIZE)
+// Size of a binary screen frame: the frame type (SCREEN_BIN_TYPE_FRAME),
+// followed by the packed screen.
+
+#define SCREEN_BIN_KEYFRAME_SIZE (5 + SCREEN_SIZE)
+// Size of a binary keyframe: the frame type (SCREEN_BIN_TYPE_KEYFRAME), the
+// sequence number (u32 little-endian), and the packed screen.
+
+#define SCREEN_DELTA_MAX_SIZE (2 * SCREEN_SIZE)
+// Maximum size of the spans of a delta. Deltas larger than SCREEN_SIZE are
+// not worth sending: a keyframe should be sent instead.
+
+#define SCREEN_BIN_DELTA_MAX_SIZE (5 + SCREEN_DELTA_MAX_SIZE)
+// Maximum size of a binary delta: the frame type (SCREEN_BIN_TYPE_DELTA), the
+// sequence number (u32 little-endian), and the spans.
+
+#define SCREEN_JSON_MAX_SIZE 160
+// Maximum size of a scr event, including the string terminator.
+
+#define SCREEN_JSON_DELTA_MAX_SIZE 256
+// Maximum size of a scd event, including the string terminator.
+
+void screen_pack(const bool_t *src, const size_t len, uint8_t *dst);
+void screen_pack_screen(const bool_t matrix[LCD_HEIGHT][LCD_WIDTH],
+	const bool_t icons[ICON_NUM], uint8_t screen[SCREEN_SIZE]);
+void screen_encode_bin(const uint8_t screen[SCREEN_SIZE],
+	uint8_t frame[SCREEN_BIN_FRAME_SIZE]);
+void screen_encode_bin_keyframe(const uint8_t screen[SCREEN_SIZE],
+	uint32_t seq, uint8_t frame[SCREEN_BIN_KEYFRAME_SIZE]);
+size_t screen_encode_delta(const uint8_t previous[SCREEN_SIZE],
+	const uint8_t current[SCREEN_SIZE], uint8_t *spans);
+size_t screen_encode_bin_delta(const uint8_t *spans, size_t spans_size,
+	uint32_t seq, uint8_t *frame);
+size_t screen_encode_json(const uint8_t screen[SCREEN_SIZE], const uint32_t *seq,
+	char *msg);
+size_t screen_encode_json_delta(const uint8_t *spans, size_t spans_size,
+	uint32_t seq, char *msg);
+
+#endif /* _SCREEN_H_ */
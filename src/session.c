@@ -0,0 +1,1579 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <base64.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "session.h"
+#include "scheduler.h"
+#include "state.h"
+#include "stats.h"
+#include "store.h"
+#include "base64singleline.h"
+#include "logger.h"
+#include "metrics.h"
+#include "msgbuf.h"
+#include "outbox.h"
+
+#define SESSION_BUCKETS SESSION_MAX
+#define CLIENT_BUCKETS 4096
+
+#define SESSION_UNLIMITED_BUDGET_US 10000
+// Wall-clock time a session running at SPEED_UNLIMITED (or catching up with
+// the wall clock) may hold the core before another session is scheduled.
+
+#define SESSION_BATCH_TICKS 4096
+// CPU clock cycles run between two checks of the wall clock by a session that
+// is behind, i.e. about a thousand instructions.
+
+typedef struct client_entry {
+	ws_cli_conn_t client;
+	client_options_t options;
+	session_t *session;			// NULL if the client is not in a session
+	struct client_entry *next;
+} client_entry_t;
+
+/* Session registry. The registry holds one reference to each session. */
+static pthread_mutex_t g_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static session_t *g_sessions[SESSION_BUCKETS] = {0};
+static client_entry_t *g_clients[CLIENT_BUCKETS] = {0};
+static size_t g_n_sessions = 0;
+
+/* TamaLIB core state, guarded by g_core_lock */
+static pthread_mutex_t g_core_lock = PTHREAD_MUTEX_INITIALIZER;
+static session_t *g_current = NULL;	// Session receiving the HAL callbacks
+static session_t *g_loaded = NULL;	// Session whose state is in the core
+static const u12_t *g_loaded_program = NULL;
+static bool g_ts_override = false;
+static timestamp_t g_ts_override_value = 0;
+
+static unsigned int g_autosave_period = 0;
+
+static u8_t log_levels = LOG_ERROR | LOG_INFO;
+
+static uint32_t hash_id(const char *id)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; *id; id++) {
+		h ^= (unsigned char) *id;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t hash_client(ws_cli_conn_t client)
+{
+	uint64_t h = (uint64_t) client * 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (h >> 32);
+}
+
+/* Subscribers */
+
+/**
+ * @brief Send an event to the subscribers of a session, framed once
+ */
+static void session_send_locked(session_t *s, const char *msg, size_t size,
+	int type, metrics_event_t event)
+{
+	if (s->n_subscribers == 0) {
+		return;
+	}
+	msgbuf_t *buf = msgbuf_frame(msg, size, type);
+	if (buf == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		outbox_send_buf(s->subscribers[i].client, buf, event);
+	}
+	msgbuf_release(buf);
+}
+
+static void session_send(session_t *s, const char *msg, size_t size, int type,
+	metrics_event_t event)
+{
+	pthread_mutex_lock(&s->lock);
+	session_send_locked(s, msg, size, type, event);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void session_remove_subscriber(session_t *s, ws_cli_conn_t client)
+{
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		if (s->subscribers[i].client == client) {
+			s->subscribers[i] = s->subscribers[--s->n_subscribers];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int session_add_subscriber(session_t *s, ws_cli_conn_t client,
+	const client_options_t *options)
+{
+	int status = 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->n_subscribers == s->subscribers_size) {
+		size_t new_size = s->subscribers_size ? s->subscribers_size * 2 : 4;
+		subscriber_t *new_subscribers = realloc(
+			s->subscribers, new_size * sizeof(subscriber_t));
+		if (new_subscribers == NULL) {
+			status = 1;
+			goto end;
+		}
+		s->subscribers = new_subscribers;
+		s->subscribers_size = new_size;
+	}
+	s->subscribers[s->n_subscribers].client = client;
+	s->subscribers[s->n_subscribers].options = *options;
+	s->subscribers[s->n_subscribers].needs_keyframe = true;
+	s->subscribers[s->n_subscribers].screen_seq = 0;
+	s->subscribers[s->n_subscribers].last_frame = 0;
+	s->n_subscribers++;
+
+	end:
+		pthread_mutex_unlock(&s->lock);
+		return status;
+}
+
+/* Registry */
+
+bool session_is_valid_id(const char *id)
+{
+	size_t len = strlen(id);
+	if (len == 0 || len >= SESSION_ID_SIZE) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		char c = id[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			  (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static session_t * session_find_locked(const char *id)
+{
+	session_t *s = g_sessions[hash_id(id) % SESSION_BUCKETS];
+	while (s != NULL && strcmp(s->id, id) != 0) {
+		s = s->next;
+	}
+	return s;
+}
+
+static client_entry_t ** client_entry_find_locked(ws_cli_conn_t client)
+{
+	client_entry_t **e = &g_clients[hash_client(client) % CLIENT_BUCKETS];
+	while (*e != NULL && (*e)->client != client) {
+		e = &(*e)->next;
+	}
+	return e;
+}
+
+static client_entry_t * client_entry_get_locked(ws_cli_conn_t client)
+{
+	client_entry_t **e = client_entry_find_locked(client);
+	if (*e == NULL) {
+		*e = calloc(1, sizeof(client_entry_t));
+		if (*e != NULL) {
+			(*e)->client = client;
+		}
+	}
+	return *e;
+}
+
+static void session_free(session_t *s)
+{
+	pthread_mutex_destroy(&s->lock);
+	command_t command;
+
+	while (command_queue_pop(&s->commands, &command)) {
+		command_free(&command);
+	}
+	rom_release(s->rom);
+	free(s->state);
+	free(s->subscribers);
+	free(s);
+}
+
+void session_release(session_t *s)
+{
+	if (s != NULL && atomic_fetch_sub(&s->refcount, 1) == 1) {
+		session_free(s);
+	}
+}
+
+/**
+ * @brief Register a session and start its emulation
+ *
+ * @param state state save to start from (STATE_SIZE bytes), or NULL to start
+ * from the initial state
+ * @return the new session, or NULL on failure
+ */
+static session_t * session_start(const char *id, rom_t *rom,
+	const uint8_t *state)
+{
+	session_t *s = aligned_alloc(alignof(session_t), sizeof(session_t));
+	if (s == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(session_t));
+	strncpy(s->id, id, SESSION_ID_SIZE - 1);
+	atomic_init(&s->refcount, 2);	// registry + caller
+	pthread_mutex_init(&s->lock, NULL);
+	command_queue_init(&s->commands);
+	rom_acquire(rom);
+	s->rom = rom;
+	s->next_run = scheduler_now_us();
+	s->deadline = s->next_run;
+	s->heap_index = -1;
+	s->speed = SPEED_1X;
+	s->exec_mode = EXEC_MODE_RUN;
+	s->last_autosave = time(NULL);
+	if (state != NULL) {
+		s->state = malloc(STATE_SIZE);
+		if (s->state == NULL) {
+			session_free(s);
+			return NULL;
+		}
+		memcpy(s->state, state, STATE_SIZE);
+	}
+
+	pthread_mutex_lock(&g_registry_lock);
+	if (g_n_sessions >= SESSION_MAX || session_find_locked(id) != NULL) {
+		pthread_mutex_unlock(&g_registry_lock);
+		session_free(s);
+		return NULL;
+	}
+	session_t **bucket = &g_sessions[hash_id(id) % SESSION_BUCKETS];
+	s->next = *bucket;
+	*bucket = s;
+	g_n_sessions++;
+	pthread_mutex_unlock(&g_registry_lock);
+
+	scheduler_add(s);
+
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SESSION, "Starting emulation (session %s)\n", s->id);
+	return s;
+}
+
+/**
+ * @brief Create a session and start its emulation
+ *
+ * @param id session ID
+ * @param rom program to execute. The session holds its own reference to it.
+ * @return the new session, or NULL if the ID is already used or if the
+ * maximum number of sessions is reached
+ *
+ * @note The caller must release the returned session with session_release.
+ */
+session_t * session_create(const char *id, rom_t *rom)
+{
+	session_t *s = session_start(id, rom, NULL);
+	if (s != NULL) {
+		store_put_rom(s->id, rom);
+	}
+	return s;
+}
+
+/**
+ * @brief Restore a session from the store, see store_restore
+ *
+ * @param state latest state save of the session, or NULL to start from the
+ * initial state
+ * @return 0 on success, 1 on failure
+ */
+int session_restore(const char *id, rom_t *rom, const uint8_t *state,
+	size_t state_size)
+{
+	if (state != NULL && state_size != STATE_SIZE) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_SESSION, "Ignoring invalid state save (session %s)\n", id);
+		state = NULL;
+	}
+	session_t *s = session_start(id, rom, state);
+	session_release(s);
+	return s == NULL;
+}
+
+/**
+ * @brief Set the interval between two autosaves of each session to the store
+ *
+ * @param period interval in seconds, or 0 to disable autosaves
+ */
+void session_set_autosave_period(unsigned int period)
+{
+	g_autosave_period = period;
+}
+
+/**
+ * @brief Find a session by ID
+ *
+ * @return the session, or NULL if it does not exist
+ *
+ * @note The caller must release the returned session with session_release.
+ */
+session_t * session_find(const char *id)
+{
+	pthread_mutex_lock(&g_registry_lock);
+	session_t *s = session_find_locked(id);
+	if (s != NULL) {
+		atomic_fetch_add(&s->refcount, 1);
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+	return s;
+}
+
+/**
+ * @brief Call a function on each session
+ *
+ * @note callback is called with the registry lock held, and must not call the
+ * functions of the session registry.
+ */
+void session_foreach(void (*callback)(session_t *s, void *arg), void *arg)
+{
+	pthread_mutex_lock(&g_registry_lock);
+	for (size_t b = 0; b < SESSION_BUCKETS; b++) {
+		for (session_t *s = g_sessions[b]; s != NULL; s = s->next) {
+			callback(s, arg);
+		}
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+}
+
+/**
+ * @brief Find the session a client is subscribed to
+ *
+ * @return the session, or NULL if the client is not subscribed to any session
+ *
+ * @note The caller must release the returned session with session_release.
+ */
+session_t * session_of_client(ws_cli_conn_t client)
+{
+	session_t *s = NULL;
+
+	pthread_mutex_lock(&g_registry_lock);
+	client_entry_t *e = *client_entry_find_locked(client);
+	if (e != NULL && e->session != NULL) {
+		s = e->session;
+		atomic_fetch_add(&s->refcount, 1);
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+	return s;
+}
+
+/**
+ * @brief Subscribe a client to a session
+ *
+ * The client receives the session events (scr, frq, log, sav and end) until it
+ * is unsubscribed. A client is subscribed to at most one session: it is
+ * unsubscribed from its previous session, if any.
+ *
+ * @return 0 on success, 1 on failure
+ */
+int session_subscribe(session_t *s, ws_cli_conn_t client)
+{
+	int status = 0;
+
+	pthread_mutex_lock(&g_registry_lock);
+	client_entry_t *e = client_entry_get_locked(client);
+	if (e == NULL) {
+		status = 1;
+		goto end;
+	}
+	if (e->session == s) {
+		goto end;
+	}
+	if (e->session != NULL) {
+		session_remove_subscriber(e->session, client);
+		e->session = NULL;
+	}
+	if (session_add_subscriber(s, client, &e->options)) {
+		status = 1;
+		goto end;
+	}
+	e->session = s;
+
+	end:
+		pthread_mutex_unlock(&g_registry_lock);
+		if (status == 0) {
+			/* Catch up and send the screen right away if s was headless */
+			scheduler_wake(s);
+			char msg_template[] = "{\"t\":\"ses\",\"e\":{\"i\":\"%s\",\"h\":\"%s\"}}";
+			char msg[sizeof(msg_template) + SESSION_ID_SIZE + ROM_HASH_SIZE];
+			int msg_size = snprintf(msg, sizeof(msg), msg_template, s->id, s->rom->hash);
+			outbox_send(client, msg, msg_size, FRM_TXT, METRICS_EVENT_SES);
+		}
+		return status;
+}
+
+/**
+ * @brief Unsubscribe a client from its session, and forget its options
+ *
+ * This is called when the client disconnects.
+ */
+void session_unsubscribe(ws_cli_conn_t client)
+{
+	pthread_mutex_lock(&g_registry_lock);
+	client_entry_t **e = client_entry_find_locked(client);
+	if (*e != NULL) {
+		client_entry_t *removed = *e;
+		if (removed->session != NULL) {
+			session_remove_subscriber(removed->session, client);
+		}
+		*e = removed->next;
+		free(removed);
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+}
+
+/**
+ * @brief Set the protocol options of a client
+ *
+ * The options apply to the current session of the client, if any, and to the
+ * sessions it joins later. The client receives a full screen update in the
+ * new format.
+ */
+void session_configure_client(ws_cli_conn_t client,
+	const client_options_t *options)
+{
+	pthread_mutex_lock(&g_registry_lock);
+	client_entry_t *e = client_entry_get_locked(client);
+	if (e != NULL) {
+		e->options = *options;
+		if (e->session != NULL) {
+			session_t *s = e->session;
+			pthread_mutex_lock(&s->lock);
+			for (size_t i = 0; i < s->n_subscribers; i++) {
+				if (s->subscribers[i].client == client) {
+					s->subscribers[i].options = *options;
+					s->subscribers[i].needs_keyframe = true;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+}
+
+/**
+ * @brief Send a full screen update to a client with its next screen update
+ */
+void session_request_keyframe(ws_cli_conn_t client)
+{
+	pthread_mutex_lock(&g_registry_lock);
+	client_entry_t *e = *client_entry_find_locked(client);
+	if (e != NULL && e->session != NULL) {
+		session_t *s = e->session;
+		pthread_mutex_lock(&s->lock);
+		for (size_t i = 0; i < s->n_subscribers; i++) {
+			if (s->subscribers[i].client == client) {
+				s->subscribers[i].needs_keyframe = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_mutex_unlock(&g_registry_lock);
+}
+
+/* Client actions */
+
+/**
+ * @brief Queue a client action, to be applied in the next quantum of the
+ * session
+ *
+ * @return 0 on success, 1 if too many actions are pending
+ */
+static int session_push_command(session_t *s, command_t *command)
+{
+	command->received = stats_get_arrival();
+	command->queued = scheduler_now();
+	if (command->type == COMMAND_BUTTON && command->received) {
+		stats_record(STATS_STAGE_PARSE, command->queued - command->received);
+	}
+	if (!command_queue_push(&s->commands, command)) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_SESSION, "Too many pending actions, dropping one (session %s)\n", s->id);
+		metrics_add(&g_metrics.commands_dropped, 1);
+		command_free(command);
+		return 1;
+	}
+	scheduler_wake(s);
+	return 0;
+}
+
+int session_set_button(session_t *s, button_t btn, btn_state_t state)
+{
+	command_t command = {.type = COMMAND_BUTTON, .button = {btn, state}};
+	return session_push_command(s, &command);
+}
+
+int session_set_exec_mode(session_t *s, exec_mode_t mode)
+{
+	command_t command = {.type = COMMAND_EXEC_MODE, .exec_mode = mode};
+	return session_push_command(s, &command);
+}
+
+int session_set_speed(session_t *s, u8_t speed)
+{
+	command_t command = {.type = COMMAND_SPEED, .speed = speed};
+	return session_push_command(s, &command);
+}
+
+int session_request_end(session_t *s)
+{
+	command_t command = {.type = COMMAND_END};
+	return session_push_command(s, &command);
+}
+
+int session_request_save(session_t *s)
+{
+	command_t command = {.type = COMMAND_SAVE};
+	return session_push_command(s, &command);
+}
+
+int session_request_load(session_t *s, const char *state_b64)
+{
+	command_t command = {.type = COMMAND_LOAD, .state_b64 = strdup(state_b64)};
+	if (command.state_b64 == NULL) {
+		return 1;
+	}
+	return session_push_command(s, &command);
+}
+
+/**
+ * @brief Run the CPU of a session ahead by an emulated duration, at full speed
+ *
+ * The buttons are held in their current state, and the session does not send
+ * screen updates until the end of the fast-forward. Its subscribers then
+ * receive a ffw event with the final screen and state.
+ *
+ * @param s session
+ * @param duration emulated duration, in seconds (at most SESSION_FFW_MAX_S)
+ * @return 0 if the fast-forward was queued, 1 otherwise
+ */
+int session_fast_forward(session_t *s, uint32_t duration)
+{
+	command_t command = {.type = COMMAND_FAST_FORWARD, .duration = duration};
+	if (duration > SESSION_FFW_MAX_S) {
+		return 1;
+	}
+	return session_push_command(s, &command);
+}
+
+/* HAL */
+
+static void hal_halt(void)
+{
+	g_current->halted = true;
+}
+
+static bool_t hal_is_log_enabled(log_level_t level)
+{
+	return !!(log_levels & level);
+}
+
+/**
+ * @brief Check if a session may send a log event, given its rate limit
+ *
+ * The limit is a token bucket, refilled with SESSION_LOG_RATE tokens per
+ * second, up to SESSION_LOG_BURST tokens.
+ */
+static bool session_log_allowed(session_t *s)
+{
+	const timestamp_t period = 1000000 / SESSION_LOG_RATE;
+	timestamp_t now = scheduler_now();
+	uint32_t refill = (now - s->log_refill) / period;
+
+	if (refill > 0) {
+		s->log_tokens = (s->log_tokens + refill < SESSION_LOG_BURST) ?
+			s->log_tokens + refill : SESSION_LOG_BURST;
+		s->log_refill = (s->log_tokens < SESSION_LOG_BURST) ?
+			s->log_refill + refill * period : now;
+	}
+	if (s->log_tokens == 0) {
+		metrics_add(&g_metrics.logs_dropped, 1);
+		return false;
+	}
+	s->log_tokens--;
+	return true;
+}
+
+/**
+ * @brief Escape a string for a JSON string literal
+ *
+ * @param out output buffer, of size 6 * strlen(in) + 1 at least
+ * @return the size of the escaped string, without the string terminator
+ */
+static size_t json_escape(const char *in, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *o = out;
+
+	for (; *in; in++) {
+		unsigned char c = *in;
+		if (c == '"' || c == '\\') {
+			*o++ = '\\';
+			*o++ = c;
+		} else if (c == '\n') {
+			*o++ = '\\';
+			*o++ = 'n';
+		} else if (c == '\t') {
+			*o++ = '\\';
+			*o++ = 't';
+		} else if (c < 0x20) {
+			memcpy(o, "\\u00", 4);
+			o[4] = hex[c >> 4];
+			o[5] = hex[c & 0xF];
+			o += 6;
+		} else {
+			*o++ = c;
+		}
+	}
+	*o = '\0';
+	return o - out;
+}
+
+/**
+ * @brief Log a TamaLIB message, and send it to the subscribers of the current
+ * session that receive logs
+ *
+ * The message is formatted once, in a buffer of the calling thread.
+ */
+static void hal_log(log_level_t level, char *buff, ...)
+{
+	static _Thread_local char text[SESSION_LOG_MAX_SIZE];
+	static _Thread_local char msg[32 + 6 * SESSION_LOG_MAX_SIZE];
+	session_t *s = g_current;
+	va_list arglist;
+	size_t msg_size = 0;
+	msgbuf_t *buf = NULL;
+
+	if (!(log_levels & level)) {
+		return;
+	}
+
+	va_start(arglist, buff);
+	int size = vsnprintf(text, sizeof(text), buff, arglist);
+	va_end(arglist);
+	if (size < 0) {
+		return;
+	}
+
+	const logger_level_t logger_level = (level == LOG_ERROR) ? LOGGER_ERROR :
+		(level == LOG_INFO) ? LOGGER_INFO : LOGGER_DEBUG;
+	LOGGER(logger_level, LOGGER_CAT_EMU, "%s", text);
+
+	if (s == NULL || s->headless) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		subscriber_t *sub = &s->subscribers[i];
+		if (!sub->options.logs) {
+			continue;
+		}
+		if (buf == NULL) {
+			if (!session_log_allowed(s)) {
+				break;
+			}
+			msg_size = snprintf(msg, sizeof(msg), "{\"t\":\"log\",\"e\":{\"l\":%d,\"m\":\"", level);
+			msg_size += json_escape(text, msg + msg_size);
+			memcpy(msg + msg_size, "\"}}", 3);
+			msg_size += 3;
+			buf = msgbuf_frame(msg, msg_size, FRM_TXT);
+			if (buf == NULL) {
+				break;
+			}
+		}
+		outbox_send_buf(sub->client, buf, METRICS_EVENT_LOG);
+	}
+	pthread_mutex_unlock(&s->lock);
+	msgbuf_release(buf);
+}
+
+static timestamp_t hal_get_timestamp(void)
+{
+	if (g_ts_override) {
+		return g_ts_override_value;
+	}
+	return scheduler_now();
+}
+
+static void hal_sleep_until(timestamp_t ts)
+{
+	/* The session scheduler does the sleeping, and paces the CPU with its own
+	 * clock (see session_step): TamaLIB rounds the duration of each
+	 * instruction down to a whole timestamp unit, which would make the
+	 * emulated time run up to 0.4% faster than the wall clock.
+	 */
+	(void) ts;
+}
+
+/* Screen updates encoded for the subscribers of a session. Each encoding is
+ * done and framed at most once per update, when a subscriber first needs it.
+ */
+typedef struct {
+	const uint8_t *screen;
+	uint32_t seq;
+	uint8_t spans[SCREEN_DELTA_MAX_SIZE];
+	size_t spans_size;
+	char json[SCREEN_JSON_MAX_SIZE];
+	size_t json_size;
+	char json_keyframe[SCREEN_JSON_MAX_SIZE];
+	size_t json_keyframe_size;
+	char json_delta[SCREEN_JSON_DELTA_MAX_SIZE];
+	size_t json_delta_size;
+	uint8_t bin[SCREEN_BIN_FRAME_SIZE];
+	size_t bin_size;
+	uint8_t bin_keyframe[SCREEN_BIN_KEYFRAME_SIZE];
+	size_t bin_keyframe_size;
+	uint8_t bin_delta[SCREEN_BIN_DELTA_MAX_SIZE];
+	size_t bin_delta_size;
+	msgbuf_t *frames[6];		// Frame of each encoding, see send_screen_frame
+} screen_update_t;
+
+/**
+ * @brief Queue one of the encodings of a screen update for a subscriber,
+ * framing it on first use
+ */
+static void send_screen_frame(subscriber_t *sub, msgbuf_t **frame,
+	const void *payload, size_t size, int type, metrics_event_t event)
+{
+	if (*frame == NULL) {
+		*frame = msgbuf_frame(payload, size, type);
+		if (*frame == NULL) {
+			return;
+		}
+	}
+	outbox_send_buf(sub->client, *frame, event);
+}
+
+static void send_screen_update(subscriber_t *sub, screen_update_t *u,
+	bool keyframe)
+{
+	if (!sub->options.delta) {
+		if (sub->options.binary) {
+			if (!u->bin_size) {
+				screen_encode_bin(u->screen, u->bin);
+				u->bin_size = SCREEN_BIN_FRAME_SIZE;
+			}
+			send_screen_frame(sub, &u->frames[0], u->bin, u->bin_size, FRM_BIN, METRICS_EVENT_SCR);
+		} else {
+			if (!u->json_size) {
+				u->json_size = screen_encode_json(u->screen, NULL, u->json);
+			}
+			send_screen_frame(sub, &u->frames[1], u->json, u->json_size, FRM_TXT, METRICS_EVENT_SCR);
+		}
+	} else if (keyframe) {
+		if (sub->options.binary) {
+			if (!u->bin_keyframe_size) {
+				screen_encode_bin_keyframe(u->screen, u->seq, u->bin_keyframe);
+				u->bin_keyframe_size = SCREEN_BIN_KEYFRAME_SIZE;
+			}
+			send_screen_frame(sub, &u->frames[2], u->bin_keyframe, u->bin_keyframe_size, FRM_BIN, METRICS_EVENT_SCR);
+		} else {
+			if (!u->json_keyframe_size) {
+				u->json_keyframe_size = screen_encode_json(u->screen, &u->seq, u->json_keyframe);
+			}
+			send_screen_frame(sub, &u->frames[3], u->json_keyframe, u->json_keyframe_size, FRM_TXT, METRICS_EVENT_SCR);
+		}
+	} else {
+		if (sub->options.binary) {
+			if (!u->bin_delta_size) {
+				u->bin_delta_size = screen_encode_bin_delta(u->spans, u->spans_size, u->seq, u->bin_delta);
+			}
+			send_screen_frame(sub, &u->frames[4], u->bin_delta, u->bin_delta_size, FRM_BIN, METRICS_EVENT_SCD);
+		} else {
+			if (!u->json_delta_size) {
+				u->json_delta_size = screen_encode_json_delta(u->spans, u->spans_size, u->seq, u->json_delta);
+			}
+			send_screen_frame(sub, &u->frames[5], u->json_delta, u->json_delta_size, FRM_TXT, METRICS_EVENT_SCD);
+		}
+	}
+}
+
+/**
+ * @brief Check if a subscriber may receive a screen update, given its frame
+ * rate cap
+ */
+static bool subscriber_frame_due(const subscriber_t *sub, timestamp_t now)
+{
+	if (sub->options.max_fps == 0 || sub->options.max_fps >= SESSION_FRAMERATE) {
+		return true;
+	}
+	int32_t interval = 1000000 / sub->options.max_fps - SESSION_FRAME_TOLERANCE_US;
+	return (int32_t) (now - sub->last_frame) >= interval;
+}
+
+/**
+ * @brief Send the latest screen of a session to its subscribers
+ *
+ * TamaLIB may render many frames during a quantum, in particular when the
+ * emulation runs faster than 1x. Only the last one is sent, and only to the
+ * subscribers whose frame rate cap allows it. A subscriber that skips an
+ * update receives the latest screen once it is due again.
+ */
+static void update_screen(session_t *s, timestamp_t now)
+{
+	uint8_t screen[SCREEN_SIZE];
+	screen_update_t u = {0};
+	bool changed = false;
+	bool keyframe_due = false;
+	uint64_t n_sent = 0;
+	uint64_t n_capped = 0;
+	timestamp_t encode_start = s->input_pending ? scheduler_now() : 0;
+
+	if (s->screen_dirty) {
+		s->screen_dirty = false;
+		screen_pack_screen(s->matrix_buffer, s->icon_buffer, screen);
+		changed = memcmp(screen, s->previous_screen, SCREEN_SIZE) != 0;
+		if (!changed) {
+			metrics_add(&g_metrics.frames_identical, 1);
+		}
+	}
+	if (changed) {
+		s->screen_seq++;
+		u.spans_size = screen_encode_delta(s->previous_screen, screen, u.spans);
+		/* Periodic keyframes let delta clients recover from lost updates */
+		if ((int32_t) (now - s->last_keyframe) >= SESSION_KEYFRAME_PERIOD_US ||
+			u.spans_size >= SCREEN_SIZE) {
+			keyframe_due = true;
+			s->last_keyframe = now;
+		}
+		memcpy(s->previous_screen, screen, SCREEN_SIZE);
+	}
+	u.screen = s->previous_screen;
+	u.seq = s->screen_seq;
+
+	/* Clients that subscribed since the last update receive the full frame,
+	 * even if it is identical to the previous one. Delta clients that skipped
+	 * an update cannot apply the latest spans, and receive a keyframe.
+	 */
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		subscriber_t *sub = &s->subscribers[i];
+		if (!sub->needs_keyframe && sub->screen_seq == u.seq) {
+			continue;
+		}
+		if (!sub->needs_keyframe && !subscriber_frame_due(sub, now)) {
+			n_capped++;
+			continue;
+		}
+		/* A screen update still queued for the client is replaced by this
+		 * one (see outbox.h), so that it cannot be a delta
+		 */
+		const bool in_sequence = changed && sub->screen_seq == u.seq - 1 &&
+			!outbox_has_screen(sub->client);
+		send_screen_update(sub, &u, keyframe_due || sub->needs_keyframe || !in_sequence);
+		sub->needs_keyframe = false;
+		sub->screen_seq = u.seq;
+		sub->last_frame = now;
+		n_sent++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	for (size_t i = 0; i < sizeof(u.frames) / sizeof(u.frames[0]); i++) {
+		msgbuf_release(u.frames[i]);
+	}
+	metrics_add(&g_metrics.frames_sent, n_sent);
+	metrics_add(&g_metrics.frames_capped, n_capped);
+
+	if (s->input_pending && n_sent) {
+		timestamp_t end = scheduler_now();
+		stats_record(STATS_STAGE_EMULATION, encode_start - s->input_applied);
+		stats_record(STATS_STAGE_SEND, end - encode_start);
+		stats_record(STATS_STAGE_TOTAL, end - s->input_received);
+		s->input_pending = false;
+	}
+}
+
+static void hal_update_screen(void)
+{
+	/* Coalesce the frames rendered during a quantum: the screen is sent
+	 * once, at the end of the quantum. The screen of a headless session is
+	 * still tracked, so that it can be sent when a client subscribes.
+	 */
+	g_current->screen_dirty = true;
+}
+
+/* TamaLIB only calls hal_update_screen from tamalib_mainloop, which sessions
+ * do not use: the screen is also marked dirty whenever a pixel changes.
+ */
+static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+{
+	if (g_current->matrix_buffer[y][x] != val) {
+		g_current->matrix_buffer[y][x] = val;
+		g_current->screen_dirty = true;
+	}
+}
+
+static void hal_set_lcd_icon(u8_t icon, bool_t val)
+{
+	if (g_current->icon_buffer[icon] != val) {
+		g_current->icon_buffer[icon] = val;
+		g_current->screen_dirty = true;
+	}
+}
+
+static void hal_set_frequency(u32_t freq)
+{
+	if (g_current->current_freq != freq) {
+		g_current->current_freq = freq;
+		g_current->sin_pos = 0;
+	}
+}
+
+static void hal_play_frequency(bool_t en)
+{
+	session_t *s = g_current;
+
+	if (s->is_audio_playing != en) {
+		s->is_audio_playing = en;
+		if (s->headless || s->ffw_ticks) {
+			return;
+		}
+		static _Thread_local char msg[64];
+		pthread_mutex_lock(&s->lock);
+		if (s->n_subscribers > 0) {
+			int msg_size = snprintf(msg, sizeof(msg), "{\"t\":\"frq\",\"e\":{\"f\":%u,\"p\":%u,\"e\":%d}}",
+				s->current_freq, s->sin_pos, s->is_audio_playing);
+			session_send_locked(s, msg, msg_size, FRM_TXT, METRICS_EVENT_FRQ);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static int hal_handler(void)
+{
+	/* Input is handled by session_handle_commands */
+	return 0;
+}
+
+static hal_t hal = {
+    .halt = &hal_halt,
+    .is_log_enabled = &hal_is_log_enabled,
+    .log = &hal_log,
+    .sleep_until = &hal_sleep_until,
+    .get_timestamp = &hal_get_timestamp,
+    .update_screen = &hal_update_screen,
+    .set_lcd_matrix = &hal_set_lcd_matrix,
+    .set_lcd_icon = &hal_set_lcd_icon,
+    .set_frequency = &hal_set_frequency,
+    .play_frequency = &hal_play_frequency,
+    .handler = &hal_handler,
+};
+
+/* Emulation */
+
+/**
+ * @brief Send the state of the session to its subscribers
+ *
+ * Binary clients receive the state save as a binary frame, and the other
+ * clients as a sav event.
+ */
+static void state_save_to_ws(session_t *s)
+{
+	uint8_t frame[1 + STATE_SIZE];
+	char msg_template[] = "{\"t\":\"sav\",\"e\":{\"s\":\"%s\"}}";
+	char msg[sizeof(msg_template) + BASE64SINGLELINE_SIZE(STATE_SIZE)];
+	char save_b64[BASE64SINGLELINE_SIZE(STATE_SIZE) + 1];
+	msgbuf_t *bin_buf = NULL;
+	msgbuf_t *json_buf = NULL;
+
+	frame[0] = SESSION_BIN_TYPE_STATE;
+	size_t save_size = state_save(frame + 1);
+
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		subscriber_t *sub = &s->subscribers[i];
+		if (sub->options.binary) {
+			if (bin_buf == NULL) {
+				bin_buf = msgbuf_frame(frame, 1 + save_size, FRM_BIN);
+			}
+			if (bin_buf != NULL) {
+				outbox_send_buf(sub->client, bin_buf, METRICS_EVENT_SAV);
+			}
+			continue;
+		}
+		if (json_buf == NULL) {
+			base64singleline_encode_to(frame + 1, save_size, save_b64);
+			int msg_size = snprintf(msg, sizeof(msg), msg_template, save_b64);
+			json_buf = msgbuf_frame(msg, msg_size, FRM_TXT);
+		}
+		if (json_buf != NULL) {
+			outbox_send_buf(sub->client, json_buf, METRICS_EVENT_SAV);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	msgbuf_release(bin_buf);
+	msgbuf_release(json_buf);
+}
+
+/**
+ * @brief Send the result of a fast-forward to the subscribers of a session
+ *
+ * The ffw event holds the emulated duration, the screen and the state of the
+ * session, as they are at the end of the fast-forward.
+ */
+static void fast_forward_to_ws(session_t *s)
+{
+	uint8_t screen[SCREEN_SIZE];
+	uint8_t save[STATE_SIZE];
+	char msg_template[] = "{\"t\":\"ffw\",\"e\":{\"d\":%.3f,\"m\":\"%s\",\"i\":\"%s\",\"s\":\"%s\"}}";
+	char msg[sizeof(msg_template) + 32 + BASE64SINGLELINE_SIZE(SCREEN_MATRIX_SIZE) +
+		BASE64SINGLELINE_SIZE(SCREEN_ICON_SIZE) + BASE64SINGLELINE_SIZE(STATE_SIZE)];
+	char matrix_b64[BASE64SINGLELINE_SIZE(SCREEN_MATRIX_SIZE) + 1];
+	char icons_b64[BASE64SINGLELINE_SIZE(SCREEN_ICON_SIZE) + 1];
+	char save_b64[BASE64SINGLELINE_SIZE(STATE_SIZE) + 1];
+
+	screen_pack_screen(s->matrix_buffer, s->icon_buffer, screen);
+	base64singleline_encode_to(screen, SCREEN_MATRIX_SIZE, matrix_b64);
+	base64singleline_encode_to(screen + SCREEN_MATRIX_SIZE, SCREEN_ICON_SIZE, icons_b64);
+	size_t save_size = state_save(save);
+	base64singleline_encode_to(save, save_size, save_b64);
+
+	int msg_size = snprintf(msg, sizeof(msg), msg_template,
+		(double) s->ffw_done / TICK_FREQUENCY, matrix_b64, icons_b64, save_b64);
+	session_send(s, msg, msg_size, FRM_TXT, METRICS_EVENT_FFW);
+}
+
+static void state_load_from_ws(char *load_state_save_b64)
+{
+	size_t out_len;
+	uint8_t *save = base64_decode(
+		(unsigned char *) load_state_save_b64,
+		strlen(load_state_save_b64),
+		&out_len);
+	if (save == NULL || state_load(save, out_len)) {
+		LOGGER(LOGGER_WARN, LOGGER_CAT_SESSION, "lod event: invalid state save\n");
+	}
+	free(save);
+}
+
+/**
+ * @brief Resynchronize the TamaLIB time reference with the session deadline
+ *
+ * TamaLIB keeps a single time reference for the core. This is used after a
+ * session is swapped in, so that it resumes where its emulated time stopped
+ * rather than at the emulated time of the previous session.
+ */
+static void session_sync_timestamp(session_t *s)
+{
+	g_ts_override = true;
+	g_ts_override_value = s->deadline;
+	tamalib_set_exec_mode(s->exec_mode);
+	g_ts_override = false;
+}
+
+/**
+ * @brief Copy the display memory of the core to the session
+ *
+ * State saves leave the display memory out, but loading one replays it to the
+ * HAL (tamalib_refresh_hw), so it has to be swapped along with the snapshot.
+ */
+static void session_save_display(session_t *s)
+{
+	state_t *state = tamalib_get_state();
+	uint32_t i;
+
+	for (i = 0; i < MEM_DISPLAY1_SIZE; i++) {
+		s->display[i] = GET_DISP1_MEMORY(state->memory, i + MEM_DISPLAY1_ADDR);
+	}
+	for (i = 0; i < MEM_DISPLAY2_SIZE; i++) {
+		s->display[MEM_DISPLAY1_SIZE + i] = GET_DISP2_MEMORY(state->memory, i + MEM_DISPLAY2_ADDR);
+	}
+}
+
+/**
+ * @brief Copy the display memory of the session back to the core
+ */
+static void session_load_display(session_t *s)
+{
+	state_t *state = tamalib_get_state();
+	uint32_t i;
+
+	for (i = 0; i < MEM_DISPLAY1_SIZE; i++) {
+		SET_DISP1_MEMORY(state->memory, i + MEM_DISPLAY1_ADDR, s->display[i]);
+	}
+	for (i = 0; i < MEM_DISPLAY2_SIZE; i++) {
+		SET_DISP2_MEMORY(state->memory, i + MEM_DISPLAY2_ADDR, s->display[MEM_DISPLAY1_SIZE + i]);
+	}
+}
+
+/**
+ * @brief Load a session in the TamaLIB core
+ *
+ * The state of the session that was previously loaded is saved to its
+ * snapshot, and the state of s is restored from its own snapshot. Nothing is
+ * done if s is already loaded.
+ */
+static void session_activate(session_t *s)
+{
+	g_current = s;
+	if (g_loaded == s) {
+		return;
+	}
+
+	if (g_loaded != NULL) {
+		g_current = g_loaded;
+		if (g_loaded->state == NULL) {
+			g_loaded->state = malloc(STATE_SIZE);
+		}
+		if (g_loaded->state != NULL) {
+			state_save(g_loaded->state);
+		} else {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "Cannot save state (session %s)\n", g_loaded->id);
+		}
+		session_save_display(g_loaded);
+		g_current = s;
+	}
+	g_loaded = s;
+
+	if (s->state == NULL || g_loaded_program != s->rom->program) {
+		if (g_loaded_program != NULL) {
+			tamalib_release();
+		}
+		tamalib_init(s->rom->program, NULL, 1000000);
+		g_loaded_program = s->rom->program;
+	}
+	/* The input pins are not part of the state: they are set before it is
+	 * loaded, so that the interrupts raised by the level changes land in the
+	 * state that is then overwritten, rather than in s.
+	 */
+	tamalib_set_button(BTN_LEFT, s->btn_buffer[BTN_LEFT]);
+	tamalib_set_button(BTN_MIDDLE, s->btn_buffer[BTN_MIDDLE]);
+	tamalib_set_button(BTN_RIGHT, s->btn_buffer[BTN_RIGHT]);
+	tamalib_set_button(BTN_TAP, s->btn_buffer[BTN_TAP]);
+	if (s->state != NULL) {
+		session_load_display(s);
+		state_load(s->state, STATE_SIZE);
+	}
+	tamalib_set_speed(s->speed);
+	session_sync_timestamp(s);
+}
+
+/**
+ * @brief Account for emulated instructions in the metrics
+ */
+static void session_count_emulated(session_t *s, uint64_t instructions,
+	u32_t ticks)
+{
+	metrics_add(&g_metrics.instructions, instructions);
+	metrics_add(&g_metrics.ticks, ticks);
+	metrics_add(&s->ticks, ticks);
+}
+
+/**
+ * @brief Run the CPU of the loaded session until its tick counter reaches end
+ *
+ * This is the inner loop of the emulation, which only checks whether the CPU
+ * stopped. The HAL clock is frozen to the emulated time for the whole batch:
+ * at SPEED_UNLIMITED, TamaLIB reads it after every instruction, while the
+ * value is then not used.
+ *
+ * @param s loaded session
+ * @param end tick counter value to reach
+ * @param n incremented by the number of instructions run
+ * @return false if the CPU paused or halted before reaching end
+ */
+static bool session_run_batch(session_t *s, u32_t end, unsigned int *n)
+{
+	const u32_t *tick_counter = tamalib_get_state()->tick_counter;
+	bool running = true;
+	u32_t ticks;
+
+	g_ts_override = true;
+	g_ts_override_value = s->deadline;
+	while ((int32_t) (*tick_counter - end) < 0) {
+		ticks = *tick_counter;
+		tamalib_step();
+		if (*tick_counter == ticks) {
+			/* The CPU is paused, either by the client or after a step */
+			if (s->exec_mode != EXEC_MODE_RUN) {
+				s->exec_mode = EXEC_MODE_PAUSE;
+			}
+			running = false;
+			break;
+		}
+		(*n)++;
+		if (s->halted) {
+			running = false;
+			break;
+		}
+	}
+	g_ts_override = false;
+	return running;
+}
+
+/**
+ * @brief Run the CPU for a number of ticks, whatever the wall clock
+ *
+ * The emulated time then gets ahead of the wall clock, which the next quanta
+ * make up for at 1x and 10x.
+ */
+static void session_step_ticks(session_t *s, u32_t n_ticks)
+{
+	u32_t start = *(tamalib_get_state()->tick_counter);
+	unsigned int n = 0;
+
+	session_run_batch(s, start + n_ticks, &n);
+	session_count_emulated(s, n, *(tamalib_get_state()->tick_counter) - start);
+}
+
+/**
+ * @brief Record the queueing latency of an input, and track it until the next
+ * screen update
+ */
+static void session_track_input(session_t *s, const command_t *command)
+{
+	timestamp_t applied = scheduler_now();
+
+	stats_record(STATS_STAGE_QUEUE, applied - command->queued);
+	if (!s->input_pending && command->received) {
+		s->input_pending = true;
+		s->input_received = command->received;
+		s->input_applied = applied;
+	}
+}
+
+/**
+ * @brief Apply the actions requested by the session clients, in order
+ *
+ * This replaces the hal_handler of the single-emulator main loop. A button
+ * that is pressed and released before the session runs would not be seen by
+ * the emulated CPU: the CPU runs for SESSION_BUTTON_EDGE_TICKS between the two
+ * edges.
+ */
+static void session_handle_commands(session_t *s, timestamp_t now)
+{
+	bool btn_changed[4] = {0};
+	command_t command;
+
+	/* The actions that follow a fast-forward wait until it ends */
+	while (!s->end_action && !s->ffw_ticks &&
+		command_queue_pop(&s->commands, &command)) {
+		switch (command.type) {
+			case COMMAND_BUTTON:
+				if (btn_changed[command.button.button] &&
+					s->btn_buffer[command.button.button] != command.button.state) {
+					session_step_ticks(s, SESSION_BUTTON_EDGE_TICKS);
+					memset(btn_changed, 0, sizeof(btn_changed));
+				}
+				btn_changed[command.button.button] = true;
+				s->btn_buffer[command.button.button] = command.button.state;
+				tamalib_set_button(command.button.button, command.button.state);
+				session_track_input(s, &command);
+				break;
+
+			case COMMAND_EXEC_MODE:
+				s->exec_mode = command.exec_mode;
+				/* Restart the emulated time from now */
+				s->deadline = now;
+				s->clock_synced = false;
+				session_sync_timestamp(s);
+				break;
+
+			case COMMAND_SPEED:
+				s->speed = command.speed;
+				tamalib_set_speed(s->speed);
+				s->deadline = now;
+				s->clock_synced = false;
+				session_sync_timestamp(s);
+				break;
+
+			case COMMAND_SAVE:
+				state_save_to_ws(s);
+				break;
+
+			case COMMAND_LOAD:
+				state_load_from_ws(command.state_b64);
+				s->clock_synced = false;
+				command_free(&command);
+				break;
+
+			case COMMAND_FAST_FORWARD:
+				s->ffw_ticks = (uint64_t) command.duration * TICK_FREQUENCY;
+				s->ffw_done = 0;
+				if (!s->ffw_ticks) {
+					fast_forward_to_ws(s);
+				}
+				break;
+
+			case COMMAND_END:
+				s->end_action = true;
+				break;
+		}
+	}
+}
+
+/**
+ * @brief Set the reference of the emulated clock of the loaded session
+ *
+ * The emulated time is derived from the number of CPU clock cycles run since
+ * the reference, so that rounding errors do not accumulate over time. The
+ * reference is reset whenever the speed or the execution mode change, or a
+ * state is loaded.
+ *
+ * @param s loaded session
+ * @param now_us current time, in microseconds
+ */
+static void session_clock_sync(session_t *s, uint64_t now_us)
+{
+	s->clock_ref_us = now_us;
+	s->clock_ref_ticks = *(tamalib_get_state()->tick_counter);
+	s->clock_synced = true;
+}
+
+/**
+ * @brief Get the emulated time of the loaded session, rounded up
+ *
+ * The reference is moved forward by whole seconds of emulated time, which are
+ * a whole number of clock cycles, so that the difference with the 32-bit tick
+ * counter never wraps.
+ *
+ * @param s loaded session, with a synced clock and a limited speed
+ * @param ticks current value of the tick counter
+ * @return emulated time, in microseconds
+ */
+static uint64_t session_clock_now(session_t *s, u32_t ticks)
+{
+	const u32_t ticks_per_s = TICK_FREQUENCY * s->speed;
+	u32_t seconds = (ticks - s->clock_ref_ticks) / ticks_per_s;
+
+	s->clock_ref_ticks += seconds * ticks_per_s;
+	s->clock_ref_us += seconds * 1000000ULL;
+	return s->clock_ref_us +
+		((uint64_t) (ticks - s->clock_ref_ticks) * 1000000 + ticks_per_s - 1) / ticks_per_s;
+}
+
+/**
+ * @brief End the fast-forward of the loaded session
+ *
+ * The emulated time restarts from the wall clock, and the subscribers receive
+ * the result.
+ */
+static void session_end_fast_forward(session_t *s, timestamp_t now)
+{
+	s->ffw_ticks = 0;
+	s->deadline = now;
+	s->clock_synced = false;
+	session_sync_timestamp(s);
+	fast_forward_to_ws(s);
+}
+
+/**
+ * @brief Run the CPU until the session catches up with the wall clock, or
+ * for the next part of its fast-forward
+ *
+ * @param s loaded session
+ * @param now_us current time, in microseconds
+ */
+static void session_step(session_t *s, uint64_t now_us)
+{
+	const timestamp_t now = now_us;
+	const bool fast_forward = s->ffw_ticks != 0;
+	const bool paced = s->speed != SPEED_UNLIMITED && !fast_forward;
+	state_t *state = tamalib_get_state();
+	u32_t start = *(state->tick_counter);
+	u32_t due = 0;
+	unsigned int n = 0;
+	bool running = true;
+
+	if (fast_forward) {
+		due = start + (u32_t) (s->ffw_ticks < INT32_MAX ? s->ffw_ticks : INT32_MAX) - 1;
+	} else if (paced) {
+		if (!s->clock_synced) {
+			session_clock_sync(s, now_us);
+		}
+		/* The reference may be ahead of the wall clock after a button edge */
+		due = s->clock_ref_ticks + (u32_t) ((int64_t) (now_us - s->clock_ref_us) *
+			TICK_FREQUENCY * s->speed / 1000000);
+	}
+
+	/* The CPU runs in batches of SESSION_BATCH_TICKS, the last one ending
+	 * right after the due tick, and the wall clock is only read in between.
+	 */
+	for (;;) {
+		u32_t end = *(state->tick_counter) + SESSION_BATCH_TICKS;
+		const bool bounded = paced || fast_forward;
+
+		if (bounded && (int32_t) (end - due) > 0) {
+			end = due + 1;
+		}
+		running = session_run_batch(s, end, &n);
+		if (!running ||
+			(bounded && (int32_t) (*(state->tick_counter) - due) > 0) ||
+			(int32_t) (scheduler_now() - now) > SESSION_UNLIMITED_BUDGET_US) {
+			break;
+		}
+	}
+	const u32_t ticks = *(state->tick_counter) - start;
+	session_count_emulated(s, n, ticks);
+	if (fast_forward) {
+		s->ffw_done += ticks;
+		s->ffw_ticks -= (ticks < s->ffw_ticks) ? ticks : s->ffw_ticks;
+		/* A paused CPU ends the fast-forward early */
+		if (!s->ffw_ticks || (!running && !s->halted)) {
+			session_end_fast_forward(s, now);
+		}
+	} else if (paced) {
+		s->deadline = (timestamp_t) session_clock_now(s, *(state->tick_counter));
+	}
+}
+
+/**
+ * @brief Remove a session from the registry, after its emulation ended
+ */
+static void session_destroy(session_t *s)
+{
+	char msg[] = "{\"t\":\"end\",\"e\":{}}";
+	size_t size = 18;
+
+	session_send(s, msg, size, FRM_TXT, METRICS_EVENT_END);
+
+	pthread_mutex_lock(&g_registry_lock);
+	session_t **e = &g_sessions[hash_id(s->id) % SESSION_BUCKETS];
+	while (*e != s) {
+		e = &(*e)->next;
+	}
+	*e = s->next;
+	g_n_sessions--;
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < s->n_subscribers; i++) {
+		client_entry_t *c = *client_entry_find_locked(s->subscribers[i].client);
+		if (c != NULL && c->session == s) {
+			c->session = NULL;
+		}
+	}
+	s->n_subscribers = 0;
+	pthread_mutex_unlock(&s->lock);
+	pthread_mutex_unlock(&g_registry_lock);
+
+	store_remove(s->id);
+
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SESSION, "Ending emulation (session %s)\n", s->id);
+	session_release(s);
+}
+
+/**
+ * @brief Run a session for one quantum
+ *
+ * The session is loaded in the TamaLIB core, the pending client actions are
+ * applied, and the CPU runs until it catches up with the wall clock. The
+ * screen is then sent to the subscribers, after the core is released for the
+ * other sessions.
+ *
+ * @param s session to run, which must not be run by another thread
+ * @param now_us current time, in microseconds (see scheduler_now_us)
+ * @return true if the session is still running, false if its emulation ended
+ */
+bool session_run_quantum(session_t *s, uint64_t now_us)
+{
+	const timestamp_t now = now_us;
+	uint8_t autosave[STATE_SIZE];
+	bool autosave_due = false;
+	bool ended;
+
+	pthread_mutex_lock(&s->lock);
+	s->headless = (s->n_subscribers == 0);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&g_core_lock);
+	session_activate(s);
+	session_handle_commands(s, now);
+	if (!s->end_action && !s->halted) {
+		session_step(s, now_us);
+	}
+	ended = s->end_action || s->halted;
+	if (!ended && g_autosave_period &&
+		time(NULL) - s->last_autosave >= g_autosave_period) {
+		state_save(autosave);
+		s->last_autosave = time(NULL);
+		autosave_due = true;
+	}
+	if (ended && g_loaded == s) {
+		g_loaded = NULL;
+		g_loaded_program = NULL;
+		tamalib_release();
+	}
+	g_current = NULL;
+	pthread_mutex_unlock(&g_core_lock);
+
+	if (ended) {
+		session_destroy(s);
+		return false;
+	}
+
+	if (autosave_due) {
+		store_put_state(s->id, autosave, STATE_SIZE);
+	}
+
+	metrics_add(&g_metrics.quanta, 1);
+	if (s->speed != SPEED_UNLIMITED && s->exec_mode == EXEC_MODE_RUN &&
+		!s->ffw_ticks && (int32_t) (now - s->deadline) > 0) {
+		atomic_store_explicit(&s->lag_us, now - s->deadline, memory_order_relaxed);
+	} else {
+		atomic_store_explicit(&s->lag_us, 0, memory_order_relaxed);
+	}
+
+	/* Inputs of headless sessions, or that did not change the screen, are not
+	 * tracked further
+	 */
+	if (s->input_pending && (s->headless ||
+		(int32_t) (now - s->input_received) > SESSION_INPUT_TIMEOUT_US)) {
+		s->input_pending = false;
+	}
+	if (!s->headless && !s->ffw_ticks) {
+		update_screen(s, now);
+	}
+
+	/* A session that did not catch up with the wall clock within its budget
+	 * is rescheduled immediately, after the sessions that are due.
+	 */
+	const bool behind = s->speed == SPEED_UNLIMITED || s->ffw_ticks ||
+		(int32_t) (s->deadline - now) <= 0;
+	if (behind && s->exec_mode != EXEC_MODE_PAUSE) {
+		s->next_run = now_us;
+	} else if (s->headless) {
+		s->next_run = now_us + SESSION_HEADLESS_PERIOD_US;
+	} else {
+		s->next_run = now_us + 1000000 / SESSION_FRAMERATE;
+	}
+	return true;
+}
+
+/**
+ * @brief Register the session HAL in TamaLIB
+ *
+ * This must be called once, before any session is run.
+ */
+void session_init(void)
+{
+	tamalib_register_hal(&hal);
+}
@@ -0,0 +1,217 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tamalib/tamalib.h"
+
+#include "command.h"
+#include "reactor.h"
+#include "romcache.h"
+#include "screen.h"
+
+#define WS_PORT 			8080
+#define FRM_TXT  1
+#define FRM_BIN  2
+#define FRM_CLSE 8
+#define FRM_FIN 128
+#define FRM_MSK 128
+
+#define SESSION_BIN_TYPE_STATE 0x04
+// Type of the binary frames that contain a state save (see state.h), sent to
+// binary clients in response to sav events.
+
+#define SESSION_ID_SIZE 33
+// Maximum length of a session ID, including the string terminator. IDs are
+// restricted to [A-Za-z0-9_-] so that they can safely be used in file names.
+
+#define SESSION_MAX 4096
+// Maximum number of concurrent sessions (i.e. emulators) hosted by the server.
+
+#define SESSION_KEYFRAME_PERIOD_US 5000000
+// Minimum interval between two screen keyframes, for clients that receive
+// screen updates as deltas.
+
+#define SESSION_AUTOSAVE_PERIOD 60
+// Default interval between two autosaves of each session to the store, in
+// seconds.
+
+#define SESSION_FRAMERATE 30
+// Number of times per second each session is scheduled. Every time a session
+// is scheduled (a quantum), its CPU runs until it catches up with the wall
+// clock, and its screen is sent to its subscribers. This is also the maximum
+// frame rate of the screen updates sent to a client.
+
+#define SESSION_HEADLESS_PERIOD_US 1000000
+// Interval between two quanta of a headless session, i.e. a session without
+// subscribers. Its CPU then runs in bursts, catching up with the wall clock
+// once per period instead of SESSION_FRAMERATE times per second.
+
+#define SESSION_BUTTON_EDGE_TICKS (TICK_FREQUENCY / 20)
+// Emulated time between two edges of the same button applied in a single
+// quantum (e.g. a press and its release), so that the CPU sees both.
+
+#define SESSION_INPUT_TIMEOUT_US 1000000
+// Time after which an input that did not result in a screen update is no
+// longer tracked by the latency statistics (see stats.h).
+
+#define SESSION_LOG_MAX_SIZE 256
+// Maximum size of a TamaLIB log message, including the string terminator.
+// Longer messages are truncated.
+
+#define SESSION_LOG_RATE 10
+#define SESSION_LOG_BURST 20
+// Maximum number of log events sent per second by a session, and in a burst.
+// Log messages above this rate are not sent to the clients.
+
+#define SESSION_FFW_MAX_S (7 * 24 * 3600)
+// Maximum emulated duration of a fast-forward, in seconds. A fast-forward
+// runs at full speed, in quanta of SESSION_UNLIMITED_BUDGET_US like a session
+// at SPEED_UNLIMITED, so that it does not hold the core.
+
+#define SESSION_FRAME_TOLERANCE_US 1000
+// Scheduling jitter tolerated when deciding if a client with a frame rate
+// cap is due for a screen update.
+
+typedef enum {
+	SPEED_UNLIMITED = 0,
+	SPEED_1X = 1,
+	SPEED_10X = 10,
+} emulation_speed_t;
+
+/**
+ * @brief Protocol options of a client, set with the cfg event
+ */
+typedef struct {
+	bool binary;				// Send screen updates as binary frames
+	bool delta;					// Send screen updates as deltas
+	uint8_t max_fps;			// Screen updates per second, 0 for SESSION_FRAMERATE
+	bool logs;					// Receive the log events of the session
+} client_options_t;
+
+typedef struct {
+	ws_cli_conn_t client;
+	client_options_t options;
+	bool needs_keyframe;
+	uint32_t screen_seq;		// Sequence number of the last screen sent
+	timestamp_t last_frame;		// When the last screen was sent
+} subscriber_t;
+
+/**
+ * @brief An emulator instance, and the clients subscribed to it
+ *
+ * TamaLIB keeps the emulated CPU in global variables, so that only one
+ * session can be loaded in the core at a time. The state of the other sessions
+ * is kept in their `state` snapshot, and swapped in when they are scheduled.
+ */
+typedef struct session {
+	char id[SESSION_ID_SIZE];
+	atomic_uint refcount;
+	pthread_mutex_t lock;		// Guards subscribers
+
+	/* Emulator context */
+	rom_t *rom;					// Program, shared with other sessions
+	uint8_t *state;				// Snapshot of the core while swapped out (STATE_SIZE bytes)
+	u4_t display[MEM_DISPLAY1_SIZE + MEM_DISPLAY2_SIZE];	// Display memory while swapped out, not part of the snapshot
+	timestamp_t deadline;		// Emulated time, reached at the end of the last quantum
+	uint64_t next_run;			// When the session should next be scheduled (see scheduler_now_us)
+	uint64_t clock_ref_us;		// Emulated clock reference: wall time...
+	u32_t clock_ref_ticks;		// ... at which the CPU had run that many clock cycles
+	bool clock_synced;			// The emulated clock reference is valid
+	long heap_index;			// Position in the scheduler heap, or -1
+	bool wake_pending;			// Reschedule immediately after this quantum
+	u8_t speed;
+	exec_mode_t exec_mode;
+	bool halted;
+	bool headless;				// No subscribers during the current quantum
+	uint64_t ffw_ticks;			// Clock cycles left to run by the current fast-forward
+	uint64_t ffw_done;			// Clock cycles run by the current fast-forward
+	time_t last_autosave;		// When the session was last saved to the store
+
+	/* HAL buffers */
+	u32_t current_freq; // in dHz
+	unsigned int sin_pos;
+	bool_t is_audio_playing;
+	bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH];
+	bool_t icon_buffer[ICON_NUM];
+	uint8_t previous_screen[SCREEN_SIZE];	// Last packed screen sent
+	uint32_t screen_seq;		// Sequence number of previous_screen
+	timestamp_t last_keyframe;
+	bool screen_dirty;			// hal_update_screen was called since the last update
+	uint32_t log_tokens;		// Log events that can be sent (see SESSION_LOG_RATE)
+	timestamp_t log_refill;		// When log_tokens was last refilled
+
+	/* Client actions */
+	command_queue_t commands;	// Pending actions, in order
+	bool_t btn_buffer[4];		// Button state, as applied to the core
+	bool end_action;
+
+	/* Input latency, from the oldest input not followed by a screen update */
+	bool input_pending;
+	timestamp_t input_received;
+	timestamp_t input_applied;
+
+	/* Metrics, read by the metrics thread */
+	atomic_uint_fast64_t ticks;	// CPU clock cycles emulated
+	atomic_uint_fast32_t lag_us;	// Delay of the emulated time behind the wall clock
+
+	/* Subscribed clients */
+	subscriber_t *subscribers;
+	size_t n_subscribers;
+	size_t subscribers_size;
+
+	struct session *next;		// Next session in its hash bucket
+} session_t;
+
+session_t * session_create(const char *id, rom_t *rom);
+int session_restore(const char *id, rom_t *rom, const uint8_t *state,
+	size_t state_size);
+session_t * session_find(const char *id);
+session_t * session_of_client(ws_cli_conn_t client);
+void session_foreach(void (*callback)(session_t *s, void *arg), void *arg);
+void session_release(session_t *s);
+
+int session_subscribe(session_t *s, ws_cli_conn_t client);
+void session_unsubscribe(ws_cli_conn_t client);
+void session_configure_client(ws_cli_conn_t client,
+	const client_options_t *options);
+void session_request_keyframe(ws_cli_conn_t client);
+
+int session_set_button(session_t *s, button_t btn, btn_state_t state);
+int session_set_exec_mode(session_t *s, exec_mode_t mode);
+int session_set_speed(session_t *s, u8_t speed);
+int session_request_end(session_t *s);
+int session_request_save(session_t *s);
+int session_request_load(session_t *s, const char *state_b64);
+int session_fast_forward(session_t *s, uint32_t duration);
+
+bool session_is_valid_id(const char *id);
+
+void session_set_autosave_period(unsigned int period);
+void session_init(void);
+bool session_run_quantum(session_t *s, uint64_t now_us);
+
+#endif /* _SESSION_H_ */
@@ -45,17 +45,26 @@
 
 #include "tamalib/tamalib.h"
 
+#include "logger.h"
+#include "state.h"
+
 #define STATE_FILE_MAGIC				"TLST"
-#define STATE_FILE_VERSION				3
+#define STATE_FILE_VERSION				4
+#define STATE_FILE_VERSION_V3			3
 
 
-unsigned char * state_save(size_t *out_len)
+/**
+ * @brief Save the state of the TamaLIB core
+ *
+ * @param save buffer of at least STATE_SIZE bytes, to which the state is
+ * written
+ * @return the size of the state save, i.e. STATE_SIZE
+ */
+size_t state_save(uint8_t save[STATE_SIZE])
 {
 	state_t *state;
 	uint32_t num = 0;
 	uint32_t i;
-	size_t save_size = 63 + INT_SLOT_NUM * 3 + MEM_RAM_SIZE + MEM_IO_SIZE;
-	uint8_t * save = (uint8_t*)malloc(save_size);
 
 	state = tamalib_get_state();
 
@@ -174,11 +183,13 @@ unsigned char * state_save(size_t *out_len)
 	save[num+3] = (*(state->call_depth) >> 24) & 0xFF;
 	num += 4;
 
+	/* Since version 4, the factor flag and mask registers of each interrupt
+	 * are packed in a single byte, and so are pairs of memory nibbles (the
+	 * first nibble in the low bits).
+	 */
 	for (i = 0; i < INT_SLOT_NUM; i++) {
-		save[num] = state->interrupts[i].factor_flag_reg & 0xF;
-		num += 1;
-
-		save[num] = state->interrupts[i].mask_reg & 0xF;
+		save[num] = (state->interrupts[i].factor_flag_reg & 0xF) |
+			((state->interrupts[i].mask_reg & 0xF) << 4);
 		num += 1;
 
 		save[num] = state->interrupts[i].triggered & 0x1;
@@ -186,26 +197,39 @@ unsigned char * state_save(size_t *out_len)
 	}
 
 	/* First 640 half bytes correspond to the RAM */
-	for (i = 0; i < MEM_RAM_SIZE; i++) {
-		save[num] = GET_RAM_MEMORY(state->memory, i + MEM_RAM_ADDR) & 0xF;
+	for (i = 0; i < MEM_RAM_SIZE; i += 2) {
+		save[num] = (GET_RAM_MEMORY(state->memory, i + MEM_RAM_ADDR) & 0xF) |
+			((GET_RAM_MEMORY(state->memory, i + 1 + MEM_RAM_ADDR) & 0xF) << 4);
 		num += 1;
 	}
 
 	/* I/Os are from 0xF00 to 0xF7F */
-	for (i = 0; i < MEM_IO_SIZE; i++) {
-		save[num] = GET_IO_MEMORY(state->memory, i + MEM_IO_ADDR) & 0xF;
+	for (i = 0; i < MEM_IO_SIZE; i += 2) {
+		save[num] = (GET_IO_MEMORY(state->memory, i + MEM_IO_ADDR) & 0xF) |
+			((GET_IO_MEMORY(state->memory, i + 1 + MEM_IO_ADDR) & 0xF) << 4);
 		num += 1;
 	}
 
-	*out_len = save_size;
-	return save;
+	return num;
 }
 
-void state_load(uint8_t *save)
+/**
+ * @brief Load a state save in the TamaLIB core
+ *
+ * Both version 4 saves, as written by state_save, and version 3 saves, with
+ * one byte per nibble, are accepted.
+ *
+ * @param save state save
+ * @param size size of the state save
+ * @return 0 on success, 1 if the save is invalid (the core is then left
+ * untouched)
+ */
+int state_load(const uint8_t *save, size_t size)
 {
 	state_t *state;
 	uint32_t num = 0;
 	uint32_t i;
+	uint8_t version;
 
 	state = tamalib_get_state();
 
@@ -213,17 +237,22 @@ void state_load(uint8_t *save)
 	 * the state_t struct written as u8, u16 little-endian or u32
 	 * little-endian following the struct order
 	 */
-	if (save[0] != (uint8_t) STATE_FILE_MAGIC[0] || save[1] != (uint8_t) STATE_FILE_MAGIC[1] ||
+	if (size < STATE_HEADER_SIZE ||
+		save[0] != (uint8_t) STATE_FILE_MAGIC[0] || save[1] != (uint8_t) STATE_FILE_MAGIC[1] ||
 		save[2] != (uint8_t) STATE_FILE_MAGIC[2] || save[3] != (uint8_t) STATE_FILE_MAGIC[3]) {
-		fprintf(stderr, "FATAL: Wrong state save magic!\n");
-		return;
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Wrong state save magic!\n");
+		return 1;
 	}
 	num += 4;
 
-	if (save[num] != STATE_FILE_VERSION) {
-		fprintf(stderr, "FATAL: Unsupported version %u (expected %u) in state save!\n", save[num], STATE_FILE_VERSION);
-		/* TODO: Handle migration at a point */
-		return;
+	version = save[num];
+	if (version != STATE_FILE_VERSION && version != STATE_FILE_VERSION_V3) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Unsupported version %u (expected %u) in state save!\n", version, STATE_FILE_VERSION);
+		return 1;
+	}
+	if (size != ((version == STATE_FILE_VERSION) ? STATE_SIZE : STATE_V3_SIZE)) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SESSION, "FATAL: Wrong size %zu for version %u state save!\n", size, version);
+		return 1;
 	}
 	num += 1;
 
@@ -293,32 +322,52 @@ void state_load(uint8_t *save)
 	*(state->call_depth) = save[num] | (save[num+1] << 8) | (save[num+2] << 16) | (save[num+3] << 24);
 	num += 4;
 
-	for (i = 0; i < INT_SLOT_NUM; i++) {
-		state->interrupts[i].factor_flag_reg = save[num] & 0xF;
-		num += 1;
-
-		state->interrupts[i].mask_reg = save[num] & 0xF;
-		num += 1;
-
-		state->interrupts[i].triggered = save[num] & 0x1;
-		num += 1;
-	}
-
-	/* First 640 half bytes correspond to the RAM */
-	for (i = 0; i < MEM_RAM_SIZE; i++) {
-		SET_RAM_MEMORY(state->memory, i + MEM_RAM_ADDR, save[num] & 0xF);
-		num += 1;
-	}
-
-	/* I/Os are from 0xF00 to 0xF7F */
-	for (i = 0; i < MEM_IO_SIZE; i++) {
-		SET_IO_MEMORY(state->memory, i + MEM_IO_ADDR, save[num] & 0xF);
-		num += 1;
-	}
-
-	if (num != (63 + INT_SLOT_NUM * 3 + MEM_RAM_SIZE + MEM_IO_SIZE)) {
-		fprintf(stderr, "FATAL: Failed to load state save!\n");
+	if (version == STATE_FILE_VERSION_V3) {
+		for (i = 0; i < INT_SLOT_NUM; i++) {
+			state->interrupts[i].factor_flag_reg = save[num] & 0xF;
+			num += 1;
+
+			state->interrupts[i].mask_reg = save[num] & 0xF;
+			num += 1;
+
+			state->interrupts[i].triggered = save[num] & 0x1;
+			num += 1;
+		}
+
+		/* First 640 half bytes correspond to the RAM */
+		for (i = 0; i < MEM_RAM_SIZE; i++) {
+			SET_RAM_MEMORY(state->memory, i + MEM_RAM_ADDR, save[num] & 0xF);
+			num += 1;
+		}
+
+		/* I/Os are from 0xF00 to 0xF7F */
+		for (i = 0; i < MEM_IO_SIZE; i++) {
+			SET_IO_MEMORY(state->memory, i + MEM_IO_ADDR, save[num] & 0xF);
+			num += 1;
+		}
+	} else {
+		for (i = 0; i < INT_SLOT_NUM; i++) {
+			state->interrupts[i].factor_flag_reg = save[num] & 0xF;
+			state->interrupts[i].mask_reg = save[num] >> 4;
+			num += 1;
+
+			state->interrupts[i].triggered = save[num] & 0x1;
+			num += 1;
+		}
+
+		for (i = 0; i < MEM_RAM_SIZE; i += 2) {
+			SET_RAM_MEMORY(state->memory, i + MEM_RAM_ADDR, save[num] & 0xF);
+			SET_RAM_MEMORY(state->memory, i + 1 + MEM_RAM_ADDR, save[num] >> 4);
+			num += 1;
+		}
+
+		for (i = 0; i < MEM_IO_SIZE; i += 2) {
+			SET_IO_MEMORY(state->memory, i + MEM_IO_ADDR, save[num] & 0xF);
+			SET_IO_MEMORY(state->memory, i + 1 + MEM_IO_ADDR, save[num] >> 4);
+			num += 1;
+		}
 	}
 
 	tamalib_refresh_hw();
+	return 0;
 }
@@ -42,7 +42,24 @@
 #ifndef _STATE_H_
 #define _STATE_H_
 
-uint8_t * state_save(size_t *out_len);
-void state_load(uint8_t *save);
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tamalib/tamalib.h"
+
+#define STATE_HEADER_SIZE 63
+// Size of the magic, version, registers and timers of a state save, which are
+// common to all versions.
+
+#define STATE_SIZE (STATE_HEADER_SIZE + INT_SLOT_NUM * 2 + MEM_RAM_SIZE / 2 + MEM_IO_SIZE / 2)
+// Size of a version 4 state save, as written by state_save. RAM and I/O
+// nibbles are packed two per byte.
+
+#define STATE_V3_SIZE (STATE_HEADER_SIZE + INT_SLOT_NUM * 3 + MEM_RAM_SIZE + MEM_IO_SIZE)
+// Size of a version 3 state save, with one byte per nibble. These saves can
+// still be loaded.
+
+size_t state_save(uint8_t save[STATE_SIZE]);
+int state_load(const uint8_t *save, size_t size);
 
 #endif /* _STATE_H_ */
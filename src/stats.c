@@ -0,0 +1,191 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Latency histograms, in the style of HdrHistogram: the buckets of a value
+ * are indexed by its magnitude (the position of its most significant bit),
+ * then linearly by its STATS_SUB_BUCKET_BITS most significant bits. Recording
+ * a value is a single atomic increment, so that the threads handling the
+ * clients and running the sessions never wait for each other.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define STATS_SUB_BUCKET_HALF (1 << (STATS_SUB_BUCKET_BITS - 1))
+
+typedef struct {
+	atomic_uint_fast64_t counts[STATS_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast32_t max;
+} stats_histogram_t;
+
+static const char * const g_stage_names[STATS_STAGE_NUM] = {
+	[STATS_STAGE_PARSE] = "parse",
+	[STATS_STAGE_QUEUE] = "queue",
+	[STATS_STAGE_EMULATION] = "emulation",
+	[STATS_STAGE_SEND] = "send",
+	[STATS_STAGE_TOTAL] = "total",
+};
+
+static stats_histogram_t g_histograms[STATS_STAGE_NUM];
+
+/* Arrival of the message being handled by the current thread */
+static _Thread_local timestamp_t g_arrival = 0;
+
+static size_t stats_bucket(uint32_t v)
+{
+	if (v < (1u << STATS_SUB_BUCKET_BITS)) {
+		return v;
+	}
+	unsigned int e = 32 - __builtin_clz(v) - STATS_SUB_BUCKET_BITS;
+	return e * STATS_SUB_BUCKET_HALF + (v >> e);
+}
+
+/**
+ * @brief Get the highest value recorded in a bucket
+ */
+static uint32_t stats_bucket_value(size_t b)
+{
+	if (b < (1u << STATS_SUB_BUCKET_BITS)) {
+		return b;
+	}
+	unsigned int e = b / STATS_SUB_BUCKET_HALF - 1;
+	uint64_t lowest = (uint64_t) (b - e * STATS_SUB_BUCKET_HALF) << e;
+	return lowest + ((uint64_t) 1 << e) - 1;
+}
+
+/**
+ * @brief Set the arrival timestamp of the message handled by the calling
+ * thread, which is attached to the inputs it queues
+ */
+void stats_set_arrival(timestamp_t ts)
+{
+	g_arrival = ts;
+}
+
+timestamp_t stats_get_arrival(void)
+{
+	return g_arrival;
+}
+
+/**
+ * @brief Record a latency
+ *
+ * @param stage stage of the latency
+ * @param us latency in µs
+ */
+void stats_record(stats_stage_t stage, uint32_t us)
+{
+	stats_histogram_t *h = &g_histograms[stage];
+
+	atomic_fetch_add_explicit(&h->counts[stats_bucket(us)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+	uint_fast32_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (us > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+const char * stats_stage_name(stats_stage_t stage)
+{
+	return g_stage_names[stage];
+}
+
+uint64_t stats_count(stats_stage_t stage)
+{
+	return atomic_load_explicit(&g_histograms[stage].count, memory_order_relaxed);
+}
+
+/**
+ * @brief Get the sum of the latencies of a stage, in µs
+ */
+uint64_t stats_sum(stats_stage_t stage)
+{
+	return atomic_load_explicit(&g_histograms[stage].sum, memory_order_relaxed);
+}
+
+uint32_t stats_max(stats_stage_t stage)
+{
+	return atomic_load_explicit(&g_histograms[stage].max, memory_order_relaxed);
+}
+
+/**
+ * @brief Get a percentile of the latencies of a stage
+ *
+ * The latencies recorded while the histogram is read may or may not be
+ * accounted for.
+ *
+ * @param stage stage of the latencies
+ * @param q quantile, between 0 and 1 (e.g. 0.99 for p99)
+ * @return the latency in µs, or 0 if none was recorded
+ */
+uint32_t stats_percentile(stats_stage_t stage, double q)
+{
+	stats_histogram_t *h = &g_histograms[stage];
+	uint64_t n = 0;
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint32_t max = stats_max(stage);
+
+	for (size_t b = 0; b < STATS_BUCKETS; b++) {
+		n += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+	}
+	if (n == 0) {
+		return 0;
+	}
+	rank = (uint64_t) (q * n);
+	if (rank < q * n || rank == 0) {
+		rank++;
+	}
+	for (size_t b = 0; b < STATS_BUCKETS; b++) {
+		seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+		if (seen >= rank) {
+			uint32_t v = stats_bucket_value(b);
+			return (v < max) ? v : max;
+		}
+	}
+	return max;
+}
+
+/**
+ * @brief Encode the latency percentiles as a sta event
+ *
+ * @param buf output buffer, of size STATS_JSON_MAX_SIZE at least
+ * @return the size of the event, without the string terminator
+ */
+size_t stats_encode_json(char *buf)
+{
+	size_t size = 0;
+
+	size += snprintf(buf + size, STATS_JSON_MAX_SIZE - size, "{\"t\":\"sta\",\"e\":{");
+	for (int i = 0; i < STATS_STAGE_NUM; i++) {
+		size += snprintf(buf + size, STATS_JSON_MAX_SIZE - size,
+			"%s\"%s\":{\"n\":%" PRIu64 ",\"p50\":%" PRIu32 ",\"p99\":%" PRIu32 ",\"p999\":%" PRIu32 ",\"max\":%" PRIu32 "}",
+			(i > 0) ? "," : "", g_stage_names[i], stats_count(i),
+			stats_percentile(i, 0.5), stats_percentile(i, 0.99),
+			stats_percentile(i, 0.999), stats_max(i));
+	}
+	size += snprintf(buf + size, STATS_JSON_MAX_SIZE - size, "}}");
+	return size;
+}
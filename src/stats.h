@@ -0,0 +1,63 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal_types.h"
+
+#define STATS_SUB_BUCKET_BITS 6
+// Precision of the latency histograms: values are recorded with a relative
+// error below 2^-(STATS_SUB_BUCKET_BITS - 1), i.e. about 3%.
+
+#define STATS_BUCKETS ((34 - STATS_SUB_BUCKET_BITS) << (STATS_SUB_BUCKET_BITS - 1))
+// Number of buckets of a histogram, covering all 32-bit values.
+
+#define STATS_JSON_MAX_SIZE 1024
+// Maximum size of the sta event sent by stats_encode_json.
+
+/**
+ * @brief Stages of the latency between the arrival of an input (a btn event)
+ * and the first screen update sent after it
+ */
+typedef enum {
+	STATS_STAGE_PARSE,			// Arrival to queued: logging, JSON parsing
+	STATS_STAGE_QUEUE,			// Queued to applied by the thread running the session
+	STATS_STAGE_EMULATION,		// Applied to screen update: emulation, waiting for a change
+	STATS_STAGE_SEND,			// Encoding and sending the screen update
+	STATS_STAGE_TOTAL,			// Arrival to screen update sent
+	STATS_STAGE_NUM,
+} stats_stage_t;
+
+void stats_set_arrival(timestamp_t ts);
+timestamp_t stats_get_arrival(void);
+
+void stats_record(stats_stage_t stage, uint32_t us);
+const char * stats_stage_name(stats_stage_t stage);
+uint64_t stats_count(stats_stage_t stage);
+uint64_t stats_sum(stats_stage_t stage);
+uint32_t stats_percentile(stats_stage_t stage, double q);
+uint32_t stats_max(stats_stage_t stage);
+
+size_t stats_encode_json(char *buf);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,1052 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/*
+ * On-disk session store. Each ROM is stored once in the store directory, as
+ * <hash>.rom, where hash is its ROM cache hash, and shared by all the sessions
+ * that run it. ROM files are written by a background I/O thread, so that the
+ * emulation never blocks on disk. Each file is written to a temporary file,
+ * which is renamed after it is synced, so that a crash never leaves a
+ * truncated file behind. ROM files are not removed when a session ends, since
+ * other sessions may run the same ROM, but when the store is next restored.
+ *
+ * The sessions are stored in a single memory-mapped file, the arena, made of
+ * fixed-size slots (state saves have a constant size). Each session owns one
+ * slot, which holds its ID, the hash of its ROM and its state save, and saving
+ * a session is a copy to its slot. The I/O thread syncs the arena to disk
+ * after each batch of saves.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "program.h"
+#include "session.h"
+#include "state.h"
+#include "store.h"
+
+#define STORE_ARENA_FILE "states.arena"
+#define STORE_ARENA_MAGIC "TWSA"
+#define STORE_ARENA_VERSION 2
+
+#define STORE_SLOT_BUCKETS (2 * STORE_ARENA_SLOTS)
+// Size of the open-addressing table mapping session IDs to arena slots.
+
+#define STORE_NAME_SIZE ROM_HASH_SIZE
+// Size of the names of the store files, without their extension: session IDs
+// or ROM hashes, the longest.
+
+typedef enum {
+	STORE_JOB_ROM,
+	STORE_JOB_STATE,			// Legacy <id>.sav files, only read and removed
+	STORE_JOB_REMOVE,
+} store_job_type_t;
+
+typedef struct store_job {
+	store_job_type_t type;
+	char name[STORE_NAME_SIZE];	// ROM hash for STORE_JOB_ROM, else session ID
+	uint8_t *data;
+	size_t size;
+	int fd;						// Temporary file, while the job is written
+	struct store_job *next;
+} store_job_t;
+
+static const char * const g_extensions[] = {
+	[STORE_JOB_ROM] = "rom",
+	[STORE_JOB_STATE] = "sav",
+};
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t n_slots;
+} store_arena_header_t;
+
+/* A slot holds two copies of the state save. The new save is written to the
+ * copy that is not current, which then becomes current, so that the slot
+ * always holds a complete save, even if the server crashes mid-copy.
+ */
+typedef struct {
+	char id[SESSION_ID_SIZE];	// Empty if the slot is free
+	char rom[ROM_HASH_SIZE];	// Hash of the session ROM, stored as <hash>.rom
+	uint8_t current;			// 0 if no state was saved, else 1 + index of the latest copy
+	uint8_t state[2][STATE_SIZE];
+} store_slot_t;
+
+/* Slots of version 1 arenas, which kept the ROM of each session in <id>.rom */
+typedef struct {
+	char id[SESSION_ID_SIZE];
+	uint8_t current;
+	uint8_t state[2][STATE_SIZE];
+} store_slot_v1_t;
+
+/* Session moved to the arena from a previous version of the store */
+typedef struct {
+	char id[SESSION_ID_SIZE];
+	char rom[ROM_HASH_SIZE];
+} store_migrated_t;
+
+/* Pending jobs, in FIFO order. g_store_lock also guards the arena. */
+static pthread_mutex_t g_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_store_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_store_idle_cond = PTHREAD_COND_INITIALIZER;
+static store_job_t *g_jobs_head = NULL;
+static store_job_t *g_jobs_tail = NULL;
+static bool g_store_busy = false;	// The I/O thread is running a batch
+
+static char g_dir[PATH_MAX] = {0};
+static bool g_enabled = false;
+
+/* Arena */
+static store_arena_header_t *g_arena = NULL;
+static size_t g_arena_size = 0;
+static store_slot_t *g_slots = NULL;
+static long g_slot_index[STORE_SLOT_BUCKETS];	// Slot of each ID, or -1
+static long g_free_slots[STORE_ARENA_SLOTS];
+static size_t g_n_free_slots = 0;
+static bool g_arena_dirty = false;
+
+static void store_path(char *path, const char *name, const char *ext,
+	bool tmp)
+{
+	snprintf(path, PATH_MAX, "%s/%s.%s%s", g_dir, name, ext, tmp ? ".tmp" : "");
+}
+
+static void store_job_free(store_job_t *job)
+{
+	free(job->data);
+	free(job);
+}
+
+static uint32_t store_hash(const char *id)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; *id; id++) {
+		h ^= (unsigned char) *id;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Mark the arena as modified, so that the I/O thread syncs it
+ *
+ * @note g_store_lock must be held.
+ */
+static void store_arena_dirty_locked(void)
+{
+	if (!g_arena_dirty) {
+		g_arena_dirty = true;
+		pthread_cond_signal(&g_store_cond);
+	}
+}
+
+/**
+ * @brief Find the bucket of an ID in g_slot_index
+ *
+ * @return the bucket holding the slot of id, or the empty bucket where it
+ * should be inserted
+ */
+static size_t store_slot_bucket(const char *id)
+{
+	size_t b = store_hash(id) % STORE_SLOT_BUCKETS;
+	while (g_slot_index[b] >= 0 && strcmp(g_slots[g_slot_index[b]].id, id) != 0) {
+		b = (b + 1) % STORE_SLOT_BUCKETS;
+	}
+	return b;
+}
+
+/**
+ * @brief Free the slot of an ID, if any
+ *
+ * @note g_store_lock must be held.
+ */
+static void store_slot_free_locked(const char *id)
+{
+	size_t b = store_slot_bucket(id);
+	long slot = g_slot_index[b];
+	if (slot < 0) {
+		return;
+	}
+	memset(&g_slots[slot], 0, offsetof(store_slot_t, state));
+	g_free_slots[g_n_free_slots++] = slot;
+	store_arena_dirty_locked();
+
+	/* Backward-shift deletion, to keep the probe sequences unbroken */
+	g_slot_index[b] = -1;
+	for (size_t i = (b + 1) % STORE_SLOT_BUCKETS; g_slot_index[i] >= 0; i = (i + 1) % STORE_SLOT_BUCKETS) {
+		long moved = g_slot_index[i];
+		g_slot_index[i] = -1;
+		g_slot_index[store_slot_bucket(g_slots[moved].id)] = moved;
+	}
+}
+
+/**
+ * @brief Get the slot of an ID, allocating it if needed
+ *
+ * @return the slot, or -1 if the arena is full
+ *
+ * @note g_store_lock must be held.
+ */
+static long store_slot_get_locked(const char *id)
+{
+	size_t b = store_slot_bucket(id);
+	if (g_slot_index[b] >= 0) {
+		return g_slot_index[b];
+	}
+	if (g_n_free_slots == 0) {
+		return -1;
+	}
+	long slot = g_free_slots[--g_n_free_slots];
+	memset(&g_slots[slot], 0, offsetof(store_slot_t, state));
+	strncpy(g_slots[slot].id, id, SESSION_ID_SIZE - 1);
+	g_slot_index[b] = slot;
+	store_arena_dirty_locked();
+	return slot;
+}
+
+/**
+ * @brief Convert a version 1 arena, whose slots have no ROM hash
+ *
+ * The hashes are filled in by store_restore, from the <id>.rom files of
+ * version 1 stores. The converted arena is written to a temporary file, which
+ * replaces the old one once synced.
+ *
+ * @param path arena file
+ * @param fd arena file, open for reading
+ * @param header header of the arena
+ * @return 0 on success, 1 on failure
+ */
+static int store_arena_upgrade(const char *path, int fd,
+	const store_arena_header_t *header)
+{
+	char tmp_path[PATH_MAX];
+	store_slot_v1_t old_slot;
+	store_slot_t slot;
+	store_arena_header_t new_header = *header;
+	int status = 1;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+	int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tmp_fd < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open %s: %s\n", tmp_path, strerror(errno));
+		return 1;
+	}
+	new_header.version = STORE_ARENA_VERSION;
+	new_header.slot_size = sizeof(store_slot_t);
+	if (pwrite(tmp_fd, &new_header, sizeof(new_header), 0) != sizeof(new_header)) {
+		goto end;
+	}
+	for (uint32_t i = 0; i < header->n_slots; i++) {
+		if (pread(fd, &old_slot, sizeof(old_slot), sizeof(*header) + (off_t) i * sizeof(old_slot)) != sizeof(old_slot)) {
+			goto end;
+		}
+		memset(&slot, 0, sizeof(slot));
+		memcpy(slot.id, old_slot.id, SESSION_ID_SIZE);
+		slot.current = old_slot.current;
+		memcpy(slot.state, old_slot.state, sizeof(slot.state));
+		if (pwrite(tmp_fd, &slot, sizeof(slot), sizeof(new_header) + (off_t) i * sizeof(slot)) != sizeof(slot)) {
+			goto end;
+		}
+	}
+	if (fsync(tmp_fd) != 0 || rename(tmp_path, path) != 0) {
+		goto end;
+	}
+	status = 0;
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Converted arena %s to version %d\n", path, STORE_ARENA_VERSION);
+
+	end:
+		if (status) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot convert arena %s: %s\n", path, strerror(errno));
+			unlink(tmp_path);
+		}
+		close(tmp_fd);
+		return status;
+}
+
+/**
+ * @brief Map the arena, creating, converting or growing it if needed
+ *
+ * @return 0 on success, 1 on failure
+ */
+static int store_arena_open(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	store_arena_header_t header;
+	int status = 0;
+
+	snprintf(path, PATH_MAX, "%s/%s", g_dir, STORE_ARENA_FILE);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open %s: %s\n", path, strerror(errno));
+		status = 1;
+		goto end;
+	}
+	if ((size_t) st.st_size >= sizeof(header) &&
+		pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header.magic, STORE_ARENA_MAGIC, 4) == 0 &&
+		header.version == 1 && header.slot_size == sizeof(store_slot_v1_t)) {
+		if (store_arena_upgrade(path, fd, &header)) {
+			status = 1;
+			goto end;
+		}
+		close(fd);
+		fd = open(path, O_RDWR);
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open %s: %s\n", path, strerror(errno));
+			status = 1;
+			goto end;
+		}
+	}
+	if ((size_t) st.st_size >= sizeof(header) &&
+		pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		(memcmp(header.magic, STORE_ARENA_MAGIC, 4) != 0 ||
+		 header.version != STORE_ARENA_VERSION ||
+		 header.slot_size != sizeof(store_slot_t) ||
+		 header.n_slots > STORE_ARENA_SLOTS)) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Incompatible arena %s\n", path);
+		status = 1;
+		goto end;
+	}
+
+	g_arena_size = sizeof(store_arena_header_t) + STORE_ARENA_SLOTS * sizeof(store_slot_t);
+	if ((size_t) st.st_size < g_arena_size && ftruncate(fd, g_arena_size) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot resize %s: %s\n", path, strerror(errno));
+		status = 1;
+		goto end;
+	}
+	g_arena = mmap(NULL, g_arena_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (g_arena == MAP_FAILED) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot map %s: %s\n", path, strerror(errno));
+		g_arena = NULL;
+		status = 1;
+		goto end;
+	}
+	memcpy(g_arena->magic, STORE_ARENA_MAGIC, 4);
+	g_arena->version = STORE_ARENA_VERSION;
+	g_arena->slot_size = sizeof(store_slot_t);
+	g_arena->n_slots = STORE_ARENA_SLOTS;
+	g_slots = (store_slot_t *) (g_arena + 1);
+
+	for (size_t b = 0; b < STORE_SLOT_BUCKETS; b++) {
+		g_slot_index[b] = -1;
+	}
+	/* Free slots are not written to, so that the pages of the arena are only
+	 * allocated on disk once used
+	 */
+	for (long slot = STORE_ARENA_SLOTS - 1; slot >= 0; slot--) {
+		if (g_slots[slot].id[0] == '\0') {
+			g_free_slots[g_n_free_slots++] = slot;
+			continue;
+		}
+		/* The arena may be corrupted: slots whose ID is invalid (like the
+		 * files of store_migrate) or already used are freed, so that they are
+		 * never restored
+		 */
+		g_slots[slot].id[SESSION_ID_SIZE - 1] = '\0';
+		g_slots[slot].rom[ROM_HASH_SIZE - 1] = '\0';
+		if (g_slots[slot].current > 2) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_SERVER, "Corrupted state in slot %ld of %s\n", slot, path);
+			g_slots[slot].current = 0;
+		}
+		if (!session_is_valid_id(g_slots[slot].id) ||
+			g_slot_index[store_slot_bucket(g_slots[slot].id)] >= 0) {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_SERVER, "Freeing corrupted slot %ld of %s\n", slot, path);
+			memset(&g_slots[slot], 0, offsetof(store_slot_t, state));
+			g_free_slots[g_n_free_slots++] = slot;
+		} else {
+			g_slot_index[store_slot_bucket(g_slots[slot].id)] = slot;
+		}
+	}
+
+	end:
+		if (fd >= 0) {
+			close(fd);
+		}
+		return status;
+}
+
+/**
+ * @brief Write the data of a job to its temporary file, without syncing it
+ *
+ * @return 0 on success, 1 on failure
+ */
+static int store_job_write(store_job_t *job)
+{
+	char path[PATH_MAX];
+	size_t written = 0;
+
+	store_path(path, job->name, g_extensions[job->type], true);
+	job->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (job->fd < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	while (written < job->size) {
+		ssize_t n = write(job->fd, job->data + written, job->size - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot write %s: %s\n", path, strerror(errno));
+			close(job->fd);
+			job->fd = -1;
+			unlink(path);
+			return 1;
+		}
+		written += n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Remove the files of a session written by previous versions of the
+ * store, if any
+ */
+static void store_job_remove(store_job_t *job)
+{
+	char path[PATH_MAX];
+
+	store_path(path, job->name, g_extensions[STORE_JOB_STATE], false);
+	unlink(path);
+	store_path(path, job->name, g_extensions[STORE_JOB_ROM], false);
+	unlink(path);
+}
+
+/**
+ * @brief Run a batch of jobs
+ *
+ * The files of the batch are all written before any of them is synced, so
+ * that the disk can sync them together. Each file is renamed once synced, and
+ * the directory is synced once for the whole batch.
+ */
+static void store_run_batch(store_job_t *jobs)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	store_job_t *job;
+
+	/* Removals first: a pending write for the same session was queued after
+	 * the removal (see store_remove).
+	 */
+	for (job = jobs; job != NULL; job = job->next) {
+		job->fd = -1;
+		if (job->type == STORE_JOB_REMOVE) {
+			store_job_remove(job);
+		}
+	}
+
+	for (job = jobs; job != NULL; job = job->next) {
+		if (job->type != STORE_JOB_REMOVE) {
+			store_job_write(job);
+		}
+	}
+
+	for (job = jobs; job != NULL; job = job->next) {
+		if (job->fd < 0) {
+			continue;
+		}
+		store_path(tmp_path, job->name, g_extensions[job->type], true);
+		store_path(path, job->name, g_extensions[job->type], false);
+		if (fsync(job->fd) != 0 || close(job->fd) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot sync %s: %s\n", tmp_path, strerror(errno));
+			unlink(tmp_path);
+			continue;
+		}
+		if (rename(tmp_path, path) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot rename %s: %s\n", tmp_path, strerror(errno));
+			unlink(tmp_path);
+		}
+	}
+
+	int dir_fd = open(g_dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	while (jobs != NULL) {
+		job = jobs;
+		jobs = jobs->next;
+		store_job_free(job);
+	}
+}
+
+static void * store_thread(void *arg)
+{
+	((void)arg);
+
+	for (;;) {
+		pthread_mutex_lock(&g_store_lock);
+		while (g_jobs_head == NULL && !g_arena_dirty) {
+			pthread_cond_wait(&g_store_cond, &g_store_lock);
+		}
+		g_store_busy = true;
+		pthread_mutex_unlock(&g_store_lock);
+
+		usleep(STORE_BATCH_DELAY_US);
+
+		pthread_mutex_lock(&g_store_lock);
+		store_job_t *jobs = g_jobs_head;
+		g_jobs_head = g_jobs_tail = NULL;
+		bool arena_dirty = g_arena_dirty;
+		g_arena_dirty = false;
+		pthread_mutex_unlock(&g_store_lock);
+
+		store_run_batch(jobs);
+		if (arena_dirty && msync(g_arena, g_arena_size, MS_SYNC) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot sync arena: %s\n", strerror(errno));
+		}
+
+		pthread_mutex_lock(&g_store_lock);
+		g_store_busy = false;
+		pthread_cond_broadcast(&g_store_idle_cond);
+		pthread_mutex_unlock(&g_store_lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Create a job
+ *
+ * @param data data to write, owned by the job
+ * @return the job, or NULL on failure
+ */
+static store_job_t * store_job_new(store_job_type_t type, const char *name,
+	uint8_t *data, size_t size)
+{
+	store_job_t *job = calloc(1, sizeof(store_job_t));
+	if (job == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot queue store job (%s)\n", name);
+		free(data);
+		return NULL;
+	}
+	job->type = type;
+	strncpy(job->name, name, STORE_NAME_SIZE - 1);
+	job->data = data;
+	job->size = size;
+	job->fd = -1;
+	return job;
+}
+
+/**
+ * @brief Queue a job
+ *
+ * @note g_store_lock must be held.
+ */
+static void store_push_locked(store_job_t *job)
+{
+	job->next = NULL;
+	if (g_jobs_tail != NULL) {
+		g_jobs_tail->next = job;
+	} else {
+		g_jobs_head = job;
+	}
+	g_jobs_tail = job;
+	pthread_cond_signal(&g_store_cond);
+}
+
+/**
+ * @brief Queue a job created by store_job_new, if not NULL
+ */
+static void store_push(store_job_t *job)
+{
+	if (job == NULL) {
+		return;
+	}
+	const store_job_type_t type = job->type;
+	const char *name = job->name;
+
+	pthread_mutex_lock(&g_store_lock);
+	if (type == STORE_JOB_ROM) {
+		/* The ROM may already be queued for another session */
+		for (store_job_t *pending = g_jobs_head; pending != NULL; pending = pending->next) {
+			if (pending->type == STORE_JOB_ROM && strcmp(pending->name, name) == 0) {
+				pthread_mutex_unlock(&g_store_lock);
+				store_job_free(job);
+				return;
+			}
+		}
+	}
+	if (type == STORE_JOB_REMOVE) {
+		store_slot_free_locked(name);
+		/* Drop the pending writes of the session */
+		store_job_t **e = &g_jobs_head;
+		g_jobs_tail = NULL;
+		while (*e != NULL) {
+			if (strcmp((*e)->name, name) == 0) {
+				store_job_t *removed = *e;
+				*e = removed->next;
+				store_job_free(removed);
+			} else {
+				g_jobs_tail = *e;
+				e = &(*e)->next;
+			}
+		}
+	}
+	store_push_locked(job);
+	pthread_mutex_unlock(&g_store_lock);
+}
+
+/**
+ * @brief Open the store and start its I/O thread
+ *
+ * @param dir store directory, created if it does not exist
+ * @return 0 on success, 1 on failure
+ */
+int store_init(const char *dir)
+{
+	pthread_t thread;
+
+	if (strlen(dir) >= PATH_MAX - STORE_NAME_SIZE - 16) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Store directory path is too long\n");
+		return 1;
+	}
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot create store directory %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	strcpy(g_dir, dir);
+	if (store_arena_open()) {
+		return 1;
+	}
+
+	if (pthread_create(&thread, NULL, &store_thread, NULL)) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot start store thread\n");
+		return 1;
+	}
+	pthread_detach(thread);
+	g_enabled = true;
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Using session store %s\n", g_dir);
+	return 0;
+}
+
+bool store_is_enabled(void)
+{
+	return g_enabled;
+}
+
+/**
+ * @brief Encode a ROM in a job writing its <hash>.rom file
+ *
+ * @return the job, or NULL on failure
+ */
+static store_job_t * store_rom_job(const rom_t *rom)
+{
+	uint8_t *data = malloc(2 * (size_t) rom->size);
+	if (data == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot store ROM %s\n", rom->hash);
+		return NULL;
+	}
+	program_save(rom->program, rom->size, data);
+	return store_job_new(STORE_JOB_ROM, rom->hash, data, 2 * (size_t) rom->size);
+}
+
+/**
+ * @brief Record the ROM of a session in the store
+ *
+ * The hash of the ROM is kept in the arena slot of the session. The ROM
+ * itself is only written if no other session stored it before.
+ */
+void store_put_rom(const char *id, const rom_t *rom)
+{
+	char path[PATH_MAX];
+
+	if (!g_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&g_store_lock);
+	long slot = store_slot_get_locked(id);
+	if (slot >= 0) {
+		strcpy(g_slots[slot].rom, rom->hash);
+		store_arena_dirty_locked();
+	}
+	pthread_mutex_unlock(&g_store_lock);
+	if (slot < 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot store session, the arena is full (session %s)\n", id);
+		return;
+	}
+
+	store_path(path, rom->hash, g_extensions[STORE_JOB_ROM], false);
+	if (access(path, F_OK) == 0) {
+		return;
+	}
+	store_push(store_rom_job(rom));
+}
+
+/**
+ * @brief Write the state save of a session to its arena slot
+ *
+ * The state is copied to the arena, and synced to disk later by the I/O
+ * thread.
+ */
+void store_put_state(const char *id, const uint8_t *state, size_t state_size)
+{
+	if (!g_enabled || state_size != STATE_SIZE) {
+		return;
+	}
+	pthread_mutex_lock(&g_store_lock);
+	long slot = store_slot_get_locked(id);
+	if (slot < 0) {
+		pthread_mutex_unlock(&g_store_lock);
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot store state, the arena is full (session %s)\n", id);
+		return;
+	}
+	store_slot_t *sl = &g_slots[slot];
+	uint8_t next = (sl->current == 1) ? 1 : 0;
+	memcpy(sl->state[next], state, STATE_SIZE);
+	atomic_thread_fence(memory_order_release);
+	sl->current = next + 1;
+	store_arena_dirty_locked();
+	pthread_mutex_unlock(&g_store_lock);
+}
+
+/**
+ * @brief Remove a session from the store
+ */
+void store_remove(const char *id)
+{
+	if (!g_enabled) {
+		return;
+	}
+	store_push(store_job_new(STORE_JOB_REMOVE, id, NULL, 0));
+}
+
+/**
+ * @brief Wait until the pending writes and state saves are on disk
+ */
+void store_flush(void)
+{
+	if (!g_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&g_store_lock);
+	while (g_jobs_head != NULL || g_arena_dirty || g_store_busy) {
+		pthread_cond_wait(&g_store_idle_cond, &g_store_lock);
+	}
+	pthread_mutex_unlock(&g_store_lock);
+}
+
+/**
+ * @brief Read a file from the store
+ *
+ * @return the content of the file, which must be freed by the caller, or NULL
+ * if it cannot be read
+ */
+static uint8_t * store_read(const char *path, size_t *size)
+{
+	struct stat st;
+	uint8_t *data = NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > STORE_MAX_FILE_SIZE) {
+		goto end;
+	}
+	data = malloc(st.st_size);
+	if (data == NULL) {
+		goto end;
+	}
+	*size = 0;
+	while (*size < (size_t) st.st_size) {
+		ssize_t n = read(fd, data + *size, st.st_size - *size);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			free(data);
+			data = NULL;
+			goto end;
+		}
+		*size += n;
+	}
+
+	end:
+		close(fd);
+		return data;
+}
+
+/**
+ * @brief Get a ROM of the store, from the ROM cache or from its <hash>.rom file
+ *
+ * @return the ROM, or NULL if it is missing or does not match its hash
+ *
+ * @note The caller must release the returned ROM with rom_release.
+ */
+static rom_t * store_load_rom(const char *hash)
+{
+	char path[PATH_MAX];
+
+	if (!rom_is_valid_hash(hash)) {
+		return NULL;
+	}
+	rom_t *rom = rom_cache_find(hash);
+	if (rom != NULL) {
+		return rom;
+	}
+	store_path(path, hash, g_extensions[STORE_JOB_ROM], false);
+	rom = rom_cache_load_file(path);
+	if (rom != NULL && strcmp(rom->hash, hash) != 0) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Corrupted ROM %s\n", path);
+		rom_release(rom);
+		return NULL;
+	}
+	return rom;
+}
+
+/**
+ * @brief Move the sessions of previous versions of the store to the arena
+ *
+ * Previous versions kept the ROM of each session in <id>.rom, and the oldest
+ * ones also its state save in <id>.sav. The ROMs are written once under their
+ * hash, the hashes and state saves are copied to the arena, and the old files
+ * are removed once all of it is on disk.
+ */
+static void store_migrate(void)
+{
+	char path[PATH_MAX];
+	char id[SESSION_ID_SIZE];
+	struct dirent *entry;
+	store_migrated_t *migrated = NULL;
+	size_t n_migrated = 0, migrated_size = 0;
+	store_job_t *jobs = NULL;
+
+	DIR *dir = opendir(g_dir);
+	if (dir == NULL) {
+		LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot open store directory %s: %s\n", g_dir, strerror(errno));
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		const char *ext = strrchr(entry->d_name, '.');
+		if (ext == NULL || strcmp(ext, ".rom") != 0 ||
+			ext - entry->d_name >= SESSION_ID_SIZE) {
+			continue;
+		}
+		memcpy(id, entry->d_name, ext - entry->d_name);
+		id[ext - entry->d_name] = '\0';
+		if (!session_is_valid_id(id)) {
+			continue;
+		}
+
+		if (n_migrated == migrated_size) {
+			size_t size = migrated_size ? 2 * migrated_size : 64;
+			store_migrated_t *m = realloc(migrated, size * sizeof(store_migrated_t));
+			if (m == NULL) {
+				LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot move session %s to the arena\n", id);
+				break;
+			}
+			migrated = m;
+			migrated_size = size;
+		}
+
+		size_t rom_size = 0;
+		store_path(path, id, g_extensions[STORE_JOB_ROM], false);
+		uint8_t *rom_data = store_read(path, &rom_size);
+		if (rom_data == NULL) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot read %s\n", path);
+			continue;
+		}
+		rom_t *rom = rom_cache_load(rom_data, rom_size);
+		free(rom_data);
+		if (rom == NULL) {
+			continue;
+		}
+
+		pthread_mutex_lock(&g_store_lock);
+		long slot = store_slot_get_locked(id);
+		bool has_state = false;
+		if (slot >= 0) {
+			strcpy(g_slots[slot].rom, rom->hash);
+			has_state = g_slots[slot].current != 0;
+		}
+		pthread_mutex_unlock(&g_store_lock);
+		if (slot < 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot move session %s, the arena is full\n", id);
+			rom_release(rom);
+			continue;
+		}
+
+		if (!has_state) {
+			size_t state_size = 0;
+			store_path(path, id, g_extensions[STORE_JOB_STATE], false);
+			uint8_t *state = store_read(path, &state_size);
+			if (state != NULL) {
+				store_put_state(id, state, state_size);
+				free(state);
+			}
+		}
+
+		bool queued = false;
+		for (store_job_t *job = jobs; job != NULL && !queued; job = job->next) {
+			queued = strcmp(job->name, rom->hash) == 0;
+		}
+		store_path(path, rom->hash, g_extensions[STORE_JOB_ROM], false);
+		if (!queued && access(path, F_OK) != 0) {
+			store_job_t *job = store_rom_job(rom);
+			if (job != NULL) {
+				job->next = jobs;
+				jobs = job;
+			}
+		}
+
+		strcpy(migrated[n_migrated].id, id);
+		strcpy(migrated[n_migrated].rom, rom->hash);
+		n_migrated++;
+		rom_release(rom);
+	}
+	closedir(dir);
+
+	if (n_migrated > 0) {
+		store_run_batch(jobs);
+		if (msync(g_arena, g_arena_size, MS_SYNC) != 0) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot sync arena: %s\n", strerror(errno));
+			n_migrated = 0;
+		}
+	}
+	for (size_t i = 0; i < n_migrated; i++) {
+		store_path(path, migrated[i].rom, g_extensions[STORE_JOB_ROM], false);
+		if (access(path, F_OK) != 0) {
+			continue;
+		}
+		store_path(path, migrated[i].id, g_extensions[STORE_JOB_STATE], false);
+		unlink(path);
+		store_path(path, migrated[i].id, g_extensions[STORE_JOB_ROM], false);
+		unlink(path);
+	}
+	if (n_migrated > 0) {
+		LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Moved %zu sessions to the arena\n", n_migrated);
+	}
+	free(migrated);
+}
+
+/**
+ * @brief Remove the ROM files that no session of the arena runs
+ */
+static void store_collect_roms(void)
+{
+	char path[PATH_MAX];
+	char hash[ROM_HASH_SIZE];
+	struct dirent *entry;
+
+	DIR *dir = opendir(g_dir);
+	if (dir == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		const char *ext = strrchr(entry->d_name, '.');
+		if (ext == NULL || strcmp(ext, ".rom") != 0 ||
+			ext - entry->d_name != ROM_HASH_SIZE - 1) {
+			continue;
+		}
+		memcpy(hash, entry->d_name, ROM_HASH_SIZE - 1);
+		hash[ROM_HASH_SIZE - 1] = '\0';
+		if (!rom_is_valid_hash(hash)) {
+			continue;
+		}
+
+		bool used = false;
+		pthread_mutex_lock(&g_store_lock);
+		for (long slot = 0; slot < STORE_ARENA_SLOTS && !used; slot++) {
+			used = g_slots[slot].id[0] != '\0' && strcmp(g_slots[slot].rom, hash) == 0;
+		}
+		pthread_mutex_unlock(&g_store_lock);
+		if (!used) {
+			store_path(path, hash, g_extensions[STORE_JOB_ROM], false);
+			unlink(path);
+			LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Removed unused ROM %s\n", hash);
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * @brief Restore the sessions of the store
+ *
+ * For each session of the arena, restore is called with its cached ROM and,
+ * if available, its latest state save. The sessions of previous versions of
+ * the store are first moved to the arena.
+ *
+ * The arena slots of sessions whose ROM is missing are freed. Sessions that
+ * cannot be restored, e.g. because SESSION_MAX sessions are already running,
+ * are kept in the store.
+ *
+ * @return the number of restored sessions
+ */
+unsigned int store_restore(store_restore_cb_t restore)
+{
+	uint8_t state[STATE_SIZE];
+	char id[SESSION_ID_SIZE];
+	char hash[ROM_HASH_SIZE];
+	unsigned int n = 0;
+
+	if (!g_enabled) {
+		return 0;
+	}
+	store_migrate();
+
+	for (long slot = 0; slot < STORE_ARENA_SLOTS; slot++) {
+		pthread_mutex_lock(&g_store_lock);
+		const store_slot_t *sl = &g_slots[slot];
+		strcpy(id, sl->id);
+		strcpy(hash, sl->rom);
+		const bool has_state = sl->current != 0;
+		if (has_state) {
+			memcpy(state, sl->state[sl->current - 1], STATE_SIZE);
+		}
+		pthread_mutex_unlock(&g_store_lock);
+		if (id[0] == '\0') {
+			continue;
+		}
+
+		rom_t *rom = store_load_rom(hash);
+		if (rom == NULL) {
+			LOGGER(LOGGER_ERROR, LOGGER_CAT_SERVER, "Cannot restore session %s: missing ROM\n", id);
+			pthread_mutex_lock(&g_store_lock);
+			store_slot_free_locked(id);
+			pthread_mutex_unlock(&g_store_lock);
+			continue;
+		}
+		if (restore(id, rom, has_state ? state : NULL, has_state ? STATE_SIZE : 0) == 0) {
+			n++;
+		} else {
+			LOGGER(LOGGER_WARN, LOGGER_CAT_SERVER, "Cannot restore session %s\n", id);
+		}
+		rom_release(rom);
+	}
+	store_collect_roms();
+
+	LOGGER(LOGGER_INFO, LOGGER_CAT_SERVER, "Restored %u sessions from %s\n", n, g_dir);
+	return n;
+}
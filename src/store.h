@@ -0,0 +1,54 @@
+/*
+ * Tama Websocket - Tamagotchi P1 emulator websocket server
+ *
+ * Copyright (C) 2025 Gabriel Pelouze <gabriel@pelouze.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal_types.h"
+#include "romcache.h"
+
+#define STORE_BATCH_DELAY_US 200000
+// Time the I/O thread waits after the first pending write, so that the writes
+// of other sessions can be synced to disk in the same batch.
+
+#define STORE_MAX_FILE_SIZE (1 << 20)
+// Maximum size of a file read from the store.
+
+#define STORE_ARENA_SLOTS 16384
+// Number of sessions the store can hold. It does not depend on SESSION_MAX:
+// sessions that cannot run are kept in the store until they can.
+
+typedef int (*store_restore_cb_t)(const char *id, rom_t *rom,
+	const uint8_t *state, size_t state_size);
+
+int store_init(const char *dir);
+bool store_is_enabled(void);
+
+void store_put_rom(const char *id, const rom_t *rom);
+void store_put_state(const char *id, const uint8_t *state, size_t state_size);
+void store_remove(const char *id);
+void store_flush(void);
+
+unsigned int store_restore(store_restore_cb_t restore);
+
+#endif /* _STORE_H_ */